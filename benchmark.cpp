@@ -0,0 +1,471 @@
+#include <filesystem>
+#include <iostream>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <cmath>
+#include <vector>
+#include <string>
+#include <functional>
+#include <opencv2/opencv.hpp>
+#include <opencv2/flann.hpp>
+#include "nanofractal.h"
+#include "opencv_fractal.h"
+#include "fractal_synth.h"
+
+// Microbenchmarks of each stage of the fractal marker detection at the five resolutions of the test images.
+//
+// Every benchmark runs some warm-up iterations (reported, but not used in the statistics) followed by the measured
+// repetitions. The setup of each repetition (e.g. copying the keypoints that kfilter modifies) is not measured.
+// If the test image of a resolution is not found, a synthetic scene (fractal_synth.h) is used instead.
+// On Linux, the hardware counters of the measured repetitions are also reported (IPC and misses per thousand
+// instructions) when perf_event_open is permitted. They count only the benchmark thread, not OpenCV's workers.
+// Then, the pose from the correspondences is timed against cv::solvePnP on synthetic scenes of known pose.
+// Finally, the accuracy of the subpixel refinement is compared with cv::cornerSubPix on synthetic scenes.
+//
+// Usage: benchmark [--data dir] [--prefix distortion] [--config FRACTAL_4L_6] [--warmup 3] [--reps 25] [--json out.json]
+
+struct BenchmarkResult {
+    std::string name;
+    std::string resolution;
+    int items = 0;                  // elements processed by one repetition (points, keypoints, queries...)
+    std::vector<double> warmupMs;
+    std::vector<double> samplesMs;
+    double medianMs = 0, p95Ms = 0, madMs = 0, minMs = 0, maxMs = 0;
+    nanofractal::HardwareCounters counters;  // sum of the measured repetitions
+};
+
+static double percentile(std::vector<double> v, double p) {
+    if (v.empty()) return 0;
+    std::sort(v.begin(), v.end());
+    double pos = p * (v.size() - 1);
+    size_t i = size_t(pos);
+    if (i + 1 >= v.size()) return v.back();
+    return v[i] + (pos - i) * (v[i + 1] - v[i]);
+}
+
+class Benchmark {
+public:
+    Benchmark(int warmup, int reps) : _warmup(warmup), _reps(reps) {}
+
+    bool countersAvailable() const { return nanofractal::PerfCounters::thisThread().available(); }
+
+    // setup runs before every repetition and is not measured
+    void run(const std::string& name, const std::string& resolution, int items,
+             const std::function<void()>& setup, const std::function<void()>& body) {
+        BenchmarkResult res;
+        res.name = name;
+        res.resolution = resolution;
+        res.items = items;
+        nanofractal::PerfCounters& counters = nanofractal::PerfCounters::thisThread();
+        for (int i = 0; i < _warmup + _reps; i++) {
+            if (setup) setup();
+            nanofractal::HardwareCounters c0 = counters.read();
+            auto start = std::chrono::high_resolution_clock::now();
+            body();
+            auto end = std::chrono::high_resolution_clock::now();
+            nanofractal::HardwareCounters c1 = counters.read();
+            double ms = std::chrono::duration<double, std::milli>(end - start).count();
+            if (i < _warmup) res.warmupMs.push_back(ms);
+            else {
+                res.samplesMs.push_back(ms);
+                res.counters += c1 - c0;
+            }
+        }
+        res.medianMs = percentile(res.samplesMs, 0.5);
+        res.p95Ms = percentile(res.samplesMs, 0.95);
+        std::vector<double> deviations;
+        for (double v : res.samplesMs) deviations.push_back(std::abs(v - res.medianMs));
+        res.madMs = percentile(deviations, 0.5);
+        res.minMs = *std::min_element(res.samplesMs.begin(), res.samplesMs.end());
+        res.maxMs = *std::max_element(res.samplesMs.begin(), res.samplesMs.end());
+
+        std::cout << std::left << std::setw(28) << name << std::setw(11) << resolution << std::right
+                  << std::setw(8) << items << std::fixed << std::setprecision(4)
+                  << std::setw(12) << (res.warmupMs.empty() ? 0. : res.warmupMs[0])
+                  << std::setw(12) << res.medianMs << std::setw(12) << res.p95Ms << std::setw(12) << res.madMs;
+        if (countersAvailable()) {
+            const auto& c = res.counters;
+            std::cout << std::setprecision(2) << std::setw(8) << c.ipc() << std::setw(10) << c.mpki(c.l1dMisses)
+                      << std::setw(10) << c.mpki(c.llcMisses) << std::setw(10) << c.mpki(c.branchMisses);
+        }
+        std::cout << std::endl;
+        _results.push_back(res);
+    }
+
+    void printHeader() const {
+        std::cout << std::left << std::setw(28) << "benchmark" << std::setw(11) << "resolution" << std::right
+                  << std::setw(8) << "items" << std::setw(12) << "first_ms" << std::setw(12) << "median_ms"
+                  << std::setw(12) << "p95_ms" << std::setw(12) << "mad_ms";
+        if (countersAvailable())
+            std::cout << std::setw(8) << "ipc" << std::setw(10) << "l1d_mpki" << std::setw(10) << "llc_mpki"
+                      << std::setw(10) << "br_mpki";
+        std::cout << std::endl;
+        if (!countersAvailable())
+            std::cout << "(hardware counters not available: " << nanofractal::PerfCounters::thisThread().error() << ")"
+                      << std::endl;
+    }
+
+    bool writeJson(const std::string& path, const std::string& config) const {
+        std::ofstream ofs(path);
+        if (!ofs.is_open()) return false;
+        auto list = [](const std::vector<double>& v) {
+            std::stringstream sstr;
+            sstr << "[";
+            for (size_t i = 0; i < v.size(); i++) sstr << (i ? "," : "") << v[i];
+            sstr << "]";
+            return sstr.str();
+        };
+        ofs << std::setprecision(6);
+        ofs << "{\n  \"config\": \"" << config << "\",\n  \"warmup\": " << _warmup << ",\n  \"reps\": " << _reps
+            << ",\n  \"opencv_threads\": " << cv::getNumThreads() << ",\n  \"benchmarks\": [\n";
+        for (size_t i = 0; i < _results.size(); i++) {
+            const auto& r = _results[i];
+            ofs << "    {\"name\": \"" << r.name << "\", \"resolution\": \"" << r.resolution << "\", \"items\": " << r.items
+                << ", \"median_ms\": " << r.medianMs << ", \"p95_ms\": " << r.p95Ms << ", \"mad_ms\": " << r.madMs
+                << ", \"min_ms\": " << r.minMs << ", \"max_ms\": " << r.maxMs;
+            if (countersAvailable()) {
+                const auto& c = r.counters;
+                ofs << ", \"counters\": {\"cycles\": " << c.cycles << ", \"instructions\": " << c.instructions
+                    << ", \"l1d_misses\": " << c.l1dMisses << ", \"llc_misses\": " << c.llcMisses
+                    << ", \"branch_misses\": " << c.branchMisses << ", \"ipc\": " << c.ipc()
+                    << ", \"l1d_mpki\": " << c.mpki(c.l1dMisses) << ", \"llc_mpki\": " << c.mpki(c.llcMisses)
+                    << ", \"branch_mpki\": " << c.mpki(c.branchMisses) << "}";
+            }
+            ofs << ", \"warmup_ms\": " << list(r.warmupMs) << ", \"samples_ms\": " << list(r.samplesMs) << "}"
+                << (i + 1 < _results.size() ? "," : "") << "\n";
+        }
+        ofs << "  ]\n}\n";
+        return true;
+    }
+
+private:
+    int _warmup, _reps;
+    std::vector<BenchmarkResult> _results;
+};
+
+// Samples the bits of a marker as the decoding stage does, returning the thresholded bit matrix
+static cv::Mat sampleBits(const cv::Mat& gray, const std::vector<cv::Point2f>& corners, int nbits) {
+    nanofractal::_private::Homographer hom(corners);
+    int nbitsWithBorder = sqrt(nbits) + 2;
+    cv::Mat bits(nbitsWithBorder, nbitsWithBorder, CV_8UC1);
+    int pixelSum = 0;
+    for (int r = 0; r < bits.rows; r++)
+        for (int c = 0; c < bits.cols; c++) {
+            auto pixelValue = uchar(0.5 + nanofractal::FractalMarkerDetector::getSubpixelValue(gray,
+                hom(cv::Point2f(float(c + 0.5) / float(bits.cols), float(r + 0.5) / float(bits.rows)))));
+            bits.at<uchar>(r, c) = pixelValue;
+            pixelSum += pixelValue;
+        }
+    double mean = double(pixelSum) / double(bits.cols * bits.rows);
+    cv::threshold(bits, bits, mean, 255, cv::THRESH_BINARY);
+    return bits;
+}
+
+static void benchmarkResolution(Benchmark& bench, const cv::Mat& image, const std::string& config) {
+    std::string resolution = std::to_string(image.cols) + "x" + std::to_string(image.rows);
+    cv::Mat gray;
+    if (image.channels() == 3) cv::cvtColor(image, gray, cv::COLOR_BGR2GRAY);
+    else gray = image;
+
+    nanofractal::FractalMarkerDetector detector;
+    detector.setParams(config);
+    const nanofractal::FractalMarkerSet& markerSet = detector.getFractalMarkerSet();
+
+    // whole detection, for reference
+    nanofractal::FractalDetectorWorkspace ws;
+    std::vector<cv::Point3f> p3d;
+    std::vector<cv::Point2f> p2d;
+    std::vector<nanofractal::FractalMarker> markers;
+    bench.run("nano_detect", resolution, 1, [&]() { p3d.clear(); p2d.clear(); },
+              [&]() { markers = detector.detect(image, p3d, p2d, ws); });
+    opencvfractal::FractalMarkerDetector cvDetector;
+    cvDetector.setParams(config);
+    opencvfractal::FractalDetectorWorkspace cvWs;
+    std::vector<cv::Point3f> cvP3d;
+    std::vector<cv::Point2f> cvP2d;
+    bench.run("opencv_detect", resolution, 1, [&]() { cvP3d.clear(); cvP2d.clear(); },
+              [&]() { cvDetector.detect(image, cvP3d, cvP2d, cvWs); });
+
+    // the same with a second configuration registered: the quads are extracted and sampled once for both
+    nanofractal::FractalMarkerDetector multiDetector;
+    multiDetector.setParams(config);
+    multiDetector.addMarkerSet(config == "FRACTAL_3L_6" ? "FRACTAL_5L_6" : "FRACTAL_3L_6");
+    nanofractal::FractalDetectorWorkspace multiWs;
+    std::vector<cv::Point3f> multiP3d;
+    std::vector<cv::Point2f> multiP2d;
+    bench.run("nano_detect_2sets", resolution, 1, [&]() { multiP3d.clear(); multiP2d.clear(); },
+              [&]() { multiDetector.detect(image, multiP3d, multiP2d, multiWs); });
+
+    if (image.channels() == 3)
+        bench.run("gray", resolution, image.total(), nullptr, [&]() { cv::cvtColor(image, ws.gray, cv::COLOR_BGR2GRAY); });
+
+    // decoding of the markers found: grid sampling and identification
+    if (!markers.empty()) {
+        int nSamples = 0;
+        for (const auto& m : markers) nSamples += m.nBits() + 4 * sqrt(m.nBits()) + 4;
+        bench.run("grid_sampling", resolution, nSamples, nullptr, [&]() {
+            for (const auto& m : markers) sampleBits(gray, m, m.nBits());
+        });
+        std::vector<cv::Mat> bits;
+        for (const auto& m : markers) bits.push_back(sampleBits(gray, m, m.nBits()));
+        bench.run("getMarkerId", resolution, bits.size() * markerSet.bits_ids.size(), nullptr, [&]() {
+            for (const auto& b : bits)
+                for (const auto& b_vm : markerSet.bits_ids) {
+                    if (b.rows != int(sqrt(b_vm.first)) + 2) continue;
+                    int nrotations = 0;
+                    nanofractal::FractalMarkerDetector::getMarkerId(b, nrotations, b_vm.second, markerSet);
+                }
+        });
+    } else
+        std::cout << "  no markers found at " << resolution << ": decoding and matching benchmarks skipped" << std::endl;
+
+    // keypoints
+    std::vector<cv::KeyPoint> fastKpoints, kpoints;
+    cv::Ptr<cv::FastFeatureDetector> fd = cv::FastFeatureDetector::create();
+    bench.run("fast", resolution, gray.total(), nullptr, [&]() { fd->detect(gray, fastKpoints); });
+    if (fastKpoints.empty()) return;
+    bench.run("kfilter", resolution, fastKpoints.size(), [&]() { kpoints = fastKpoints; },
+              [&]() { nanofractal::_private::kfilter(kpoints); });
+    std::vector<cv::KeyPoint> filtered = kpoints;
+    bench.run("assignClass", resolution, filtered.size(), [&]() { kpoints = filtered; },
+              [&]() { nanofractal::_private::assignClass(gray, kpoints); });
+    std::vector<cv::KeyPoint> classified = kpoints;
+
+    // queries: the model points projected with the homography of the markers, as in the matching stage
+    std::vector<cv::Point2f> queries;
+    if (!markers.empty()) {
+        std::vector<cv::Point2f> imgpoints, objpoints;
+        for (const auto& m : markers)
+            for (int c = 0; c < 4; c++) {
+                imgpoints.push_back(m[c]);
+                objpoints.push_back(m.keypts[c].pt);
+            }
+        cv::Mat H = cv::findHomography(objpoints, imgpoints);
+        if (!H.empty()) {
+            std::vector<cv::Point2f> modelPoints;
+            for (const auto& fm : markerSet.fractalMarkerCollection)
+                for (const auto& kpt : fm.second.keypts) modelPoints.push_back(kpt.pt);
+            cv::perspectiveTransform(modelPoints, queries, H);
+        }
+    }
+    if (queries.empty())
+        for (size_t i = 0; i < classified.size(); i += 4) queries.push_back(classified[i].pt);
+
+    nanofractal::_private::picoflann::KdTreeIndex<2, nanofractal::_private::PicoFlann_KeyPointAdapter> kdtree;
+    bench.run("picoflann_build", resolution, classified.size(), nullptr, [&]() { kdtree.build(classified); });
+    std::vector<std::pair<uint32_t, double>> res;
+    bench.run("picoflann_radiusSearch", resolution, queries.size(), nullptr, [&]() {
+        for (const auto& q : queries) kdtree.radiusSearch(res, classified, q, 10);
+    });
+
+    cv::Mat kpointsMat(classified.size(), 2, CV_32F);
+    for (size_t i = 0; i < classified.size(); ++i) {
+        kpointsMat.at<float>(i, 0) = classified[i].pt.x;
+        kpointsMat.at<float>(i, 1) = classified[i].pt.y;
+    }
+    cv::flann::Index flannIndex;
+    bench.run("cvflann_build", resolution, classified.size(), nullptr, [&]() {
+        flannIndex.build(kpointsMat, cv::flann::KDTreeIndexParams(1), cvflann::FLANN_DIST_EUCLIDEAN);
+    });
+    std::vector<int> indices;
+    std::vector<float> dists;
+    bench.run("cvflann_radiusSearch", resolution, queries.size(), nullptr, [&]() {
+        for (const auto& q : queries) {
+            std::vector<float> query = {q.x, q.y};
+            flannIndex.radiusSearch(query, indices, dists, 400.0, 1, cv::flann::SearchParams());
+        }
+    });
+
+    // subpixel refinement of the correspondences found by the detector
+    if (!p2d.empty()) {
+        std::vector<cv::Point2f> initial = p2d, refined;
+        cv::TermCriteria criteria(cv::TermCriteria::MAX_ITER | cv::TermCriteria::EPS, 12, 0.005);
+        bench.run("cornerSubPix", resolution, initial.size(), [&]() { refined = initial; },
+                  [&]() { cv::cornerSubPix(gray, refined, cv::Size(4, 4), cv::Size(-1, -1), criteria); });
+
+        // the same points with refineCorners: fixed and adaptive windows, serial and in parallel chunks
+        nanofractal::RefineParams parallel = detector.getRefineParams(), serial = parallel, fixed = parallel;
+        serial.chunkSize = 0;
+        fixed.chunkSize = 0;
+        fixed.windowFraction = 0;
+        std::vector<int> windows;
+        bool known = ws.pointBits.size() == initial.size();
+        for (size_t i = 0; i < initial.size(); i++)
+            windows.push_back(nanofractal::FractalMarkerDetector::refineHalfWindow(known ? ws.pointBits[i] : 0.f, parallel));
+        bench.run("refineCorners_fixed", resolution, initial.size(), [&]() { refined = initial; },
+                  [&]() { nanofractal::FractalMarkerDetector::refineCorners(gray, refined, std::vector<int>(), fixed); });
+        bench.run("refineCorners_adaptive", resolution, initial.size(), [&]() { refined = initial; },
+                  [&]() { nanofractal::FractalMarkerDetector::refineCorners(gray, refined, windows, serial); });
+        bench.run("refineCorners_parallel", resolution, initial.size(), [&]() { refined = initial; },
+                  [&]() { nanofractal::FractalMarkerDetector::refineCorners(gray, refined, windows, parallel); });
+    }
+}
+
+// Accuracy of the subpixel refinement on a synthetic scene: the visible model points are moved up to 1.5 px from their
+// true position and refined back with cv::cornerSubPix (4 px half window, as the detectors did) and with refineCorners
+// (window from the projected bit size of each point). Prints the mean and 90th percentile of the remaining error, and
+// the points left more than 1 px away
+static void subpixAccuracy(const cv::Size& size, const std::string& config) {
+    fractalsynth::SceneParams params;
+    params.imageSize = size;
+    params.rvec = cv::Vec3d(0.3, -0.2, 0.1);
+    params.tvec = cv::Vec3d(0, 0, 3.5);
+    params.blurSigma = 0.8;
+    params.noiseSigma = 2;
+    fractalsynth::SceneGenerator generator(config);
+    fractalsynth::Scene scene = generator.render(params);
+    const auto& collection = generator.getFractalMarkerSet().fractalMarkerCollection;
+    nanofractal::RefineParams refineParams;
+
+    cv::RNG rng(1);
+    std::vector<cv::Point2f> truth, initial;
+    std::vector<int> windows;
+    for (const auto& p : scene.points) {
+        if (!p.visible) continue;
+        // projected bit size: shortest of the two sides of a bit at the point
+        const nanofractal::FractalMarker& fm = collection.at(p.markerId);
+        float bitSize = fm.getMarkerSize() / (std::sqrt(float(fm.nBits())) + 2.f);
+        std::vector<cv::Point2f> model = {cv::Point2f(p.modelPoint.x, p.modelPoint.y),
+                                          cv::Point2f(p.modelPoint.x + bitSize, p.modelPoint.y),
+                                          cv::Point2f(p.modelPoint.x, p.modelPoint.y + bitSize)},
+                                 image;
+        cv::perspectiveTransform(model, image, scene.H);
+        float bitPixels = float(std::min(cv::norm(image[1] - image[0]), cv::norm(image[2] - image[0])));
+        truth.push_back(p.imagePoint);
+        initial.push_back(p.imagePoint + cv::Point2f(rng.uniform(-1.5f, 1.5f), rng.uniform(-1.5f, 1.5f)));
+        windows.push_back(nanofractal::FractalMarkerDetector::refineHalfWindow(bitPixels, refineParams));
+    }
+    if (truth.empty()) return;
+
+    auto report = [&](const std::string& name, const std::vector<cv::Point2f>& refined) {
+        std::vector<double> errors;
+        int far = 0;
+        for (size_t i = 0; i < truth.size(); i++) {
+            errors.push_back(cv::norm(refined[i] - truth[i]));
+            if (errors.back() > 1) far++;
+        }
+        double mean = 0;
+        for (double e : errors) mean += e;
+        mean /= errors.size();
+        std::cout << "  " << std::left << std::setw(24) << name << std::right << std::fixed << std::setprecision(4)
+                  << " mean " << mean << " px, p90 " << percentile(errors, 0.9) << " px, >1px " << far << "/"
+                  << errors.size() << std::endl;
+    };
+    std::cout << "subpixel accuracy at " << size.width << "x" << size.height << " (synthetic, 1.5 px initial error)"
+              << std::endl;
+    std::vector<cv::Point2f> refined = initial;
+    cv::TermCriteria criteria(cv::TermCriteria::MAX_ITER | cv::TermCriteria::EPS, 12, 0.005);
+    cv::cornerSubPix(scene.image, refined, cv::Size(4, 4), cv::Size(-1, -1), criteria);
+    report("cornerSubPix", refined);
+    refined = initial;
+    nanofractal::RefineParams fixed = refineParams;
+    fixed.windowFraction = 0;
+    nanofractal::FractalMarkerDetector::refineCorners(scene.image, refined, std::vector<int>(), fixed);
+    report("refineCorners_fixed", refined);
+    refined = initial;
+    nanofractal::FractalMarkerDetector::refineCorners(scene.image, refined, windows, refineParams);
+    report("refineCorners_adaptive", refined);
+}
+
+// Pose from the correspondences of the detector on a synthetic scene of known pose: cv::solvePnP from scratch, and
+// estimatePose started from the homography of the markers (cold) and from a nearby pose (warm, as when tracking)
+static void benchmarkPose(Benchmark& bench, const cv::Size& size, const std::string& config) {
+    std::string resolution = std::to_string(size.width) + "x" + std::to_string(size.height);
+    fractalsynth::SceneParams params;
+    params.imageSize = size;
+    params.rvec = cv::Vec3d(0.3, -0.2, 0.1);
+    params.tvec = cv::Vec3d(0, 0, 3.5);
+    params.blurSigma = 0.8;
+    params.noiseSigma = 2;
+    fractalsynth::Scene scene = fractalsynth::SceneGenerator(config).render(params);
+
+    nanofractal::FractalMarkerDetector detector;
+    detector.setParams(config);
+    detector.setCameraParams(scene.K, cv::Mat(), size);
+    nanofractal::FractalDetectorWorkspace ws;
+    std::vector<cv::Point3f> p3d;
+    std::vector<cv::Point2f> p2d;
+    detector.detect(scene.image, p3d, p2d, ws);
+    if (p3d.size() < 4) {
+        std::cout << "  no markers found at " << resolution << ": pose benchmarks skipped" << std::endl;
+        return;
+    }
+
+    cv::Vec3d rvec, tvec;
+    bench.run("solvePnP", resolution, p3d.size(), nullptr,
+              [&]() { cv::solvePnP(p3d, p2d, scene.K, cv::Mat(), rvec, tvec, false, cv::SOLVEPNP_ITERATIVE); });
+    nanofractal::FractalPose pose, previous;
+    bench.run("estimatePose_cold", resolution, p3d.size(), nullptr,
+              [&]() { detector.estimatePose(p3d, p2d, pose, ws); });
+    previous = pose;
+    previous.rvec = params.rvec + cv::Vec3d(0.01, -0.01, 0.005);
+    previous.tvec = params.tvec + cv::Vec3d(0.01, 0.01, -0.02);
+    bench.run("estimatePose_warm", resolution, p3d.size(), nullptr,
+              [&]() { detector.estimatePose(p3d, p2d, pose, ws, &previous); });
+    std::cout << "  pose at " << resolution << ": " << pose.nInliers << "/" << pose.nPoints << " inliers, "
+              << std::fixed << std::setprecision(4) << pose.reprojError << " px, "
+              << "tvec error estimatePose " << cv::norm(pose.tvec - params.tvec) << ", solvePnP "
+              << cv::norm(tvec - params.tvec) << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+    std::string dataDir = "data", prefix = "distortion", config = "FRACTAL_4L_6", jsonPath;
+    int warmup = 3, reps = 25;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            std::cerr << "Missing value for " << arg << std::endl;
+            return 1;
+        }
+        if (arg == "--data") dataDir = argv[++i];
+        else if (arg == "--prefix") prefix = argv[++i];
+        else if (arg == "--config") config = argv[++i];
+        else if (arg == "--warmup") warmup = std::stoi(argv[++i]);
+        else if (arg == "--reps") reps = std::stoi(argv[++i]);
+        else if (arg == "--json") jsonPath = argv[++i];
+        else {
+            std::cerr << "Usage: " << argv[0]
+                      << " [--data dir] [--prefix distortion] [--config FRACTAL_4L_6] [--warmup 3] [--reps 25] [--json out.json]"
+                      << std::endl;
+            return 1;
+        }
+    }
+    if (reps < 1) reps = 1;
+
+    const std::vector<cv::Size> resolutions = {{672, 504}, {1008, 756}, {1344, 1008}, {2016, 1512}, {4032, 3024}};
+    try {
+        Benchmark bench(warmup, reps);
+        bench.printHeader();
+        for (const auto& size : resolutions) {
+            std::string imagePath = dataDir + "/" + prefix + "_" + std::to_string(size.width) + "_" + std::to_string(size.height) + ".jpg";
+            cv::Mat image = cv::imread(imagePath);
+            if (image.empty()) {
+                std::cerr << "Failed to read image: " << imagePath << ". Using a synthetic scene" << std::endl;
+                fractalsynth::SceneParams params;
+                params.imageSize = size;
+                params.color = true;
+                params.rvec = cv::Vec3d(0.3, -0.2, 0.1);
+                params.tvec = cv::Vec3d(0, 0, 3.5);
+                params.blurSigma = 0.8;
+                params.noiseSigma = 2;
+                image = fractalsynth::SceneGenerator(config).render(params).image;
+            }
+            benchmarkResolution(bench, image, config);
+        }
+        for (const auto& size : resolutions) benchmarkPose(bench, size, config);
+        for (const auto& size : resolutions) subpixAccuracy(size, config);
+        if (!jsonPath.empty()) {
+            if (!bench.writeJson(jsonPath, config)) {
+                std::cerr << "Failed to open output file: " << jsonPath << std::endl;
+                return 1;
+            }
+            std::cout << "Results saved to: " << jsonPath << std::endl;
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,410 @@
+/*
+ * Long running metrics of the fractal marker detectors, exported in the Prometheus text format.
+ *
+ * A MetricsRegistry aggregates the DetectionStats of every detect() call (through the stats callback of the detector):
+ * latency histograms of each stage and of the whole call, frames with and without markers, keypoints and
+ * correspondences per frame, and the reasons why contours and quads were discarded. Recording a call only does relaxed
+ * atomic increments, so one registry can be shared by all the threads detecting. A MetricsExporter writes the metrics
+ * periodically to a file (e.g. for the textfile collector of node_exporter) and/or serves them on a local Unix socket.
+ *
+ * Example:
+ *
+ * fractalmetrics::MetricsRegistry<nanofractal::DetectionStats> metrics("nanofractal");
+ * detector.setStatsCallback([&](const nanofractal::DetectionStats &stats){ metrics.observe(stats); });
+ * fractalmetrics::ExporterParams params;
+ * params.filePath = "/var/lib/node_exporter/nanofractal.prom";
+ * params.socketPath = "/tmp/nanofractal.sock";  // curl --unix-socket /tmp/nanofractal.sock http://localhost/metrics
+ * fractalmetrics::MetricsExporter exporter(metrics, params);
+ */
+
+#ifndef _FractalMetrics_H_
+#define _FractalMetrics_H_
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#ifdef __unix__
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+namespace fractalmetrics {
+
+/**
+ * @brief Histogram of non negative integer values with a bounded relative error (HDR style).
+ *
+ * Values below 16 have one bucket each. Above, every power of two is split into 16 linear buckets, so the quantiles
+ * are within ~6% of the real value. Values from 2^40 on go to the last bucket.
+ */
+class Histogram{
+public:
+    static constexpr int SUB_BITS=4;
+    static constexpr int MAX_EXP=40;
+    static constexpr int NBUCKETS=(1<<SUB_BITS)*(MAX_EXP-SUB_BITS+2);
+
+    Histogram(){ clear(); }
+    Histogram(const Histogram&)=delete;
+    Histogram& operator=(const Histogram&)=delete;
+
+    inline void record(uint64_t value){
+        _buckets[bucketOf(value)].fetch_add(1,std::memory_order_relaxed);
+        _count.fetch_add(1,std::memory_order_relaxed);
+        _sum.fetch_add(value,std::memory_order_relaxed);
+    }
+    inline uint64_t count()const{ return _count.load(std::memory_order_relaxed); }
+    inline uint64_t sum()const{ return _sum.load(std::memory_order_relaxed); }
+    //number of values up to 2^exp included, within the resolution of its bucket (exp<=MAX_EXP)
+    inline uint64_t countUpToPow2(int exp)const;
+    //value of the quantile q in [0,1]. Zero if empty
+    inline double quantile(double q)const;
+    inline void clear(){
+        for(auto &b:_buckets) b.store(0,std::memory_order_relaxed);
+        _count.store(0,std::memory_order_relaxed);
+        _sum.store(0,std::memory_order_relaxed);
+    }
+
+    static inline int bucketOf(uint64_t value){
+        if(value<(1u<<SUB_BITS)) return int(value);
+        int exp=63-countLeadingZeros(value);
+        if(exp>MAX_EXP) return NBUCKETS-1;
+        int sub=int(value>>(exp-SUB_BITS))&((1<<SUB_BITS)-1);
+        return ((exp-SUB_BITS+1)<<SUB_BITS)+sub;
+    }
+    //smallest value of a bucket
+    static inline uint64_t bucketLow(int bucket){
+        if(bucket<(1<<SUB_BITS)) return uint64_t(bucket);
+        int exp=(bucket>>SUB_BITS)+SUB_BITS-1;
+        uint64_t sub=uint64_t(bucket&((1<<SUB_BITS)-1));
+        return ((uint64_t(1)<<SUB_BITS)+sub)<<(exp-SUB_BITS);
+    }
+private:
+    std::atomic<uint64_t> _buckets[NBUCKETS];
+    std::atomic<uint64_t> _count,_sum;
+
+    static inline int countLeadingZeros(uint64_t v){
+#if defined(__GNUC__) || defined(__clang__)
+        return __builtin_clzll(v);
+#else
+        int n=0;
+        while(!(v&(uint64_t(1)<<63))){ v<<=1; n++; }
+        return n;
+#endif
+    }
+};
+
+uint64_t Histogram::countUpToPow2(int exp)const{
+    int last=bucketOf(uint64_t(1)<<exp);
+    uint64_t n=0;
+    for(int i=0;i<=last;i++) n+=_buckets[i].load(std::memory_order_relaxed);
+    return n;
+}
+
+double Histogram::quantile(double q)const{
+    uint64_t total=0;
+    uint64_t counts[NBUCKETS];
+    for(int i=0;i<NBUCKETS;i++){
+        counts[i]=_buckets[i].load(std::memory_order_relaxed);
+        total+=counts[i];
+    }
+    if(total==0) return 0;
+    uint64_t rank=uint64_t(q*double(total-1));
+    uint64_t acc=0;
+    for(int i=0;i<NBUCKETS;i++){
+        acc+=counts[i];
+        if(acc>rank){
+            //middle of the bucket
+            uint64_t low=bucketLow(i);
+            uint64_t high=i+1<NBUCKETS? bucketLow(i+1) : low+1;
+            return 0.5*double(low+high-1);
+        }
+    }
+    return double(bucketLow(NBUCKETS-1));
+}
+
+/**
+ * @brief Aggregated DetectionStats of many detect() calls.
+ *
+ * Stats is nanofractal::DetectionStats or opencvfractal::DetectionStats. observe() can be called from any number of
+ * threads at the same time, and prometheusText() while they observe.
+ */
+template<typename Stats>
+class MetricsRegistry{
+public:
+    //@param prefix prefix of the names of the metrics (e.g. nanofractal_frames_total)
+    MetricsRegistry(const std::string &prefix="fractal"):_prefix(prefix){}
+    MetricsRegistry(const MetricsRegistry&)=delete;
+    MetricsRegistry& operator=(const MetricsRegistry&)=delete;
+
+    //records the stats of one detect() call
+    inline void observe(const Stats &stats);
+    inline std::string prometheusText()const;
+    //writes prometheusText() to a temporary file renamed to path, so readers never see a partial file
+    inline bool writeFile(const std::string &path)const;
+private:
+    enum Rejection{SMALL=0,NOT_QUAD,BORDER,CODE,DUPLICATE,NREJECTIONS};
+    std::string _prefix;
+    std::atomic<uint64_t> _frames{0},_framesWithMarkers{0},_markers{0},_contours{0},_quads{0},_keypoints{0},_matches{0};
+    std::atomic<uint64_t> _rejections[NREJECTIONS]={};
+    Histogram _totalNs;//latency of the whole call, in nanoseconds
+    Histogram _stageNs[Stats::NSTAGES];
+    Histogram _keypointsPerFrame,_matchesPerFrame;
+
+    static inline void add(std::atomic<uint64_t> &counter, int64_t value){
+        if(value>0) counter.fetch_add(uint64_t(value),std::memory_order_relaxed);
+    }
+    static inline uint64_t toNs(double ms){ return ms>0? uint64_t(ms*1e6) : 0; }
+    inline void writeHistogram(std::ostream &os, const std::string &name, const std::string &labels,
+                               const Histogram &h, double unit, int minExp, int maxExp)const;
+};
+
+template<typename Stats>
+void MetricsRegistry<Stats>::observe(const Stats &stats){
+    _frames.fetch_add(1,std::memory_order_relaxed);
+    if(stats.candidates>0) _framesWithMarkers.fetch_add(1,std::memory_order_relaxed);
+    add(_markers,stats.candidates);
+    add(_contours,stats.contours);
+    add(_quads,stats.quads);
+    add(_keypoints,stats.keypointsFiltered);
+    add(_matches,stats.matches);
+    add(_rejections[SMALL],stats.rejectedSmall);
+    add(_rejections[NOT_QUAD],stats.rejectedNotQuad);
+    add(_rejections[BORDER],stats.rejectedBorder);
+    add(_rejections[CODE],stats.rejectedCode);
+    add(_rejections[DUPLICATE],stats.rejectedDuplicate);
+    _totalNs.record(toNs(stats.totalMs));
+    //only the stages run
+    for(int i=0;i<Stats::NSTAGES;i++)
+        if(stats.stageMs[i]>0) _stageNs[i].record(toNs(stats.stageMs[i]));
+    //frames without markers stop before the keypoints
+    if(stats.candidates>0){
+        _keypointsPerFrame.record(uint64_t(std::max(0,stats.keypointsFiltered)));
+        _matchesPerFrame.record(uint64_t(std::max(0,stats.matches)));
+    }
+}
+
+template<typename Stats>
+void MetricsRegistry<Stats>::writeHistogram(std::ostream &os, const std::string &name, const std::string &labels,
+                                            const Histogram &h, double unit, int minExp, int maxExp)const{
+    std::string sep=labels.empty()? "" : ",";
+    for(int e=minExp;e<=maxExp;e++)
+        os<<name<<"_bucket{"<<labels<<sep<<"le=\""<<double(uint64_t(1)<<e)*unit<<"\"} "<<h.countUpToPow2(e)<<"\n";
+    os<<name<<"_bucket{"<<labels<<sep<<"le=\"+Inf\"} "<<h.count()<<"\n";
+    std::string braces=labels.empty()? "" : "{"+labels+"}";
+    os<<name<<"_sum"<<braces<<" "<<double(h.sum())*unit<<"\n";
+    os<<name<<"_count"<<braces<<" "<<h.count()<<"\n";
+}
+
+template<typename Stats>
+std::string MetricsRegistry<Stats>::prometheusText()const{
+    std::stringstream os;
+    os.precision(9);
+    auto counter=[&](const std::string &name, const std::string &help, const std::atomic<uint64_t> &value){
+        os<<"# HELP "<<_prefix<<"_"<<name<<" "<<help<<"\n# TYPE "<<_prefix<<"_"<<name<<" counter\n";
+        os<<_prefix<<"_"<<name<<" "<<value.load(std::memory_order_relaxed)<<"\n";
+    };
+    counter("frames_total","Calls to detect()",_frames);
+    counter("frames_with_markers_total","Calls to detect() that found at least one marker",_framesWithMarkers);
+    counter("markers_total","Markers found",_markers);
+    counter("contours_total","Contours found in the thresholded images",_contours);
+    counter("quads_total","Contours approximated by a convex quadrilateral",_quads);
+    counter("keypoints_total","Keypoints left by the filter",_keypoints);
+    counter("correspondences_total","3d-2d correspondences found",_matches);
+
+    static const char* reasons[NREJECTIONS]={"small_contour","not_quad","border","code","duplicate"};
+    std::string name=_prefix+"_rejections_total";
+    os<<"# HELP "<<name<<" Contours and quads discarded, by reason\n# TYPE "<<name<<" counter\n";
+    for(int i=0;i<NREJECTIONS;i++)
+        os<<name<<"{reason=\""<<reasons[i]<<"\"} "<<_rejections[i].load(std::memory_order_relaxed)<<"\n";
+
+    //latencies from ~1us to ~69s
+    name=_prefix+"_detect_seconds";
+    os<<"# HELP "<<name<<" Latency of detect()\n# TYPE "<<name<<" histogram\n";
+    writeHistogram(os,name,"",_totalNs,1e-9,10,36);
+    name=_prefix+"_stage_seconds";
+    os<<"# HELP "<<name<<" Latency of each stage of detect()\n# TYPE "<<name<<" histogram\n";
+    for(int i=0;i<Stats::NSTAGES;i++)
+        writeHistogram(os,name,std::string("stage=\"")+Stats::stageName(i)+"\"",_stageNs[i],1e-9,10,36);
+    name=_prefix+"_stage_quantile_seconds";
+    os<<"# HELP "<<name<<" Quantiles of the latency of each stage since the start\n# TYPE "<<name<<" gauge\n";
+    for(int i=-1;i<Stats::NSTAGES;i++){
+        const Histogram &h= i<0? _totalNs : _stageNs[i];
+        for(double q:{0.5,0.9,0.99,0.999})
+            os<<name<<"{stage=\""<<(i<0? "total" : Stats::stageName(i))<<"\",quantile=\""<<q<<"\"} "
+              <<h.quantile(q)*1e-9<<"\n";
+    }
+
+    name=_prefix+"_keypoints_per_frame";
+    os<<"# HELP "<<name<<" Keypoints left by the filter in the frames with markers\n# TYPE "<<name<<" histogram\n";
+    writeHistogram(os,name,"",_keypointsPerFrame,1,0,20);
+    name=_prefix+"_correspondences_per_frame";
+    os<<"# HELP "<<name<<" 3d-2d correspondences in the frames with markers\n# TYPE "<<name<<" histogram\n";
+    writeHistogram(os,name,"",_matchesPerFrame,1,0,20);
+    return os.str();
+}
+
+template<typename Stats>
+bool MetricsRegistry<Stats>::writeFile(const std::string &path)const{
+    std::string tmp=path+".tmp";
+    {
+        std::ofstream ofs(tmp);
+        if(!ofs.is_open()) return false;
+        ofs<<prometheusText();
+        if(!ofs) return false;
+    }
+    return std::rename(tmp.c_str(),path.c_str())==0;
+}
+
+/**
+ * @brief Parameters of the MetricsExporter
+ */
+struct ExporterParams{
+    std::string filePath;//file rewritten every periodMs. Empty: no file
+    std::string socketPath;//Unix socket where every connection receives the current metrics. Empty: no socket
+    int periodMs=10000;
+};
+
+/**
+ * @brief Exports the metrics of a registry from a background thread, until destroyed.
+ *
+ * The socket answers every connection with an HTTP response holding the metrics and closes it, so it can be read with
+ * curl --unix-socket or socat. Throws std::runtime_error if the socket cannot be created.
+ */
+class MetricsExporter{
+public:
+    template<typename Stats>
+    MetricsExporter(const MetricsRegistry<Stats> &registry, const ExporterParams &params);
+    inline ~MetricsExporter();
+    MetricsExporter(const MetricsExporter&)=delete;
+    MetricsExporter& operator=(const MetricsExporter&)=delete;
+private:
+    std::function<std::string()> _text;
+    std::function<bool(const std::string&)> _writeFile;
+    ExporterParams _params;
+    int _socket=-1;
+    std::atomic<bool> _stop{false};
+    std::mutex _mtx;
+    std::condition_variable _cv;
+    std::thread _thread;
+
+    inline void openSocket();
+    inline void serveClient();
+    inline void loop();
+};
+
+template<typename Stats>
+MetricsExporter::MetricsExporter(const MetricsRegistry<Stats> &registry, const ExporterParams &params):_params(params){
+    _text=[&registry](){ return registry.prometheusText(); };
+    _writeFile=[&registry](const std::string &path){ return registry.writeFile(path); };
+    _params.periodMs=std::max(1,_params.periodMs);
+    if(!_params.socketPath.empty()) openSocket();
+    _thread=std::thread(&MetricsExporter::loop,this);
+}
+
+MetricsExporter::~MetricsExporter(){
+    {
+        std::unique_lock<std::mutex> lock(_mtx);
+        _stop=true;
+    }
+    _cv.notify_all();
+    _thread.join();
+#ifdef __unix__
+    if(_socket>=0){
+        close(_socket);
+        unlink(_params.socketPath.c_str());
+    }
+#endif
+}
+
+void MetricsExporter::openSocket(){
+#ifdef __unix__
+    sockaddr_un addr;
+    std::memset(&addr,0,sizeof(addr));
+    addr.sun_family=AF_UNIX;
+    if(_params.socketPath.size()>=sizeof(addr.sun_path))
+        throw std::runtime_error("MetricsExporter: socket path too long: "+_params.socketPath);
+    std::strcpy(addr.sun_path,_params.socketPath.c_str());
+    _socket=socket(AF_UNIX,SOCK_STREAM,0);
+    if(_socket<0) throw std::runtime_error("MetricsExporter: could not create socket: "+std::string(std::strerror(errno)));
+    unlink(_params.socketPath.c_str());//left by a previous run
+    if(bind(_socket,reinterpret_cast<sockaddr*>(&addr),sizeof(addr))!=0 || listen(_socket,8)!=0){
+        std::string err=std::strerror(errno);
+        close(_socket);
+        _socket=-1;
+        throw std::runtime_error("MetricsExporter: could not listen on "+_params.socketPath+": "+err);
+    }
+#else
+    throw std::runtime_error("MetricsExporter: Unix sockets are not available in this platform");
+#endif
+}
+
+void MetricsExporter::serveClient(){
+#ifdef __unix__
+    int client=accept(_socket,nullptr,nullptr);
+    if(client<0) return;
+    //read the request, if any: closing with unread data resets the connection and the client may lose the response
+    pollfd pfd;
+    pfd.fd=client;
+    pfd.events=POLLIN;
+    pfd.revents=0;
+    char request[4096];
+    if(poll(&pfd,1,100)>0 && (pfd.revents&POLLIN)) (void)!recv(client,request,sizeof(request),0);
+    std::string body=_text();
+    std::string response="HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: "+
+            std::to_string(body.size())+"\r\n\r\n"+body;
+    size_t sent=0;
+    while(sent<response.size()){
+        ssize_t n=send(client,response.data()+sent,response.size()-sent,MSG_NOSIGNAL);
+        if(n<=0) break;
+        sent+=size_t(n);
+    }
+    close(client);
+#endif
+}
+
+void MetricsExporter::loop(){
+    using namespace std::chrono;
+    auto nextWrite=steady_clock::now();
+    bool writeFailed=false;
+    while(!_stop){
+        if(!_params.filePath.empty() && steady_clock::now()>=nextWrite){
+            bool ok=_writeFile(_params.filePath);
+            if(!ok && !writeFailed) std::cerr<<"[fractalmetrics] could not write "<<_params.filePath<<std::endl;
+            writeFailed=!ok;
+            nextWrite+=milliseconds(_params.periodMs);
+        }
+#ifdef __unix__
+        //wait for clients in short slices, to notice the stop and the next file write
+        if(_socket>=0){
+            pollfd pfd;
+            pfd.fd=_socket;
+            pfd.events=POLLIN;
+            pfd.revents=0;
+            if(poll(&pfd,1,100)>0 && (pfd.revents&POLLIN)) serveClient();
+            continue;
+        }
+#endif
+        std::unique_lock<std::mutex> lock(_mtx);
+        if(_params.filePath.empty()) _cv.wait(lock,[&]{return _stop.load();});
+        else _cv.wait_until(lock,nextWrite,[&]{return _stop.load();});
+    }
+    //last values before finishing
+    if(!_params.filePath.empty()) _writeFile(_params.filePath);
+}
+
+}
+#endif
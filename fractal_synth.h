@@ -0,0 +1,285 @@
+/*
+ * Synthetic scenes of fractal markers with ground truth.
+ *
+ * Renders any of the predefined fractal markers (FRACTAL_2L_6 ... FRACTAL_5L_6) from the codes embedded in
+ * nanofractal.h, places it in the image with a homography or a camera pose, and degrades the result with lens
+ * distortion, illumination gradient, occlusions, blur and noise. Besides the image, it returns the exact image
+ * position of every model point (the keypts of all the markers of the set), so the accuracy of the detection can be
+ * measured without real photos. Scenes are deterministic given the parameters and the seed.
+ *
+ * Example:
+ *
+ * fractalsynth::SceneGenerator generator("FRACTAL_4L_6");
+ * fractalsynth::SceneParams params;
+ * params.imageSize = cv::Size(1344, 1008);
+ * params.blurSigma = 1.0;
+ * params.noiseSigma = 3;
+ * fractalsynth::Scene scene = generator.render(params);
+ * cv::imwrite("scene.png", scene.image);
+ * for(const auto &p:scene.points) if(p.visible) ... p.imagePoint ...
+ */
+
+#ifndef _FractalSynth_H_
+#define _FractalSynth_H_
+#include "nanofractal.h"
+
+namespace fractalsynth {
+
+/**
+ * @brief Description of one synthetic scene
+ */
+struct SceneParams{
+    cv::Size imageSize=cv::Size(1344,1008);
+    bool color=false;//if true, the image is BGR (three equal channels)
+
+    //Placement of the marker. If H is not empty, it maps the marker coordinates (keypts) to the undistorted image.
+    //Otherwise the camera pose (rvec,tvec) is used, with the camera matrix K (default: focal length = image width,
+    //principal point at the center). The marker coordinates of the predefined sets are normalized: the external
+    //marker goes from -1 to 1.
+    cv::Mat H;
+    cv::Vec3d rvec=cv::Vec3d(0,0,0);
+    cv::Vec3d tvec=cv::Vec3d(0,0,4);
+    cv::Mat K;
+
+    cv::Mat distCoeffs;//lens distortion (k1,k2,p1,p2[,k3]) applied to the image. Empty: none
+    int background=128;//gray level around the marker
+    int quietZoneBits=1;//white margin around the external marker, in bits of the external marker
+    float gradient=0;//illumination changes linearly across the image by +-gradient (fraction of the gray level)
+    float gradientAngle=0;//direction of the gradient in degrees
+    int occlusions=0;//number of random occluding rectangles over the marker
+    float occlusionSize=0.25f;//side of the occlusions, as a fraction of the size of the marker in the image
+    double blurSigma=0;//gaussian blur
+    double noiseSigma=0;//gaussian noise, in gray levels
+    int supersampling=2;//the scene is rendered at this scale and reduced, for antialiasing
+    uint64_t seed=0;//random occlusions and noise
+};
+
+/**
+ * @brief Position of one model point in the synthetic image
+ */
+struct GroundTruthPoint{
+    int markerId;
+    int pointIdx;//index in the keypts of the marker
+    int classId;
+    cv::Point3f modelPoint;
+    cv::Point2f imagePoint;//in the distorted image, center of the top-left pixel is (0,0)
+    bool visible;//inside the image and not occluded
+};
+
+/**
+ * @brief Synthetic image and ground truth
+ */
+struct Scene{
+    cv::Mat image;
+    std::vector<GroundTruthPoint> points;
+    cv::Mat H;//homography from the marker coordinates to the undistorted image
+    cv::Mat K;//camera matrix used for the distortion
+    std::vector<cv::Rect> occlusions;
+};
+
+/**
+ * @brief Renders synthetic scenes of one fractal marker configuration
+ */
+class SceneGenerator{
+public:
+    //@param config possible values (FRACTAL_2L_6,FRACTAL_3L_6,FRACTAL_4L_6,FRACTAL_5L_6)
+    SceneGenerator(const std::string &config):_markerSet(config){}
+
+    inline Scene render(const SceneParams &params) const;
+
+    //Random pose with the marker filling about `scale` of the image height, tilted up to maxTiltDeg degrees
+    static inline void randomPose(SceneParams &params, cv::RNG &rng, float minScale=0.3f, float maxScale=0.8f, float maxTiltDeg=45);
+    static inline cv::Mat defaultCameraMatrix(const cv::Size &imageSize);
+
+    inline const nanofractal::FractalMarkerSet& getFractalMarkerSet() const { return _markerSet; }
+private:
+    nanofractal::FractalMarkerSet _markerSet;
+};
+
+cv::Mat SceneGenerator::defaultCameraMatrix(const cv::Size &imageSize){
+    double f=imageSize.width;
+    return (cv::Mat_<double>(3,3)<<f,0,(imageSize.width-1)/2.,0,f,(imageSize.height-1)/2.,0,0,1);
+}
+
+void SceneGenerator::randomPose(SceneParams &params, cv::RNG &rng, float minScale, float maxScale, float maxTiltDeg){
+    cv::Mat K=params.K.empty() ? defaultCameraMatrix(params.imageSize) : params.K;
+    double f=K.at<double>(1,1);
+    double scale=rng.uniform(minScale,maxScale);
+    //the marker side is 2 units: distance at which it covers scale*height pixels
+    double z=2*f/(scale*params.imageSize.height);
+    double tilt=maxTiltDeg*CV_PI/180.;
+    cv::Mat R;
+    cv::Vec3d rx(rng.uniform(-tilt,tilt),0,0), ry(0,rng.uniform(-tilt,tilt),0), rz(0,0,rng.uniform(-CV_PI,CV_PI));
+    cv::Mat Rx,Ry,Rz;
+    cv::Rodrigues(rx,Rx);
+    cv::Rodrigues(ry,Ry);
+    cv::Rodrigues(rz,Rz);
+    R=Rx*Ry*Rz;
+    cv::Rodrigues(R,params.rvec);
+    //move the center inside the image, leaving room for the marker
+    double freeX=std::max(0.,(1-scale)*params.imageSize.width/2.), freeY=std::max(0.,(1-scale)*params.imageSize.height/2.);
+    double cx=rng.uniform(-freeX,freeX+1e-6), cy=rng.uniform(-freeY,freeY+1e-6);
+    params.tvec=cv::Vec3d(cx*z/f, cy*z/f, z);
+    params.H=cv::Mat();
+}
+
+Scene SceneGenerator::render(const SceneParams &params) const{
+    if(params.imageSize.area()<=0) throw std::runtime_error("SceneGenerator::render: invalid image size");
+    Scene scene;
+    cv::RNG rng(params.seed);
+    scene.K=params.K.empty() ? defaultCameraMatrix(params.imageSize) : params.K.clone();
+
+    ///////////////////////////////////////////////////
+    //homography from the marker coordinates to the undistorted image
+    if(!params.H.empty()) params.H.convertTo(scene.H,CV_64F);
+    else{
+        cv::Mat R;
+        cv::Rodrigues(params.rvec,R);
+        cv::Mat Rt=(cv::Mat_<double>(3,3)<<R.at<double>(0,0),R.at<double>(0,1),params.tvec[0],
+                                            R.at<double>(1,0),R.at<double>(1,1),params.tvec[1],
+                                            R.at<double>(2,0),R.at<double>(2,1),params.tvec[2]);
+        scene.H=scene.K*Rt;
+    }
+    scene.H/=scene.H.at<double>(2,2);
+
+    ///////////////////////////////////////////////////
+    //marker texture, with a resolution similar to its size in the supersampled image
+    const nanofractal::FractalMarker &external=_markerSet.fractalMarkerCollection.at(_markerSet.idExternal);
+    int ss=std::max(1,params.supersampling);
+    cv::Mat S=(cv::Mat_<double>(3,3)<<ss,0,0.5*ss-0.5, 0,ss,0.5*ss-0.5, 0,0,1);//image to supersampled image
+    std::vector<cv::Point2f> extCorners,extImg;
+    for(int c=0;c<4;c++) extCorners.push_back(external.keypts[c].pt);
+    cv::perspectiveTransform(extCorners,extImg,S*scene.H);
+    double maxSide=0;
+    for(int c=0;c<4;c++) maxSide=std::max(maxSide,cv::norm(extImg[c]-extImg[(c+1)%4]));
+    //side multiple of the number of smallest bits, so that all the bits have the same size
+    float minBitSize=external.getMarkerSize();
+    for(const auto &fm:_markerSet.fractalMarkerCollection)
+        minBitSize=std::min(minBitSize,float(fm.second.getMarkerSize()/(sqrt(fm.second.nBits())+2)));
+    int nCells=std::max(1,int(std::round(external.getMarkerSize()/minBitSize)));
+    int side=nCells*std::max(1,std::min(int(std::ceil(maxSide/nCells)),8192/nCells));
+    cv::Mat texture=_markerSet.render(side);
+    int quiet=params.quietZoneBits*side/(sqrt(external.nBits())+2);
+    cv::copyMakeBorder(texture,texture,quiet,quiet,quiet,quiet,cv::BORDER_CONSTANT,cv::Scalar::all(255));
+    cv::Matx33d T=_markerSet.renderTransform(side);
+    T(0,2)+=quiet;
+    T(1,2)+=quiet;
+
+    ///////////////////////////////////////////////////
+    //undistorted image
+    cv::Size ssSize(params.imageSize.width*ss,params.imageSize.height*ss);
+    cv::Mat undistorted(ssSize,CV_8UC1,cv::Scalar::all(params.background));
+    cv::Mat textureToImage=S*scene.H*cv::Mat(T).inv();
+    cv::warpPerspective(texture,undistorted,textureToImage,ssSize,cv::INTER_LINEAR,cv::BORDER_TRANSPARENT);
+    if(ss>1) cv::resize(undistorted,undistorted,params.imageSize,0,0,cv::INTER_AREA);
+
+    ///////////////////////////////////////////////////
+    //ground truth
+    std::vector<cv::Point2f> modelPoints;
+    for(const auto &fm:_markerSet.fractalMarkerCollection)
+        for(size_t i=0;i<fm.second.keypts.size();i++){
+            const cv::KeyPoint &kpt=fm.second.keypts[i];
+            GroundTruthPoint gt;
+            gt.markerId=fm.first;
+            gt.pointIdx=i;
+            gt.classId=kpt.class_id;
+            gt.modelPoint=cv::Point3f(kpt.pt.x,kpt.pt.y,0);
+            gt.visible=true;
+            scene.points.push_back(gt);
+            modelPoints.push_back(kpt.pt);
+        }
+    std::vector<cv::Point2f> imagePoints;
+    cv::perspectiveTransform(modelPoints,imagePoints,scene.H);
+
+    ///////////////////////////////////////////////////
+    //lens distortion: each pixel of the distorted image takes the value of its undistorted position
+    if(!params.distCoeffs.empty()){
+        cv::TermCriteria criteria(cv::TermCriteria::COUNT|cv::TermCriteria::EPS,50,1e-6);
+        std::vector<cv::Point2f> pixels;
+        pixels.reserve(params.imageSize.area());
+        for(int y=0;y<params.imageSize.height;y++)
+            for(int x=0;x<params.imageSize.width;x++) pixels.push_back(cv::Point2f(x,y));
+        std::vector<cv::Point2f> sources;
+        cv::undistortPoints(pixels,sources,scene.K,params.distCoeffs,cv::noArray(),scene.K,criteria);
+        cv::Mat map=cv::Mat(sources).reshape(2,params.imageSize.height);
+        cv::remap(undistorted,scene.image,map,cv::noArray(),cv::INTER_LINEAR,cv::BORDER_CONSTANT,cv::Scalar::all(params.background));
+        //and the points go the other way
+        std::vector<cv::Point3f> normalized;
+        cv::Mat Kinv=scene.K.inv();
+        for(const auto &p:imagePoints){
+            cv::Mat n=Kinv*(cv::Mat_<double>(3,1)<<p.x,p.y,1);
+            normalized.push_back(cv::Point3f(n.at<double>(0)/n.at<double>(2),n.at<double>(1)/n.at<double>(2),1));
+        }
+        std::vector<cv::Point2f> undistortedPoints=imagePoints;
+        cv::projectPoints(normalized,cv::Vec3d(0,0,0),cv::Vec3d(0,0,0),scene.K,params.distCoeffs,imagePoints);
+        //the pixel rendered at a visible ground truth point must come from its undistorted position
+        cv::Rect imageRect(0,0,params.imageSize.width,params.imageSize.height);
+        std::vector<cv::Point2f> back;
+        cv::undistortPoints(imagePoints,back,scene.K,params.distCoeffs,cv::noArray(),scene.K,criteria);
+        for(size_t i=0;i<imagePoints.size();i++)
+            if(imageRect.contains(imagePoints[i]) && cv::norm(back[i]-undistortedPoints[i])>0.01)
+                throw std::runtime_error("SceneGenerator::render: the lens distortion can not be inverted at a ground truth point");
+    }
+    else scene.image=undistorted;
+
+    cv::Rect imageRect(0,0,params.imageSize.width,params.imageSize.height);
+    for(size_t i=0;i<imagePoints.size();i++){
+        scene.points[i].imagePoint=imagePoints[i];
+        if(!imageRect.contains(imagePoints[i])) scene.points[i].visible=false;
+    }
+
+    ///////////////////////////////////////////////////
+    //illumination gradient
+    cv::Mat image;
+    scene.image.convertTo(image,CV_32F);
+    if(params.gradient!=0){
+        double angle=params.gradientAngle*CV_PI/180.;
+        double dx=cos(angle), dy=sin(angle);
+        double halfDiag=0.5*sqrt(double(image.cols*image.cols+image.rows*image.rows));
+        for(int y=0;y<image.rows;y++){
+            float *ptr=image.ptr<float>(y);
+            for(int x=0;x<image.cols;x++){
+                double t=((x-image.cols/2.)*dx+(y-image.rows/2.)*dy)/halfDiag;
+                ptr[x]*=float(1+params.gradient*t);
+            }
+        }
+    }
+
+    ///////////////////////////////////////////////////
+    //occlusions over the marker
+    if(params.occlusions>0){
+        std::vector<cv::Point2f> extDist;
+        for(int c=0;c<4;c++)
+            for(const auto &gt:scene.points)
+                if(gt.markerId==_markerSet.idExternal && gt.pointIdx==c) extDist.push_back(gt.imagePoint);
+        cv::Rect box=cv::boundingRect(extDist)&imageRect;
+        int occSide=std::max(2,int(params.occlusionSize*std::max(box.width,box.height)));
+        for(int i=0;i<params.occlusions && box.area()>0;i++){
+            int w=std::max(2,int(occSide*rng.uniform(0.5,1.5))), h=std::max(2,int(occSide*rng.uniform(0.5,1.5)));
+            cv::Rect occ(box.x+rng.uniform(0,std::max(1,box.width))-w/2, box.y+rng.uniform(0,std::max(1,box.height))-h/2, w, h);
+            occ&=imageRect;
+            if(occ.area()==0) continue;
+            image(occ).setTo(cv::Scalar::all(rng.uniform(0,256)));
+            scene.occlusions.push_back(occ);
+        }
+        //a corner needs some pixels around it to be seen
+        for(auto &gt:scene.points)
+            for(const auto &occ:scene.occlusions)
+                if(cv::Rect(occ.x-3,occ.y-3,occ.width+6,occ.height+6).contains(gt.imagePoint)) gt.visible=false;
+    }
+
+    ///////////////////////////////////////////////////
+    //blur and noise
+    if(params.blurSigma>0) cv::GaussianBlur(image,image,cv::Size(0,0),params.blurSigma);
+    if(params.noiseSigma>0){
+        cv::Mat noise(image.size(),CV_32F);
+        rng.fill(noise,cv::RNG::NORMAL,0,params.noiseSigma);
+        image+=noise;
+    }
+    image.convertTo(scene.image,CV_8U);//saturates
+    if(params.color) cv::cvtColor(scene.image,scene.image,cv::COLOR_GRAY2BGR);
+    return scene;
+}
+
+}
+#endif
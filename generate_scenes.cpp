@@ -0,0 +1,113 @@
+#include <filesystem>
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <opencv2/opencv.hpp>
+#include "fractal_synth.h"
+
+// Generates a dataset of synthetic fractal marker images with the ground truth position of every model point.
+//
+// Writes <out>/NNN.jpg (or the extension chosen) and <out>/ground_truth.csv with one row per model point and image.
+// The same arguments always produce the same dataset.
+
+static void usage(const char* name) {
+    std::cerr << "Usage: " << name << " <output_dir> [--config FRACTAL_4L_6] [--size 1344x1008] [--count 100] [--seed 0]\n"
+              << "          [--scale 0.3:0.8] [--tilt 45] [--blur 0] [--noise 0] [--gradient 0] [--k1 0] [--k2 0]\n"
+              << "          [--occlusions 0] [--occlusion-size 0.25] [--color] [--ext .jpg]" << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        usage(argv[0]);
+        return 1;
+    }
+    std::filesystem::path outDir(argv[1]);
+    std::string config = "FRACTAL_4L_6", ext = ".jpg";
+    int count = 100;
+    uint64_t seed = 0;
+    float minScale = 0.3f, maxScale = 0.8f, tilt = 45;
+    double k1 = 0, k2 = 0;
+    fractalsynth::SceneParams params;
+    try {
+        for (int i = 2; i < argc; i++) {
+            std::string arg = argv[i];
+            if (arg == "--color") {
+                params.color = true;
+                continue;
+            }
+            if (i + 1 >= argc) {
+                usage(argv[0]);
+                return 1;
+            }
+            std::string value = argv[++i];
+            if (arg == "--config") config = value;
+            else if (arg == "--size") {
+                size_t x = value.find('x');
+                params.imageSize = cv::Size(std::stoi(value.substr(0, x)), std::stoi(value.substr(x + 1)));
+            } else if (arg == "--count") count = std::stoi(value);
+            else if (arg == "--seed") seed = std::stoull(value);
+            else if (arg == "--scale") {
+                size_t sep = value.find(':');
+                minScale = std::stof(value.substr(0, sep));
+                maxScale = sep == std::string::npos ? minScale : std::stof(value.substr(sep + 1));
+            } else if (arg == "--tilt") tilt = std::stof(value);
+            else if (arg == "--blur") params.blurSigma = std::stod(value);
+            else if (arg == "--noise") params.noiseSigma = std::stod(value);
+            else if (arg == "--gradient") params.gradient = std::stof(value);
+            else if (arg == "--k1") k1 = std::stod(value);
+            else if (arg == "--k2") k2 = std::stod(value);
+            else if (arg == "--occlusions") params.occlusions = std::stoi(value);
+            else if (arg == "--occlusion-size") params.occlusionSize = std::stof(value);
+            else if (arg == "--ext") ext = value;
+            else {
+                usage(argv[0]);
+                return 1;
+            }
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Invalid argument: " << e.what() << std::endl;
+        return 1;
+    }
+    if (k1 != 0 || k2 != 0) params.distCoeffs = (cv::Mat_<double>(1, 4) << k1, k2, 0, 0);
+
+    try {
+        std::filesystem::create_directories(outDir);
+        std::string gtFile = (outDir / "ground_truth.csv").string();
+        std::ofstream ofs(gtFile);
+        if (!ofs.is_open()) {
+            std::cerr << "Failed to open output file: " << gtFile << std::endl;
+            return 1;
+        }
+        ofs << "filename,marker_id,point_idx,class_id,model_x,model_y,image_x,image_y,visible" << std::endl;
+        ofs << std::setprecision(9);
+
+        fractalsynth::SceneGenerator generator(config);
+        cv::RNG rng(seed);
+        for (int i = 0; i < count; i++) {
+            fractalsynth::SceneGenerator::randomPose(params, rng, minScale, maxScale, tilt);
+            params.gradientAngle = rng.uniform(0.f, 360.f);
+            params.seed = rng.next();
+            fractalsynth::Scene scene = generator.render(params);
+
+            std::stringstream name;
+            name << std::setw(3) << std::setfill('0') << i + 1 << ext;
+            std::string imagePath = (outDir / name.str()).string();
+            if (!cv::imwrite(imagePath, scene.image, {cv::IMWRITE_JPEG_QUALITY, 95})) {
+                std::cerr << "Failed to write image: " << imagePath << std::endl;
+                return 1;
+            }
+            for (const auto& p : scene.points)
+                ofs << name.str() << "," << p.markerId << "," << p.pointIdx << "," << p.classId << ","
+                    << p.modelPoint.x << "," << p.modelPoint.y << "," << p.imagePoint.x << "," << p.imagePoint.y << ","
+                    << int(p.visible) << "\n";
+        }
+        std::cout << count << " images and ground truth saved to: " << outDir.string() << std::endl;
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return -1;
+    }
+    return 0;
+}
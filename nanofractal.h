@@ -34,7 +34,7 @@
  * nanofractal::MarkerDetector TheDetector = nanofractal::MarkerDetector("FRACTAL_5L_6", 0.85);
  * std::vector<cv::Point2f>p2d; std::vector<cv::Point3f>p3d;
  * auto markers=TheDetector.detect(image, p3d, p2d);
- * //Here you can call solvepnp using p3d and p2d points
+ * //Here you can call solvepnp using p3d and p2d points (or use detectPose, with the camera parameters set)
  * for(auto pt:p2d)
  *    cv::circle(image,pt,5,cv::Scalar(0,0,255), cv::FILLED);
  * for(const auto &m:markers)
@@ -58,6 +58,7 @@
 #include <opencv2/imgproc.hpp>
 #include <opencv2/highgui.hpp>
 #include <opencv2/calib3d.hpp>
+#include <opencv2/video/tracking.hpp>
 
 #include <map>
 #include <iostream>
@@ -67,6 +68,27 @@
 #include <limits>
 #include <algorithm>
 #include <cstring>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <exception>
+#include <atomic>
+#include <future>
+#include <fstream>
+#include <string>
+#include <cstdio>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <cerrno>
+#endif
 /**
  * The FractalMarkerDetector class detects fractal markers in the images passed
  *
@@ -75,9 +97,41 @@ namespace nanofractal{
   public:
     //@param fractal_config possible values (FRACTAL_2L_6,FRACTAL_3L_6,FRACTAL_4L_6,FRACTAL_5L_6)
     void setParams(std::string config, float markerSize=-1);
-    inline std::vector<FractalMarker> detect(const cv::Mat &img);
+    inline std::vector<FractalMarker> detect(const cv::Mat &img) const;
     inline std::vector<FractalMarker> detect(const cv::Mat &img, std::vector<cv::Point3f>& p3d,
-                                             std::vector<cv::Point2f>& p2d);
+                                             std::vector<cv::Point2f>& p2d) const;
+    //reentrant versions: pass one workspace per thread to share the detector between threads
+    inline std::vector<FractalMarker> detect(const cv::Mat &img, FractalDetectorWorkspace &ws) const;
+    inline std::vector<FractalMarker> detect(const cv::Mat &img, std::vector<cv::Point3f>& p3d,
+                                             std::vector<cv::Point2f>& p2d, FractalDetectorWorkspace &ws) const;
+    //raw camera buffers (gray, NV12, NV21, I420, YUYV, UYVY, BGR, Bayer) with row stride, read without converting to BGR
+    inline std::vector<FractalMarker> detect(const uchar *data, int width, int height, size_t stride, PixelFormat format,
+                                             FractalDetectorWorkspace &ws) const;
+    inline std::vector<FractalMarker> detect(const uchar *data, int width, int height, size_t stride, PixelFormat format,
+                                             std::vector<cv::Point3f>& p3d, std::vector<cv::Point2f>& p2d,
+                                             FractalDetectorWorkspace &ws) const;
+    //large JPEG files: markers searched on a 1/2, 1/4 or 1/8 decode, refined at full resolution around them
+    inline std::vector<FractalMarker> detectFile(const std::string &path, int reduction, bool refine,
+                                                 FractalDetectorWorkspace &ws, cv::Rect *region=nullptr) const;
+    inline std::vector<FractalMarker> detectFile(const std::string &path, int reduction, std::vector<cv::Point3f>& p3d,
+                                                 std::vector<cv::Point2f>& p2d, FractalDetectorWorkspace &ws,
+                                                 cv::Rect *region=nullptr) const;
+    //more configurations detected at once, sharing the candidate extraction. Markers and points are tagged with their set
+    int addMarkerSet(std::string config, float markerSize=-1);
+    //intrinsics and distortion: detection on distorted images without undistorting them
+    void setCameraParams(const cv::Mat &K, const cv::Mat &distCoeffs, const cv::Size &imageSize, bool undistortOutput=false, int lutStep=8);
+    //search radius of the projected model points: a fraction of their projected bit size (see MatchParams)
+    void setMatchParams(const MatchParams &params);
+    //subpixel refinement: window from the projected bit size of each point, parallel chunks (see RefineParams)
+    void setRefineParams(const RefineParams &params);
+    //camera pose (requires setCameraParams), started from the homography or from the pose of the previous frame
+    std::vector<FractalMarker> detectPose(const cv::Mat &img, FractalPose &pose, FractalDetectorWorkspace &ws,
+                                          const FractalPose *previous=nullptr) const;
+    void setPoseParams(const PoseParams &params);
+    //runs FAST in a second thread while the markers are searched (only in the detect versions computing p3d/p2d)
+    void setSpeculativeKeypoints(bool enable);
+    //function receiving the DetectionStats of every detect() call (see also FractalDetectorWorkspace::collectStats)
+    void setStatsCallback(std::function<void(const DetectionStats&)> callback);
   };
 }
 */
@@ -804,10 +858,10 @@ public:
     FractalMarker(int id, cv::Mat m, std::vector<cv::Point3f> corners, std::vector<int> id_submarkers);
     FractalMarker(){};
 
-    inline int nBits() { return _M.total(); }
-    inline cv::Mat mat(){ return _M; }
-    inline cv::Mat mask(){ return _mask; }
-    inline std::vector<int> subMarkers(){ return _submarkers; }
+    inline int nBits() const { return _M.total(); }
+    inline cv::Mat mat() const { return _M; }
+    inline cv::Mat mask() const { return _mask; }
+    inline const std::vector<int>& subMarkers() const { return _submarkers; }
     void addSubFractalMarker(FractalMarker submarker);
     // returns the distance of the marker side
     inline float getMarkerSize() const
@@ -818,6 +872,7 @@ public:
     inline void draw(cv::Mat &image,const cv::Scalar color=cv::Scalar(0,0,255))const;
 
     int id;
+    int setIndex=0;//marker set of the detector where it was found (see FractalMarkerDetector::addMarkerSet)
     std::vector<cv::KeyPoint> keypts; //Corners & class. First 4 corners are external
 private:
     cv::Mat _M;
@@ -912,6 +967,13 @@ public:
     FractalMarkerSet(){};
     FractalMarkerSet(std::string config);
     void convertToMeters(float size);
+    /**Draws the fractal marker in a sidePixels x sidePixels image (CV_8UC1) covering exactly its external marker.
+     * Use renderTransform() to know where each model point is in the image.
+     */
+    inline cv::Mat render(int sidePixels) const;
+    //Transform from the marker coordinates (keypts) to the pixels of render(sidePixels), the center of the top-left
+    //pixel being (0,0) as in the rest of OpenCV
+    inline cv::Matx33d renderTransform(int sidePixels) const;
 
     //Fractal configuration. id_marker
     std::map<int, FractalMarker> fractalMarkerCollection;
@@ -922,6 +984,56 @@ public:
     int idExternal;
 };
 
+cv::Matx33d FractalMarkerSet::renderTransform(int sidePixels) const
+{
+    const FractalMarker &external = fractalMarkerCollection.at(idExternal);
+    cv::Point2f tl = external.keypts[0].pt;
+    double scale = double(sidePixels) / external.getMarkerSize();
+    //y axis of the marker points upwards
+    return cv::Matx33d(scale, 0, -tl.x*scale - 0.5,
+                       0, -scale, tl.y*scale - 0.5,
+                       0, 0, 1);
+}
+
+cv::Mat FractalMarkerSet::render(int sidePixels) const
+{
+    cv::Mat image(sidePixels, sidePixels, CV_8UC1, cv::Scalar::all(255));
+    cv::Matx33d T = renderTransform(sidePixels);
+    //pixel edge nearest to a marker coordinate
+    auto toEdgeX = [&](float x){ return int(std::round(T(0,0)*x + T(0,2) + 0.5)); };
+    auto toEdgeY = [&](float y){ return int(std::round(T(1,1)*y + T(1,2) + 0.5)); };
+
+    //from the largest to the smallest marker, so that submarkers are drawn over the area their parent leaves for them
+    std::vector<const FractalMarker*> markers;
+    for(const auto &id_marker:fractalMarkerCollection)
+        markers.push_back(&id_marker.second);
+    std::sort(markers.begin(), markers.end(), [](const FractalMarker *a, const FractalMarker *b){
+        return a->getMarkerSize() > b->getMarkerSize();
+    });
+
+    for(const FractalMarker *marker:markers)
+    {
+        cv::Mat bits = marker->mat(), mask = marker->mask();
+        int nbitsWithBorder = bits.cols + 2;
+        float bitSize = marker->getMarkerSize() / nbitsWithBorder;
+        cv::Point2f tl = marker->keypts[0].pt;
+        for(int r=0; r<nbitsWithBorder; r++){
+            for(int c=0; c<nbitsWithBorder; c++){
+                uchar value = 0;//black border
+                if(r>0 && c>0 && r<nbitsWithBorder-1 && c<nbitsWithBorder-1){
+                    if(!mask.at<uchar>(r-1, c-1)) continue;//submarker area
+                    value = bits.at<uchar>(r-1, c-1) ? 255 : 0;
+                }
+                int x0 = toEdgeX(tl.x + c*bitSize), x1 = toEdgeX(tl.x + (c+1)*bitSize);
+                int y0 = toEdgeY(tl.y - r*bitSize), y1 = toEdgeY(tl.y - (r+1)*bitSize);
+                cv::Rect cell = cv::Rect(x0, y0, x1-x0, y1-y0) & cv::Rect(0, 0, sidePixels, sidePixels);
+                if(cell.area()>0) image(cell).setTo(cv::Scalar::all(value));
+            }
+        }
+    }
+    return image;
+}
+
 void FractalMarkerSet::convertToMeters(float size)
 {
     if (!(mInfoType == 0 || mInfoType == 2))
@@ -930,10 +1042,11 @@ void FractalMarkerSet::convertToMeters(float size)
     mInfoType = 1;
 
     // now, get the size of a pixel, and change scale
-    float pixSizeM = size / float(fractalMarkerCollection[idExternal].getMarkerSize());
+    float pixSizeM = size / float(fractalMarkerCollection.at(idExternal).getMarkerSize());
 
-    for (size_t i=0; i < fractalMarkerCollection.size(); i++)
-        for(auto &kpt:fractalMarkerCollection[i].keypts)
+    //markers ids are not necessarily consecutive, so iterate over the map itself
+    for (auto &id_marker:fractalMarkerCollection)
+        for(auto &kpt:id_marker.second.keypts)
             kpt.pt *= pixSizeM;
 }
 
@@ -1209,7 +1322,7 @@ FractalMarkerSet::FractalMarkerSet(std::string str)
     {
         FractalMarker &marker = id_marker.second;
         for(auto id:id_marker.second.subMarkers())
-            marker.addSubFractalMarker(fractalMarkerCollection[id]);
+            marker.addSubFractalMarker(fractalMarkerCollection.at(id));
 
         //Init marker kpts
         marker.getKeypts();
@@ -1218,292 +1331,2130 @@ FractalMarkerSet::FractalMarkerSet(std::string str)
     }
 }
 
+/**
+ * @brief Hardware event counts of a piece of code (see PerfCounters)
+ */
+struct HardwareCounters{
+    uint64_t cycles=0;
+    uint64_t instructions=0;
+    uint64_t l1dMisses=0;//L1 data cache read misses
+    uint64_t llcMisses=0;//last level cache misses
+    uint64_t branchMisses=0;
+
+    inline double ipc()const{ return cycles? double(instructions)/double(cycles) : 0; }
+    //misses per thousand instructions
+    inline double mpki(uint64_t misses)const{ return instructions? 1000.*double(misses)/double(instructions) : 0; }
+    inline HardwareCounters operator-(const HardwareCounters &c)const{
+        HardwareCounters r;
+        r.cycles=cycles-c.cycles;
+        r.instructions=instructions-c.instructions;
+        r.l1dMisses=l1dMisses-c.l1dMisses;
+        r.llcMisses=llcMisses-c.llcMisses;
+        r.branchMisses=branchMisses-c.branchMisses;
+        return r;
+    }
+    inline HardwareCounters& operator+=(const HardwareCounters &c){
+        cycles+=c.cycles;
+        instructions+=c.instructions;
+        l1dMisses+=c.l1dMisses;
+        llcMisses+=c.llcMisses;
+        branchMisses+=c.branchMisses;
+        return *this;
+    }
+};
 
 /**
- * @brief The MarkerDetector class is detecting the markers in the image passed
+ * @brief Hardware performance counters of the calling thread, read with Linux perf_event_open (user space only).
  *
+ * The counters cannot be opened outside Linux, when the kernel does not permit it (perf_event_paranoid, containers
+ * without CAP_PERFMON) or when the CPU has no PMU (some VMs). Then available() is false, error() tells why and read()
+ * returns zeros. Events the CPU does not support stay at zero. Reading costs one system call.
  */
-class FractalMarkerDetector{
+class PerfCounters{
 public:
-    /**@param fractal_config possible values (FRACTAL_2L_6,FRACTAL_3L_6,FRACTAL_4L_6,FRACTAL_5L_6)
-     */
-    void setParams(std::string fractal_config, float markerSize=-1);
-    inline std::vector<FractalMarker> detect(const cv::Mat &img);
-    inline std::vector<FractalMarker> detect(const cv::Mat &img, std::vector<cv::Point3f>& p3d,
-                                             std::vector<cv::Point2f>& p2d);
+    inline PerfCounters();
+    inline ~PerfCounters();
+    PerfCounters(const PerfCounters&)=delete;
+    PerfCounters& operator=(const PerfCounters&)=delete;
+
+    inline bool available()const{ return _fds[0]>=0; }
+    inline const std::string& error()const{ return _error; }
+    //counts since the counters were opened
+    inline HardwareCounters read()const;
+    //counters of the calling thread, opened on first use
+    static inline PerfCounters& thisThread(){
+        thread_local PerfCounters counters;
+        return counters;
+    }
 private:
-    FractalMarkerSet fractalMarkerSet;
-    static inline  std::vector<cv::Point2f> sort( const  std::vector<cv::Point2f> &marker);
-    static inline  float  getSubpixelValue(const cv::Mat &im_grey,const cv::Point2f &p);
-    static inline  int    getMarkerId(const cv::Mat &bits,int &nrotations, const std::vector<int>& markersId, const FractalMarkerSet& markerSet);
-    static inline  int    perimeter(const std::vector<cv::Point2f>& a);
-
+    enum{CYCLES=0,INSTRUCTIONS,L1D_MISSES,LLC_MISSES,BRANCH_MISSES,NCOUNTERS};
+    int _fds[NCOUNTERS];
+    int _groupIdx[NCOUNTERS];//position of each counter in the group read. -1 if not opened
+    int _nOpened=0;
+    std::string _error;
 };
 
+#ifdef __linux__
+PerfCounters::PerfCounters(){
+    for(int i=0;i<NCOUNTERS;i++) _fds[i]=_groupIdx[i]=-1;
+    const uint32_t types[NCOUNTERS]={PERF_TYPE_HARDWARE,PERF_TYPE_HARDWARE,PERF_TYPE_HW_CACHE,PERF_TYPE_HARDWARE,PERF_TYPE_HARDWARE};
+    const uint64_t configs[NCOUNTERS]={PERF_COUNT_HW_CPU_CYCLES,PERF_COUNT_HW_INSTRUCTIONS,
+                                       PERF_COUNT_HW_CACHE_L1D|(PERF_COUNT_HW_CACHE_OP_READ<<8)|(PERF_COUNT_HW_CACHE_RESULT_MISS<<16),
+                                       PERF_COUNT_HW_CACHE_MISSES,PERF_COUNT_HW_BRANCH_MISSES};
+    //cycles leads the group, so all the counters are scheduled together
+    for(int i=0;i<NCOUNTERS;i++){
+        perf_event_attr attr;
+        std::memset(&attr,0,sizeof(attr));
+        attr.size=sizeof(attr);
+        attr.type=types[i];
+        attr.config=configs[i];
+        attr.exclude_kernel=1;
+        attr.exclude_hv=1;
+        attr.read_format=PERF_FORMAT_GROUP|PERF_FORMAT_TOTAL_TIME_ENABLED|PERF_FORMAT_TOTAL_TIME_RUNNING;
+        int fd=int(syscall(__NR_perf_event_open,&attr,0,-1,i==0?-1:_fds[0],0));
+        if(fd<0){
+            if(i==0){
+                _error=std::string("perf_event_open: ")+std::strerror(errno);
+                return;
+            }
+            continue;
+        }
+        _fds[i]=fd;
+        _groupIdx[i]=_nOpened++;
+    }
+}
 
-void FractalMarkerDetector::setParams(std::string config, float markerSize)
-{
-    fractalMarkerSet = FractalMarkerSet(config);
-    if(markerSize != -1) fractalMarkerSet.convertToMeters(markerSize);
-
+PerfCounters::~PerfCounters(){
+    for(int i=NCOUNTERS-1;i>=0;i--)
+        if(_fds[i]>=0) close(_fds[i]);
 }
 
-#include <chrono>
-// ...existing code...
+HardwareCounters PerfCounters::read()const{
+    HardwareCounters res;
+    if(!available()) return res;
+    uint64_t data[3+NCOUNTERS];//nr, time enabled, time running, values
+    if(::read(_fds[0],data,sizeof(data))<ssize_t(3*sizeof(uint64_t))) return res;
+    //scale the counts if the group was multiplexed with other events
+    double scale= data[2]>0 ? double(data[1])/double(data[2]) : 0;
+    auto value=[&](int counter)->uint64_t{
+        int idx=_groupIdx[counter];
+        return idx<0 || uint64_t(idx)>=data[0] ? 0 : uint64_t(double(data[3+idx])*scale);
+    };
+    res.cycles=value(CYCLES);
+    res.instructions=value(INSTRUCTIONS);
+    res.l1dMisses=value(L1D_MISSES);
+    res.llcMisses=value(LLC_MISSES);
+    res.branchMisses=value(BRANCH_MISSES);
+    return res;
+}
+#else
+PerfCounters::PerfCounters(){
+    for(int i=0;i<NCOUNTERS;i++) _fds[i]=_groupIdx[i]=-1;
+    _error="hardware counters are only available on Linux";
+}
+PerfCounters::~PerfCounters(){}
+HardwareCounters PerfCounters::read()const{ return HardwareCounters(); }
+#endif
 
-std::vector<FractalMarker> FractalMarkerDetector::detect(const cv::Mat &img, std::vector<cv::Point3f>& p3d,
-                                                  std::vector<cv::Point2f>& p2d)
-{
-    using namespace std::chrono;
-    auto t0 = high_resolution_clock::now();
+/**
+ * @brief Time spent in each stage of one detect() call and size of the intermediate results.
+ *
+ * Collected only if the workspace has collectStats set or the detector has a stats callback. Define
+ * NANOFRACTAL_NO_STATS before including this file to remove the collection code altogether, and NANOFRACTAL_PERF to
+ * also collect the hardware counters of each stage (two extra system calls per stage).
+ */
+struct DetectionStats{
+    enum Stage{GRAY=0,THRESHOLD,CONTOURS,DECODE,FAST,FILTER,CLASSIFY,INDEX_BUILD,HOMOGRAPHY,MATCH,SUBPIX,NSTAGES};
+    double stageMs[NSTAGES]={};//milliseconds spent in each stage. Zero for the stages not run
+    double totalMs=0;
+    int contours=0;//contours found in the thresholded image
+    int quads=0;//contours approximated by a convex quadrilateral
+    int candidates=0;//quads decoded as markers, without duplicates
+    //reasons why contours and quads were discarded
+    int rejectedSmall=0;//contour too short to be a marker
+    int rejectedNotQuad=0;//contour not approximated by a convex quadrilateral
+    int rejectedBorder=0;//quad without a black border for any of the bit sizes of the set
+    int rejectedCode=0;//quad with a black border but a code not in the set
+    int rejectedDuplicate=0;//marker found more than once (the largest one is kept)
+    int keypoints=0;//FAST keypoints
+    int keypointsFiltered=0;//keypoints left by kfilter
+    int queries=0;//model points searched in the kd-tree
+    int matches=0;//3d-2d correspondences found
+    HardwareCounters stageCounters[NSTAGES];//only with NANOFRACTAL_PERF. Zero if the counters are not available
+    bool countersAvailable=false;//set when the detection finishes, from the counters of the detecting thread
+
+    static inline const char* stageName(int stage){
+        static const char* names[NSTAGES]={"gray","threshold","contours","decode","fast","filter","classify",
+                                           "index_build","homography","match","subpix"};
+        return names[stage];
+    }
+};
 
-    cv::Mat bwimage;
-    if(img.channels()==3)
-        cv::cvtColor(img,bwimage,cv::COLOR_BGR2GRAY);
-    else bwimage=img;
-    auto t1 = high_resolution_clock::now();
-    // std::cout << "[nanofractal]  Convert to gray: " << duration<double, std::milli>(t1-t0).count() << " ms" << std::endl;
+/**
+ * @brief Records begin/end events of the detection stages and of the worker threads, to see in a timeline where the
+ * time of each frame goes and how the threads overlap.
+ *
+ * The library only records events if NANOFRACTAL_TRACE is defined before including this file (otherwise the hooks are
+ * compiled out) and the tracer is enabled. Each thread writes into its own ring buffer, without locks, keeping its
+ * last events. dump() writes them in the Chrome trace format, which can be opened in https://ui.perfetto.dev or
+ * chrome://tracing. Example:
+ *
+ * nanofractal::FractalTracer::instance().enable(true);
+ * for(...) detector.detect(frame, p3d, p2d, ws);
+ * nanofractal::FractalTracer::instance().dump("trace.json");
+ */
+class FractalTracer{
+public:
+    static inline FractalTracer& instance(){
+        static FractalTracer tracer;
+        return tracer;
+    }
+    FractalTracer(const FractalTracer&)=delete;
+    FractalTracer& operator=(const FractalTracer&)=delete;
+
+    inline void enable(bool enable){ _enabled.store(enable, std::memory_order_relaxed); }
+    inline bool enabled() const { return _enabled.load(std::memory_order_relaxed); }
+    //events kept per thread, rounded up to a power of two. Only affects the threads not traced yet
+    inline void setBufferSize(size_t nEvents);
+    //name of the calling thread in the trace
+    inline void setThreadName(const std::string &name);
+    //events of the calling thread. name must outlive the tracer (a string literal)
+    inline void begin(const char *name){ record(name,'B'); }
+    inline void end(const char *name){ record(name,'E'); }
+
+    //Writes the events recorded in Chrome trace JSON. Call it (and clear) while no thread is recording: the oldest
+    //events of a thread recording at the same time could be overwritten while they are written
+    inline bool dump(const std::string &path) const;
+    inline void dump(std::ostream &os) const;
+    inline void clear();
+private:
+    struct Event{
+        const char *name;
+        int64_t ns;//since the creation of the tracer
+        char phase;//'B' or 'E'
+    };
+    struct ThreadBuffer{
+        int tid=0;
+        std::string name;
+        std::vector<Event> events;
+        std::atomic<uint64_t> count{0};//events written so far. The last events.size() are kept
+        std::atomic<bool> active{true};//false once its thread has finished: the buffer can be reused
+    };
+    struct ThreadState{
+        ThreadBuffer *buffer=nullptr;
+        std::string name;
+        ~ThreadState(){ if(buffer) buffer->active=false; }
+    };
 
-    //Fractal marker detection
-    auto t2 = high_resolution_clock::now();
-    std::vector<FractalMarker> detected =  detect(bwimage);
-    auto t3 = high_resolution_clock::now();
-    // std::cout << "[nanofractal] Marker detection: " << duration<double, std::milli>(t3-t2).count() << " ms" << std::endl;
+    FractalTracer():_epoch(std::chrono::steady_clock::now()){}
+    static inline ThreadState& threadState(){
+        thread_local ThreadState state;
+        return state;
+    }
+    inline ThreadBuffer& threadBuffer();
+    inline void record(const char *name, char phase){
+        if(!enabled()) return;
+        ThreadBuffer &b=threadBuffer();
+        uint64_t n=b.count.load(std::memory_order_relaxed);
+        Event &e=b.events[n&(b.events.size()-1)];
+        e.name=name;
+        e.ns=std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now()-_epoch).count();
+        e.phase=phase;
+        b.count.store(n+1, std::memory_order_release);
+    }
 
-    if(detected.size() > 0)
-    {
-        //External corners to compute homography
-        auto t4 = high_resolution_clock::now();
-        std::vector<cv::Point2f>imgpoints;
-        std::vector<cv::Point3f>objpoints;
-        for(auto marker:detected)
-        {
-            for(auto p2d:marker)
-                imgpoints.push_back(p2d);
+    std::atomic<bool> _enabled{false};
+    size_t _bufferSize=1<<16;
+    std::chrono::steady_clock::time_point _epoch;
+    mutable std::mutex _mtx;//protects the list of buffers, not their events
+    std::vector<std::shared_ptr<ThreadBuffer>> _buffers;
+};
 
-            for(int c=0; c<4; c++)
-            {
-                cv::KeyPoint kpt = fractalMarkerSet.fractalMarkerCollection[marker.id].getKeypts()[c];
-                objpoints.push_back(cv::Point3f(kpt.pt.x, kpt.pt.y, 0));
-            }
-        }
-        auto t5 = high_resolution_clock::now();
-        // std::cout << "[nanofractal] Homography prep: " << duration<double, std::milli>(t5-t4).count() << " ms" << std::endl;
-
-        //FAST
-        auto t6 = high_resolution_clock::now();
-        std::vector<cv::KeyPoint> kpoints;
-        cv::Ptr<cv::FastFeatureDetector> fd = cv::FastFeatureDetector::create();
-        fd->detect(bwimage, kpoints);
-        auto t7 = high_resolution_clock::now();
-        // std::cout << "[nanofractal] FAST features: " << duration<double, std::milli>(t7-t6).count() << " ms" << std::endl;
-
-        //Filter kpoints (low response) and removing duplicated.
-        auto t8 = high_resolution_clock::now();
-        _private::kfilter(kpoints);
-        _private::assignClass(bwimage, kpoints);
-        auto t9 = high_resolution_clock::now();
-        // std::cout << "[nanofractal] Keypoint filtering & classification: " << duration<double, std::milli>(t9-t8).count() << " ms" << std::endl;
-
-        auto t10 = high_resolution_clock::now();
-        _private::picoflann::KdTreeIndex<2,_private::PicoFlann_KeyPointAdapter>  kdtree;
-        kdtree.build(kpoints);
-        auto t11 = high_resolution_clock::now();
-        // std::cout << "[nanofractal] KD-tree build: " << duration<double, std::milli>(t11-t10).count() << " ms" << std::endl;
-
-        auto t12 = high_resolution_clock::now();
-        cv::Mat H = cv::findHomography(objpoints, imgpoints);
-        auto t13 = high_resolution_clock::now();
-        // std::cout << "[nanofractal] Homography calc: " << duration<double, std::milli>(t13-t12).count() << " ms" << std::endl;
-
-        auto t14 = high_resolution_clock::now();
-        for(auto &fm:fractalMarkerSet.fractalMarkerCollection)
-        {
-            std::vector<cv::Point2f> imgPoints;
-            std::vector<cv::Point2f> objPoints;
-            std::vector<cv::KeyPoint> objKeyPoints = fm.second.getKeypts();
+void FractalTracer::setBufferSize(size_t nEvents){
+    std::unique_lock<std::mutex> lock(_mtx);
+    _bufferSize=1;
+    while(_bufferSize<nEvents) _bufferSize<<=1;
+}
 
-            for(auto kpt : objKeyPoints)
-                objPoints.push_back(cv::Point2f(kpt.pt.x, kpt.pt.y));
+void FractalTracer::setThreadName(const std::string &name){
+    ThreadState &state=threadState();
+    state.name=name;
+    if(state.buffer){
+        std::unique_lock<std::mutex> lock(_mtx);
+        state.buffer->name=name;
+    }
+}
 
-            cv::perspectiveTransform(objPoints, imgPoints, H);
+FractalTracer::ThreadBuffer& FractalTracer::threadBuffer(){
+    ThreadState &state=threadState();
+    if(state.buffer) return *state.buffer;
+    std::unique_lock<std::mutex> lock(_mtx);
+    //threads created per frame (std::async) reuse the buffer of a finished thread with the same name, so they share
+    //its track instead of adding a new buffer per frame
+    for(auto &b:_buffers)
+        if(!state.name.empty() && !b->active && b->name==state.name && b->events.size()==_bufferSize){
+            b->active=true;
+            state.buffer=b.get();
+            return *state.buffer;
+        }
+    std::shared_ptr<ThreadBuffer> b=std::make_shared<ThreadBuffer>();
+    b->tid=int(_buffers.size())+1;
+    b->name=state.name.empty()? "thread "+std::to_string(b->tid) : state.name;
+    b->events.resize(_bufferSize);
+    _buffers.push_back(b);
+    state.buffer=b.get();
+    return *state.buffer;
+}
 
-            //We consider only markers whose internal points are separated by a specific distance.
-            bool consider=true;
-            for(size_t i=0; i<imgPoints.size()-1 && consider; i++)
-                for(size_t j=i+1; j<imgPoints.size() && consider; j++)
-                    if(pow(imgPoints[i].x-imgPoints[j].x, 2) + pow(imgPoints[i].y-imgPoints[j].y, 2) < 150)
-                        consider=false;
+bool FractalTracer::dump(const std::string &path) const{
+    std::ofstream ofs(path);
+    if(!ofs.is_open()) return false;
+    dump(ofs);
+    return bool(ofs);
+}
 
-            if(consider)
-            {
-                for(size_t idx=0; idx<imgPoints.size(); idx++)
-                {
-                    if(imgPoints[idx].x > 0 && imgPoints[idx].x < img.cols
-                            && imgPoints[idx].y>0 && imgPoints[idx].y<img.rows)
-                    {
-                        std::vector<std::pair<uint32_t, double>> res = kdtree.radiusSearch(kpoints, imgPoints[idx], 10);
-                        if(res.size() == 1)
-                        {
-                            if(kpoints[res[0].first].class_id == objKeyPoints[idx].class_id)
-                            {
-                                p2d.push_back(kpoints[res[0].first].pt);
-                                p3d.push_back(cv::Point3f(objPoints[idx].x, objPoints[idx].y, 0));
-                            }
-                        }
-                    }
-                }
-            }
-            else
-            {
-                //If a marker is detected and it is not possible take all their corners,
-                //at least take the external one!
-                for(auto markerDetected:detected)
-                {
-                    if(markerDetected.id == fm.first)
-                    {
-                        for(int c=0; c<4; c++)
-                        {
-                            cv::Point2f pt = markerDetected.keypts[c].pt;
-                            p3d.push_back(cv::Point3f(pt.x,pt.y,0));
-                            p2d.push_back(markerDetected[c]);
-                        }
-                        break;
-                    }
-                }
-            }
+void FractalTracer::dump(std::ostream &os) const{
+    auto escape=[](const std::string &str){
+        std::string res;
+        for(char c:str){
+            if(c=='"' || c=='\\') res+='\\';
+            if(static_cast<unsigned char>(c)>=0x20) res+=c;
         }
-        auto t15 = high_resolution_clock::now();
-        // std::cout << "[nanofractal] Keypoints matching: " << duration<double, std::milli>(t15-t14+t11-t10).count() << " ms" << std::endl;
-
-        if(p2d.size()>0)
-        {
-            auto t16 = high_resolution_clock::now();
-            //corner subpixel
-            cv::Size winSize = cv::Size(4, 4);
-            cv::Size zeroZone = cv::Size( -1, -1 );
-            cv::TermCriteria criteria( cv::TermCriteria::MAX_ITER | cv::TermCriteria::EPS, 12, 0.005);
-            cornerSubPix(bwimage, p2d, winSize, zeroZone, criteria);
-            auto t17 = high_resolution_clock::now();
-            // std::cout << "[nanofractal] Subpixel refinement: " << duration<double, std::milli>(t17-t16).count() << " ms" << std::endl;
+        return res;
+    };
+    std::unique_lock<std::mutex> lock(_mtx);
+    os<<"{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+    bool first=true;
+    char ts[32];
+    for(const auto &b:_buffers){
+        os<<(first?"":",\n")<<"{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":"<<b->tid
+          <<",\"args\":{\"name\":\""<<escape(b->name)<<"\"}}";
+        first=false;
+        uint64_t n=b->count.load(std::memory_order_acquire);
+        uint64_t size=b->events.size();
+        //ends without their begin (overwritten in the ring) are skipped
+        int depth=0;
+        for(uint64_t i=(n>size?n-size:0);i<n;i++){
+            const Event &e=b->events[i&(size-1)];
+            if(e.phase=='E'){
+                if(depth==0) continue;
+                depth--;
+            }
+            else depth++;
+            snprintf(ts,sizeof(ts),"%.3f",double(e.ns)/1000.);
+            os<<",\n{\"name\":\""<<e.name<<"\",\"cat\":\"nanofractal\",\"ph\":\""<<e.phase<<"\",\"ts\":"<<ts
+              <<",\"pid\":1,\"tid\":"<<b->tid<<"}";
         }
     }
+    os<<"\n]}\n";
+}
 
-    auto tEnd = high_resolution_clock::now();
-    // std::cout << "[nanofractal] Total: " << duration<double, std::milli>(tEnd-t0).count() << " ms" << std::endl;
+void FractalTracer::clear(){
+    std::unique_lock<std::mutex> lock(_mtx);
+    for(auto &b:_buffers) b->count=0;
+}
+
+namespace _private{
+//Records the begin and end events of a scope in the FractalTracer. Empty unless NANOFRACTAL_TRACE is defined
+class TraceScope{
+public:
+#ifdef NANOFRACTAL_TRACE
+    TraceScope(const char *name):_name(FractalTracer::instance().enabled()?name:nullptr){
+        if(_name) FractalTracer::instance().begin(_name);
+    }
+    ~TraceScope(){ if(_name) FractalTracer::instance().end(_name); }
+private:
+    const char *_name;
+#else
+    TraceScope(const char *){}
+#endif
+};
 
-    return detected;
+inline void traceThreadName(const std::string &name){
+#ifdef NANOFRACTAL_TRACE
+    FractalTracer::instance().setThreadName(name);
+#else
+    (void)name;
+#endif
 }
 
-std::vector<FractalMarker>  FractalMarkerDetector::detect(const cv::Mat &img){
+//Adds the time elapsed in a scope to one of the stages of the stats (if not null), and traces it
+class StageTimer{
+public:
+#if !defined(NANOFRACTAL_NO_STATS) || defined(NANOFRACTAL_TRACE)
+    StageTimer(DetectionStats *stats, int stage):_stats(stats){
+        start(stage);
+    }
+    ~StageTimer(){ stop(); }
+    //stops measuring the current stage and starts with the stage passed
+    inline void next(int stage){
+        stop();
+        start(stage);
+    }
+    inline void stop(){
+        if(_stage<0) return;
+        if(_stats){
+            _stats->stageMs[_stage]+=std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now()-_start).count();
+#ifdef NANOFRACTAL_PERF
+            //per thread counters: the speculative FAST is measured in its own thread
+            PerfCounters &counters=PerfCounters::thisThread();
+            _stats->stageCounters[_stage]+=counters.read()-_counters;
+#endif
+        }
+#ifdef NANOFRACTAL_TRACE
+        if(_traced) FractalTracer::instance().end(DetectionStats::stageName(_stage));
+#endif
+        _stage=-1;
+    }
+private:
+    DetectionStats *_stats;
+    int _stage=-1;
+    std::chrono::high_resolution_clock::time_point _start;
+#ifdef NANOFRACTAL_TRACE
+    bool _traced=false;
+#endif
+#ifdef NANOFRACTAL_PERF
+    HardwareCounters _counters;
+#endif
+    inline void start(int stage){
+        _stage=stage;
+        if(_stats){
+#ifdef NANOFRACTAL_PERF
+            _counters=PerfCounters::thisThread().read();
+#endif
+            _start=std::chrono::high_resolution_clock::now();
+        }
+#ifdef NANOFRACTAL_TRACE
+        _traced=FractalTracer::instance().enabled();
+        if(_traced) FractalTracer::instance().begin(DetectionStats::stageName(_stage));
+#endif
+    }
+#else
+    StageTimer(DetectionStats *, int){}
+    inline void next(int){}
+    inline void stop(){}
+#endif
+};
+}
 
-    cv::Mat bwimage,thresImage;
+/**
+ * @brief Layout of the raw camera buffers accepted by FractalMarkerDetector::detect
+ */
+enum PixelFormat{
+    PIXEL_GRAY8=0,//one byte per pixel
+    PIXEL_NV12,//Y plane followed by the interleaved UV plane. Only the Y plane is read
+    PIXEL_NV21,//Y plane followed by the interleaved VU plane
+    PIXEL_I420,//Y, U and V planes
+    PIXEL_YUYV,//Y0 U Y1 V (YUY2)
+    PIXEL_UYVY,//U Y0 V Y1
+    PIXEL_BGR24,
+    //8 bit Bayer mosaics, named after their top left 2x2 cell. Detected on a half resolution luma image built from
+    //the cells (no demosaicing). The points returned are in full resolution coordinates
+    PIXEL_BAYER_RGGB,
+    PIXEL_BAYER_BGGR,
+    PIXEL_BAYER_GRBG,
+    PIXEL_BAYER_GBRG
+};
 
-    std::vector<std::pair<int, std::vector<cv::Point2f>>> candidates;
+namespace _private{
+/**
+ * Sparse remap tables of a camera lens: the undistorted position of a grid of image pixels, and the distorted
+ * position of a grid of undistorted pixels, one node every step pixels. Points in between are interpolated, so mapping
+ * a point costs a few multiplications instead of the iterative undistortion of OpenCV.
+ */
+class LensLut{
+public:
+    inline LensLut(const cv::Mat &K, const cv::Mat &distCoeffs, const cv::Size &imageSize, int step);
+    //image pixel to undistorted (pinhole) pixel
+    inline cv::Point2f undistort(const cv::Point2f &p)const{ return _undistort.at(p); }
+    //undistorted pixel to image pixel
+    inline cv::Point2f distort(const cv::Point2f &p)const{ return _distort.at(p); }
+private:
+    struct Grid{
+        cv::Point2f origin;
+        float step=1;
+        int cols=0,rows=0;
+        std::vector<cv::Point2f> nodes;//row major
+
+        inline void create(const cv::Point2f &tl, const cv::Point2f &br, float stepSize){
+            origin=tl;
+            step=stepSize;
+            cols=int(std::ceil((br.x-tl.x)/step))+1;
+            rows=int(std::ceil((br.y-tl.y)/step))+1;
+            nodes.resize(size_t(cols)*size_t(rows));
+            for(int r=0;r<rows;r++)
+                for(int c=0;c<cols;c++) nodes[r*cols+c]=origin+cv::Point2f(c*step,r*step);
+        }
+        //bilinear interpolation, clamped to the grid
+        inline cv::Point2f at(const cv::Point2f &p)const{
+            float fx=std::min(std::max((p.x-origin.x)/step,0.f),float(cols-1)-1e-3f);
+            float fy=std::min(std::max((p.y-origin.y)/step,0.f),float(rows-1)-1e-3f);
+            int c=int(fx),r=int(fy);
+            float ax=fx-c,ay=fy-r;
+            const cv::Point2f *n0=&nodes[r*cols+c],*n1=n0+cols;
+            cv::Point2f d=p-(origin+cv::Point2f(fx*step,fy*step));//outside the grid: keep the offset
+            return (1-ay)*((1-ax)*n0[0]+ax*n0[1])+ay*((1-ax)*n1[0]+ax*n1[1])+d;
+        }
+    };
+    Grid _undistort,_distort;
+};
 
-    std::vector<FractalMarker> DetectedFractalMarkers;
+LensLut::LensLut(const cv::Mat &K, const cv::Mat &distCoeffs, const cv::Size &imageSize, int step){
+    step=std::max(1,step);
+    cv::Mat Kd;
+    K.convertTo(Kd,CV_64F);
+    //image nodes, covering one step beyond the image
+    _undistort.create(cv::Point2f(-step,-step), cv::Point2f(imageSize.width+step,imageSize.height+step), float(step));
+    std::vector<cv::Point2f> undistorted;
+    cv::undistortPoints(_undistort.nodes, undistorted, Kd, distCoeffs, cv::noArray(), Kd);
+    _undistort.nodes=undistorted;
+
+    //undistorted nodes, covering the undistorted image. Far outside it the distortion model is not monotonic
+    cv::Point2f tl=undistorted[0],br=undistorted[0];
+    for(const auto &u:undistorted){
+        tl=cv::Point2f(std::min(tl.x,u.x),std::min(tl.y,u.y));
+        br=cv::Point2f(std::max(br.x,u.x),std::max(br.y,u.y));
+    }
+    _distort.create(tl-cv::Point2f(step,step), br+cv::Point2f(step,step), float(step));
+    std::vector<cv::Point3f> rays;
+    double fx=Kd.at<double>(0,0),fy=Kd.at<double>(1,1),cx=Kd.at<double>(0,2),cy=Kd.at<double>(1,2);
+    for(const auto &n:_distort.nodes) rays.push_back(cv::Point3f(float((n.x-cx)/fx),float((n.y-cy)/fy),1.f));
+    std::vector<cv::Point2f> distorted;
+    cv::projectPoints(rays, cv::Vec3d(0,0,0), cv::Vec3d(0,0,0), Kd, distCoeffs, distorted);
+    _distort.nodes=distorted;
+}
 
-    //first, convert to bw
-    if(img.channels()==3)
-        cv::cvtColor(img,bwimage,cv::COLOR_BGR2GRAY);
-    else bwimage=img;
+//Smallest scale factor of the homography H (CV_64F) around the model point p: the smallest singular value of its
+//Jacobian there. A model length l becomes at least l*scale pixels in any direction
+inline float homographyMinScale(const cv::Mat &H, const cv::Point2f &p){
+    const double *h=H.ptr<double>(0);
+    double w=h[6]*p.x+h[7]*p.y+h[8];
+    if(std::abs(w)<1e-12) return 0.f;
+    double u=(h[0]*p.x+h[1]*p.y+h[2])/w, v=(h[3]*p.x+h[4]*p.y+h[5])/w;
+    double a=(h[0]-u*h[6])/w, b=(h[1]-u*h[7])/w, c=(h[3]-v*h[6])/w, d=(h[4]-v*h[7])/w;
+    //eigenvalues of J^T J: (t -+ sqrt(t^2-4det^2))/2
+    double t=a*a+b*b+c*c+d*d, det=a*d-b*c;
+    double minEig=0.5*(t-std::sqrt(std::max(0.,t*t-4*det*det)));
+    return float(std::sqrt(std::max(0.,minEig)));
+}
 
+//Model point projected in the image, to be searched among the keypoints
+struct ModelQuery{
+    cv::Point2f pt;//projected point, or the corner itself if direct
+    cv::Point3f obj;
+    float radius=0;//search radius, in pixels
+    float bitPixels=0;//size of a bit of the marker around the point, in pixels
+    int classId=-1;
+    int modelIdx=-1;//index among the keypts of all the markers of all the sets
+    int markerSet=0;
+    int count=0;//keypoints of any class found within the radius
+    bool direct=false;//corner of a detected marker taken as it is, without search
+};
+struct PicoFlann_ModelQueryAdapter{
+    inline float operator( )(const ModelQuery &elem, int dim)const { return dim==0?elem.pt.x:elem.pt.y; }
+    inline float operator( )(const cv::KeyPoint &elem, int dim)const { return dim==0?elem.pt.x:elem.pt.y; }
+};
 
-    ///////////////////////////////////////////////////
-    // Adaptive Threshold to detect border
-    int adaptiveWindowSize=std::max(int(3),int(15*float(bwimage.cols)/1920.));
-    if( adaptiveWindowSize%2==0) adaptiveWindowSize++;
-    cv::adaptiveThreshold(bwimage, thresImage, 255.,cv::ADAPTIVE_THRESH_MEAN_C, cv::THRESH_BINARY_INV, adaptiveWindowSize, 7);
+//Keypoint of the class of a model point, within its search radius
+struct MatchCandidate{
+    int query;
+    int keypoint;
+    float dist2;//squared distance, in pixels
+};
 
-    ///////////////////////////////////////////////////
-    // compute marker candidates by detecting contours
-    //if image is eroded, minSize must be adapted
-    std::vector<std::vector<cv::Point>> contours;
-    std::vector<cv::Point> approxCurve;
-    cv::findContours(thresImage, contours, cv::noArray(), cv::RETR_LIST, cv::CHAIN_APPROX_NONE);
+//Minimum cost assignment of a dense rows x cols cost matrix (row major), rows<=cols (Hungarian algorithm with
+//potentials, O(rows^2 cols)). Returns the column assigned to each row
+inline std::vector<int> hungarian(const std::vector<double> &cost, int rows, int cols){
+    const double inf=std::numeric_limits<double>::max();
+    std::vector<double> u(rows+1,0), v(cols+1,0), minv(cols+1);
+    std::vector<int> p(cols+1,0), way(cols+1,0);//p[j]: row (1 based) assigned to column j
+    std::vector<uchar> used(cols+1);
+    for(int i=1; i<=rows; i++){
+        p[0]=i;
+        int j0=0;
+        std::fill(minv.begin(), minv.end(), inf);
+        std::fill(used.begin(), used.end(), 0);
+        do{
+            used[j0]=1;
+            int i0=p[j0], j1=0;
+            double delta=inf;
+            for(int j=1; j<=cols; j++){
+                if(used[j]) continue;
+                double cur=cost[(i0-1)*cols+j-1]-u[i0]-v[j];
+                if(cur<minv[j]){ minv[j]=cur; way[j]=j0; }
+                if(minv[j]<delta){ delta=minv[j]; j1=j; }
+            }
+            for(int j=0; j<=cols; j++){
+                if(used[j]){ u[p[j]]+=delta; v[j]-=delta; }
+                else minv[j]-=delta;
+            }
+            j0=j1;
+        }while(p[j0]!=0);
+        do{ int j1=way[j0]; p[j0]=p[j1]; j0=j1; }while(j0);
+    }
+    std::vector<int> rowMatch(rows,-1);
+    for(int j=1; j<=cols; j++)
+        if(p[j]) rowMatch[p[j]-1]=j-1;
+    return rowMatch;
+}
 
-    //analyze  it is a paralelepiped likely to be the marker
-    for (unsigned int i = 0; i < contours.size(); i++)
-    {
-        // check it is a possible element by first checking that is is large enough
-        if (120 > int(contours[i].size())  ) continue;
-        // can approximate to a convex rect?
-        cv::approxPolyDP(contours[i], approxCurve, double(contours[i].size()) * 0.05, true);
+//Resolves the candidates into one-to-one correspondences: match[q] receives the keypoint of query q, or -1. Greedy:
+//by increasing distance. Optimal: the assignment of maximum size and then minimum total distance, in each connected
+//component of the candidates with at most maxComponent queries and keypoints (greedy in the larger ones).
+//Sorts the candidates. owner is a buffer of one element per keypoint, so no conflict is searched linearly
+inline void assignCandidates(std::vector<MatchCandidate> &cands, int nQueries, int nKeypoints, bool optimal,
+                             int maxComponent, std::vector<int> &match, std::vector<int> &owner){
+    match.assign(nQueries,-1);
+    owner.assign(nKeypoints,-1);
+    auto closer=[](const MatchCandidate &a, const MatchCandidate &b){
+        if(a.dist2!=b.dist2) return a.dist2<b.dist2;
+        return a.query!=b.query ? a.query<b.query : a.keypoint<b.keypoint;
+    };
+    auto greedy=[&](size_t first, size_t last){
+        for(size_t i=first; i<last; i++){
+            const MatchCandidate &c=cands[i];
+            if(match[c.query]>=0 || owner[c.keypoint]>=0) continue;
+            match[c.query]=c.keypoint;
+            owner[c.keypoint]=c.query;
+        }
+    };
+    if(!optimal){
+        std::sort(cands.begin(), cands.end(), closer);
+        greedy(0, cands.size());
+        return;
+    }
 
-        if (approxCurve.size() != 4 || !cv::isContourConvex(approxCurve)) continue;
-        // add the points
-        std::vector<cv::Point2f> markerCandidate;
-        for (int j = 0; j < 4; j++)
-            markerCandidate.push_back( cv::Point2f( approxCurve[j].x,approxCurve[j].y));
+    //connected components: union-find of the queries (0..nQueries-1) and keypoints (nQueries..)
+    std::vector<int> parent(nQueries+nKeypoints);
+    for(size_t i=0; i<parent.size(); i++) parent[i]=i;
+    auto root=[&](int a){
+        while(parent[a]!=a) a=parent[a]=parent[parent[a]];
+        return a;
+    };
+    for(const auto &c:cands){
+        int a=root(c.query), b=root(nQueries+c.keypoint);
+        if(a!=b) parent[std::max(a,b)]=std::min(a,b);
+    }
+    std::vector<int> component(cands.size());
+    for(size_t i=0; i<cands.size(); i++) component[i]=root(cands[i].query);
+    std::vector<int> order(cands.size());
+    for(size_t i=0; i<order.size(); i++) order[i]=i;
+    std::sort(order.begin(), order.end(), [&](int a, int b){
+        if(component[a]!=component[b]) return component[a]<component[b];
+        return closer(cands[a], cands[b]);
+    });
+    std::vector<MatchCandidate> sorted(cands.size());
+    for(size_t i=0; i<order.size(); i++) sorted[i]=cands[order[i]];
+    cands.swap(sorted);
+    for(size_t i=0; i<order.size(); i++) order[i]=component[order[i]];
+
+    //local index of the queries and keypoints of a component, -1 outside it
+    std::vector<int> local(nQueries+nKeypoints,-1);
+    std::vector<int> rows, cols;
+    for(size_t first=0, last; first<cands.size(); first=last){
+        for(last=first+1; last<cands.size() && order[last]==order[first]; last++);
+        rows.clear();
+        cols.clear();
+        for(size_t i=first; i<last; i++){
+            int q=cands[i].query, k=nQueries+cands[i].keypoint;
+            if(local[q]<0){ local[q]=rows.size(); rows.push_back(q); }
+            if(local[k]<0){ local[k]=cols.size(); cols.push_back(k); }
+        }
+        if(last-first>1 && int(rows.size())<=maxComponent && int(cols.size())<=maxComponent){
+            //the missing edges cost more than any set of real ones, so the largest assignment is preferred
+            const double missing=1e12;
+            bool transposed=rows.size()>cols.size();
+            int nr=transposed? cols.size() : rows.size(), nc=transposed? rows.size() : cols.size();
+            std::vector<double> cost(nr*nc, missing);
+            for(size_t i=first; i<last; i++){
+                int r=local[cands[i].query], c=local[nQueries+cands[i].keypoint];
+                if(transposed) std::swap(r,c);
+                cost[r*nc+c]=cands[i].dist2;
+            }
+            std::vector<int> rowMatch=hungarian(cost, nr, nc);
+            for(int r=0; r<nr; r++){
+                int c=rowMatch[r];
+                if(c<0 || cost[r*nc+c]>=missing) continue;
+                int q=transposed? rows[c] : rows[r], k=(transposed? cols[r] : cols[c])-nQueries;
+                match[q]=k;
+                owner[k]=q;
+            }
+        }
+        else greedy(first, last);
+        for(int q:rows) local[q]=-1;
+        for(int k:cols) local[k]=-1;
+    }
+}
+}
 
-        //sort corner in clockwise direction
-        markerCandidate=sort(markerCandidate);
+/**
+ * @brief How the conflicts between model points wanting the same keypoint (or the reverse) are resolved
+ */
+enum AssignMethod{
+    ASSIGN_GREEDY,//by increasing distance
+    ASSIGN_OPTIMAL//minimum total distance (Hungarian) in the small groups of conflicting candidates, greedy in the others
+};
 
-        //extract the code
-        //obtain the intensities of the bits using homography
-        _private::Homographer hom(markerCandidate);
+/**
+ * @brief Spatial index used to match the projected model points with the keypoints
+ */
+enum MatchStrategy{
+    MATCH_AUTO,//MATCH_MODEL_INDEX if there are more keypoints than model points, MATCH_KEYPOINT_INDEX otherwise
+    MATCH_KEYPOINT_INDEX,//kd-tree of the keypoints, queried with each model point
+    MATCH_MODEL_INDEX//kd-tree of the projected model points, queried with each keypoint
+};
 
-        for(auto b_vm:fractalMarkerSet.bits_ids)
-        {
-            int nbitsWithBorder = sqrt(b_vm.first)+2;
-            cv::Mat bits(nbitsWithBorder,nbitsWithBorder,CV_8UC1);
-            int pixelSum=0;
+/**
+ * @brief How the model points projected with the homography are searched among the keypoints.
+ *
+ * A fixed radius in pixels is too loose on small images (more candidates to check, and wrong ones accepted) and too
+ * tight on large ones (points lost). Instead, the radius of each point is a fraction of the size of a bit of its
+ * marker as projected there by the homography, so it follows the resolution, distance and tilt of the board.
+ */
+struct MatchParams{
+    float bitFraction=0.4f;//radius / projected bit size. <=0: fixedRadius for all the points
+    float minRadius=2.f;//bounds of the radius, in pixels
+    float maxRadius=40.f;
+    float fixedRadius=10.f;
+    MatchStrategy strategy=MATCH_AUTO;//same matches with any of them, only the cost changes
+    AssignMethod assignment=ASSIGN_GREEDY;//each keypoint is assigned to one model point at most, and vice versa
+    int maxComponentSize=8;//ASSIGN_OPTIMAL: largest number of model points or keypoints solved optimally together
+    //only the model points with a single keypoint (of any class) within the radius are matched. If false, any
+    //keypoint of their class within the radius is a candidate
+    bool strictCandidates=true;
+};
 
-            for(int r=0;r<bits.rows;r++){
-                for(int c=0;c<bits.cols;c++){
-                    auto pixelValue=uchar(0.5+getSubpixelValue(bwimage,hom(cv::Point2f(  float(c+0.5) / float(bits.cols) ,  float(r+0.5) / float(bits.rows)  ))));
-                    bits.at<uchar>(r,c)=pixelValue;
-                    pixelSum+=pixelValue;
-                }
-            }
+/**
+ * @brief Subpixel refinement of the corners of the markers and of the matched points.
+ *
+ * The window of each point is a fraction of the size of a bit as projected there, so it covers the bits around the
+ * corner and nothing else at any resolution or distance (a fixed window is too small for near markers and takes in
+ * other corners of far ones). The points are refined in parallel chunks.
+ */
+struct RefineParams{
+    float windowFraction=0.5f;//half side of the window / projected bit size. <=0: fixedHalfWindow for all the points
+    int minHalfWindow=2;
+    int maxHalfWindow=8;
+    int fixedHalfWindow=4;//also for the points whose bit size is not known
+    int maxIterations=12;
+    float epsilon=0.005f;//a point is done when it moves less than this
+    float stableShift=0.05f;//points moving less than this in the first iteration are reported as stable
+    int chunkSize=64;//points per parallel task (cv::parallel_for_). <=0: serial
+    bool useOpenCV=false;//cv::cornerSubPix with fixedHalfWindow (the former refinement), to compare cost and accuracy
+};
 
-            //threshold by the average value
-            double mean=double(pixelSum)/double(bits.cols*bits.rows);
-            cv::threshold(bits,bits,mean,255,cv::THRESH_BINARY);
+/**
+ * @brief Pose estimation from the correspondences of the detector (see FractalMarkerDetector::detectPose).
+ *
+ * The pose is seeded with the previous one (tracking) or with the decomposition of the homography of the markers, and
+ * refined with a few Levenberg-Marquardt iterations over the reprojection error, with Huber weights so that a few
+ * wrong correspondences do not pull the pose.
+ */
+struct PoseParams{
+    int maxIterations=10;
+    float huberThreshold=2.f;//pixels. Residuals larger than this weigh less
+    float inlierThreshold=5.f;//pixels. Points with a larger final residual are left out of reprojError
+    float restartError=3.f;//a pose seeded with the previous one ending with a larger reprojError is redone from the homography
+    double minStep=1e-6;//iterations stop when the update is smaller than this
+};
 
-            //now, analyze the inner code to see if is a marker.
-            //  If so, rotate to have the points properly sorted
-            int nrotations=0;
+/**
+ * @brief Camera pose of the marker set: X_camera = R(rvec) * X_marker + tvec, in the units of the p3d points
+ */
+struct FractalPose{
+    cv::Vec3d rvec, tvec;
+    double reprojError=-1;//RMS of the reprojection error of the inliers, in pixels
+    int nPoints=0, nInliers=0;
+    int iterations=0;
+    bool valid=false;
+};
 
-            int id=getMarkerId(bits, nrotations, b_vm.second, fractalMarkerSet);
+namespace _private{
+//Per thread buffers of the corner refinement
+struct CornerRefineBuffers{
+    std::vector<float> patch, gx, gy;
+    std::vector<float> mask, px, py;//gaussian weight and offset to the center of each element of the window
+    int halfWin=-1;//window of mask, px and py
+};
 
-            if(id==-1) continue;//not a marker
-            std::rotate(markerCandidate.begin(),markerCandidate.begin() + 4 - nrotations,markerCandidate.end());
-            candidates.push_back(std::make_pair(id,markerCandidate));
+//n x n bilinear samples of the image starting at tl, replicating the border (as cv::getRectSubPix)
+inline void samplePatch(const cv::Mat &gray, cv::Point2f tl, int n, float *out){
+    int x0=int(std::floor(tl.x)), y0=int(std::floor(tl.y));
+    float fx=tl.x-x0, fy=tl.y-y0;
+    float w00=(1-fx)*(1-fy), w01=fx*(1-fy), w10=(1-fx)*fy, w11=fx*fy;
+    if(x0>=0 && y0>=0 && x0+n<gray.cols && y0+n<gray.rows){
+        for(int i=0; i<n; i++){
+            const uchar *r0=gray.ptr<uchar>(y0+i)+x0, *r1=gray.ptr<uchar>(y0+i+1)+x0;
+            float *o=out+i*n;
+            for(int j=0; j<n; j++) o[j]=w00*r0[j]+w01*r0[j+1]+w10*r1[j]+w11*r1[j+1];
         }
+        return;
     }
+    auto at=[&](int y, int x){
+        return float(gray.ptr<uchar>(std::min(std::max(y,0),gray.rows-1))[std::min(std::max(x,0),gray.cols-1)]);
+    };
+    for(int i=0; i<n; i++)
+        for(int j=0; j<n; j++)
+            out[i*n+j]=w00*at(y0+i,x0+j)+w01*at(y0+i,x0+j+1)+w10*at(y0+i+1,x0+j)+w11*at(y0+i+1,x0+j+1);
+}
 
-    ////////////////////////////////////////////
+//Iterative subpixel refinement of a corner of a CV_8UC1 image, by the method of cv::cornerSubPix: the corner is the
+//point to which the gradients of a (2*halfWin+1)^2 gaussian weighted window around it are orthogonal. The structure
+//tensor sums are accumulated in 8 independent lanes, so the compiler vectorizes them without reordering float sums.
+//firstShift receives the displacement of the first iteration. Returns false if the point was left as it was
+inline bool refineCorner(const cv::Mat &gray, cv::Point2f &pt, int halfWin, int maxIter, float eps,
+                         CornerRefineBuffers &buf, float &firstShift){
+    const int n=2*halfWin+1, m=n+2, N=n*n, L=8;
+    if(buf.halfWin!=halfWin){
+        buf.halfWin=halfWin;
+        buf.mask.resize(N);
+        buf.px.resize(N);
+        buf.py.resize(N);
+        for(int i=0; i<n; i++){
+            float y=float(i-halfWin)/halfWin, vy=std::exp(-y*y);
+            for(int j=0; j<n; j++){
+                float x=float(j-halfWin)/halfWin;
+                buf.mask[i*n+j]=vy*std::exp(-x*x);
+                buf.px[i*n+j]=float(j-halfWin);
+                buf.py[i*n+j]=float(i-halfWin);
+            }
+        }
+    }
+    buf.patch.resize(m*m);
+    buf.gx.resize(N);
+    buf.gy.resize(N);
+    const float *mask=buf.mask.data(), *px=buf.px.data(), *py=buf.py.data();
+    float *patch=buf.patch.data(), *gx=buf.gx.data(), *gy=buf.gy.data();
+
+    cv::Point2f start=pt, c=pt;
+    firstShift=0;
+    for(int iter=0; iter<maxIter; iter++){
+        samplePatch(gray, cv::Point2f(c.x-(halfWin+1), c.y-(halfWin+1)), m, patch);
+        for(int i=0; i<n; i++){
+            const float *r=patch+(i+1)*m+1, *up=patch+i*m+1, *down=patch+(i+2)*m+1;
+            float *ox=gx+i*n, *oy=gy+i*n;
+            for(int j=0; j<n; j++){
+                ox[j]=r[j+1]-r[j-1];
+                oy[j]=down[j]-up[j];
+            }
+        }
+        float sa[L]={0}, sb[L]={0}, sc[L]={0}, s1[L]={0}, s2[L]={0};
+        int k=0;
+        for(; k+L<=N; k+=L)
+            for(int l=0; l<L; l++){
+                float x=gx[k+l], y=gy[k+l], w=mask[k+l];
+                float gxx=x*x*w, gxy=x*y*w, gyy=y*y*w;
+                sa[l]+=gxx;
+                sb[l]+=gxy;
+                sc[l]+=gyy;
+                s1[l]+=gxx*px[k+l]+gxy*py[k+l];
+                s2[l]+=gxy*px[k+l]+gyy*py[k+l];
+            }
+        double a=0, b=0, cc=0, bb1=0, bb2=0;
+        for(int l=0; l<L; l++){ a+=sa[l]; b+=sb[l]; cc+=sc[l]; bb1+=s1[l]; bb2+=s2[l]; }
+        for(; k<N; k++){
+            double x=gx[k], y=gy[k], w=mask[k];
+            a+=x*x*w; b+=x*y*w; cc+=y*y*w;
+            bb1+=x*x*w*px[k]+x*y*w*py[k];
+            bb2+=x*y*w*px[k]+y*y*w*py[k];
+        }
+        double det=a*cc-b*b;
+        if(std::abs(det)<=std::numeric_limits<double>::epsilon()*std::numeric_limits<double>::epsilon()) break;
+        double scale=1./det;
+        cv::Point2f next(float(c.x+cc*scale*bb1-b*scale*bb2), float(c.y-b*scale*bb1+a*scale*bb2));
+        float shift=float(cv::norm(next-c));
+        if(iter==0) firstShift=shift;
+        c=next;
+        if(c.x<0 || c.x>=gray.cols || c.y<0 || c.y>=gray.rows || shift<=eps) break;
+    }
+    //went out of the window: not a corner
+    if(std::abs(c.x-start.x)>halfWin || std::abs(c.y-start.y)>halfWin) return false;
+    pt=c;
+    return true;
+}
+
+//Pose of the plane z=0 from its homography to normalized image coordinates, in front of the camera. False if degenerate
+inline bool poseFromHomography(const cv::Matx33d &Hn, cv::Matx33d &R, cv::Vec3d &t){
+    double h1[3]={Hn(0,0),Hn(1,0),Hn(2,0)}, h2[3]={Hn(0,1),Hn(1,1),Hn(2,1)};
+    double n1=std::sqrt(h1[0]*h1[0]+h1[1]*h1[1]+h1[2]*h1[2]), n2=std::sqrt(h2[0]*h2[0]+h2[1]*h2[1]+h2[2]*h2[2]);
+    if(n1+n2<=std::numeric_limits<double>::epsilon()) return false;
+    double lambda=2./(n1+n2);
+    if(lambda*Hn(2,2)<0) lambda=-lambda;
+    //r1, r2 orthonormalized (Gram-Schmidt), r3=r1 x r2
+    double r1[3], r2[3], r3[3];
+    for(int i=0;i<3;i++) r1[i]=h1[i]/n1;
+    double d=r1[0]*h2[0]+r1[1]*h2[1]+r1[2]*h2[2];
+    for(int i=0;i<3;i++) r2[i]=h2[i]-d*r1[i];
+    double nr2=std::sqrt(r2[0]*r2[0]+r2[1]*r2[1]+r2[2]*r2[2]);
+    if(nr2<=std::numeric_limits<double>::epsilon()) return false;
+    for(int i=0;i<3;i++) r2[i]/=nr2;
+    if(lambda<0) for(int i=0;i<3;i++){ r1[i]=-r1[i]; r2[i]=-r2[i]; }
+    r3[0]=r1[1]*r2[2]-r1[2]*r2[1];
+    r3[1]=r1[2]*r2[0]-r1[0]*r2[2];
+    r3[2]=r1[0]*r2[1]-r1[1]*r2[0];
+    R=cv::Matx33d(r1[0],r2[0],r3[0], r1[1],r2[1],r3[1], r1[2],r2[2],r3[2]);
+    t=cv::Vec3d(lambda*Hn(0,2), lambda*Hn(1,2), lambda*Hn(2,2));
+    return true;
+}
+
+//Solves the symmetric positive definite n x n system A x=b (row major) by Cholesky, in place: x is left in b
+inline bool solveCholesky(double *A, double *b, int n){
+    for(int j=0;j<n;j++){
+        double s=A[j*n+j];
+        for(int k=0;k<j;k++) s-=A[j*n+k]*A[j*n+k];
+        if(s<=0) return false;
+        A[j*n+j]=std::sqrt(s);
+        for(int i=j+1;i<n;i++){
+            double v=A[i*n+j];
+            for(int k=0;k<j;k++) v-=A[i*n+k]*A[j*n+k];
+            A[i*n+j]=v/A[j*n+j];
+        }
+    }
+    for(int i=0;i<n;i++){
+        for(int k=0;k<i;k++) b[i]-=A[i*n+k]*b[k];
+        b[i]/=A[i*n+i];
+    }
+    for(int i=n-1;i>=0;i--){
+        for(int k=i+1;k<n;k++) b[i]-=A[k*n+i]*b[k];
+        b[i]/=A[i*n+i];
+    }
+    return true;
+}
+
+//Huber cost of the reprojection errors in pixels of the pose (R,t). Infinite if a point is behind the camera
+inline double poseCost(const std::vector<cv::Point3f> &obj, const std::vector<cv::Point2d> &img, double fx, double fy,
+                       const cv::Matx33d &R, const cv::Vec3d &t, double huber){
+    double cost=0;
+    for(size_t i=0;i<obj.size();i++){
+        const cv::Point3f &X=obj[i];
+        double z=R(2,0)*X.x+R(2,1)*X.y+R(2,2)*X.z+t[2];
+        if(z<=0) return std::numeric_limits<double>::infinity();
+        double ru=fx*((R(0,0)*X.x+R(0,1)*X.y+R(0,2)*X.z+t[0])/z-img[i].x);
+        double rv=fy*((R(1,0)*X.x+R(1,1)*X.y+R(1,2)*X.z+t[1])/z-img[i].y);
+        double e=std::sqrt(ru*ru+rv*rv);
+        cost+= e<=huber? 0.5*e*e : huber*(e-0.5*huber);
+    }
+    return cost;
+}
+
+//Levenberg-Marquardt over the reprojection error in pixels, with Huber weights (IRLS). img are normalized image
+//coordinates. The rotation is updated on the left: R <- exp(w) R. Returns the iterations done
+inline int refinePose(const std::vector<cv::Point3f> &obj, const std::vector<cv::Point2d> &img, double fx, double fy,
+                      const PoseParams &params, cv::Matx33d &R, cv::Vec3d &t){
+    double huber=params.huberThreshold;
+    double cost=poseCost(obj, img, fx, fy, R, t, huber);
+    if(!std::isfinite(cost)) return 0;
+    double lambda=1e-3;
+    int iter=0;
+    for(; iter<params.maxIterations; iter++){
+        double A[36]={0}, g[6]={0};
+        for(size_t i=0;i<obj.size();i++){
+            const cv::Point3f &X=obj[i];
+            double P[3]={R(0,0)*X.x+R(0,1)*X.y+R(0,2)*X.z, R(1,0)*X.x+R(1,1)*X.y+R(1,2)*X.z, R(2,0)*X.x+R(2,1)*X.y+R(2,2)*X.z};
+            double z=P[2]+t[2], iz=1./z;
+            double x=(P[0]+t[0])*iz, y=(P[1]+t[1])*iz;
+            double ru=fx*(x-img[i].x), rv=fy*(y-img[i].y);
+            double e=std::sqrt(ru*ru+rv*rv);
+            double w= e<=huber? 1. : huber/e;
+            //d(u,v)/dXc, and dXc/dw=-[P]x, dXc/dt=I
+            double au=fx*iz, cu=-fx*x*iz, bv=fy*iz, cv_=-fy*y*iz;
+            double Ju[6]={cu*P[1], au*P[2]-cu*P[0], -au*P[1], au, 0, cu};
+            double Jv[6]={-bv*P[2]+cv_*P[1], -cv_*P[0], bv*P[0], 0, bv, cv_};
+            for(int r=0;r<6;r++){
+                g[r]+=w*(Ju[r]*ru+Jv[r]*rv);
+                for(int c=0;c<=r;c++) A[r*6+c]+=w*(Ju[r]*Ju[c]+Jv[r]*Jv[c]);
+            }
+        }
+        for(int r=0;r<6;r++) for(int c=r+1;c<6;c++) A[r*6+c]=A[c*6+r];
+
+        //increases the damping until the cost decreases
+        bool improved=false;
+        double stepNorm=0;
+        while(!improved && lambda<1e8){
+            double M[36], delta[6];
+            std::copy(A, A+36, M);
+            for(int r=0;r<6;r++){
+                M[r*6+r]+=lambda*A[r*6+r]+1e-12;
+                delta[r]=-g[r];
+            }
+            if(!solveCholesky(M, delta, 6)){ lambda*=10; continue; }
+            cv::Matx33d dR;
+            cv::Rodrigues(cv::Vec3d(delta[0],delta[1],delta[2]), dR);
+            cv::Matx33d newR=dR*R;
+            cv::Vec3d newT(t[0]+delta[3], t[1]+delta[4], t[2]+delta[5]);
+            double newCost=poseCost(obj, img, fx, fy, newR, newT, huber);
+            stepNorm=0;
+            for(int r=0;r<6;r++) stepNorm+=delta[r]*delta[r];
+            stepNorm=std::sqrt(stepNorm);
+            if(newCost<cost){
+                R=newR;
+                t=newT;
+                cost=newCost;
+                lambda=std::max(lambda*0.1, 1e-9);
+                improved=true;
+            }
+            else lambda*=10;
+        }
+        if(!improved || stepNorm<params.minStep){ iter++; break; }
+    }
+    return iter;
+}
+}
+
+/**
+ * @brief Scratch buffers used by one detection call.
+ *
+ * detect() never writes into the detector itself, so a single configured FractalMarkerDetector can be shared by
+ * several threads as long as each thread passes its own workspace (or uses the overloads without it, which create
+ * a temporary one per call). Reusing a workspace between frames avoids reallocating the buffers every time.
+ */
+struct FractalDetectorWorkspace{
+    cv::Mat bwimage;//grey image being processed. Either the input image itself or gray
+    cv::Mat gray;//grey conversion of color inputs. Never aliases the input image
+    cv::Mat thresImage;
+    std::vector<std::vector<cv::Point>> contours;
+    std::vector<cv::Point> approxCurve;
+    std::vector<std::vector<cv::Point2f>> quads;//convex quadrilaterals found, sorted anti-clockwise
+    std::vector<std::pair<std::pair<int,int>, std::vector<cv::Point2f>>> candidates;//(set, id) and corners
+    std::vector<FractalMarker> markers;//markers detected in the last call
+    std::vector<cv::KeyPoint> kpoints;
+    _private::picoflann::KdTreeIndex<2,_private::PicoFlann_KeyPointAdapter> kdtree;//only if !modelIndex
+    bool modelIndex=false;//matching strategy of the current keypoints: true for MATCH_MODEL_INDEX
+    std::vector<_private::ModelQuery> queries;
+    std::vector<_private::MatchCandidate> matchCandidates;
+    std::vector<int> queryMatch, keypointOwner;
+    std::vector<float> pointBits;//projected bit size in pixels of each p2d point (0: unknown), for refinePoints
+    std::vector<uchar> pointStable;//1 for the p2d points that moved less than stableShift in refinePoints
+    std::vector<int> pointSets;//marker set of each p2d point (-1: not from the last call)
+    _private::picoflann::KdTreeIndex<2,_private::PicoFlann_ModelQueryAdapter> modelTree;
+    cv::Mat H;//homography from the marker coordinates to the image (of the set of setParams, if several)
+    std::vector<cv::Mat> setsH;//homographies of the sets added with addMarkerSet (set s in setsH[s-1]). Empty if not found
+    bool undistortedH=false;//if true, H maps to undistorted full image coordinates (see setCameraParams)
+    std::vector<cv::Point3f> poseP3d;//correspondences of detectPose(), kept between calls
+    std::vector<cv::Point2f> poseP2d;
+    std::vector<cv::Point2d> poseNormalized;//undistorted normalized coordinates of the p2d points of the pose
+    cv::Size fullSize;//size of the full image when bwimage is a region of it (see FractalMarkerTracker). Empty otherwise
+    cv::Point roiOffset;//position of bwimage in the full image when it is a region of it
+    bool collectStats=false;//if true, detect() fills stats
+    DetectionStats stats;//stats of the last call
+};
+
+/**
+ * @brief The MarkerDetector class is detecting the markers in the image passed
+ *
+ * Once setParams() has been called, the detector is immutable: all the detect() methods are const and reentrant, so
+ * one instance can serve several cameras from different threads without locking. setParams() must not be called
+ * while another thread is detecting.
+ */
+class FractalMarkerDetector{
+public:
+    /**@param fractal_config possible values (FRACTAL_2L_6,FRACTAL_3L_6,FRACTAL_4L_6,FRACTAL_5L_6)
+     */
+    void setParams(std::string fractal_config, float markerSize=-1);
+    inline std::vector<FractalMarker> detect(const cv::Mat &img) const;
+    //with several sets (addMarkerSet), only the points of the set of setParams are returned here
+    inline std::vector<FractalMarker> detect(const cv::Mat &img, std::vector<cv::Point3f>& p3d,
+                                             std::vector<cv::Point2f>& p2d) const;
+    //same as above, but using the buffers of the workspace passed (one per thread). The points of all the sets are
+    //returned, with their set in ws.pointSets
+    inline std::vector<FractalMarker> detect(const cv::Mat &img, FractalDetectorWorkspace &ws) const;
+    inline std::vector<FractalMarker> detect(const cv::Mat &img, std::vector<cv::Point3f>& p3d,
+                                             std::vector<cv::Point2f>& p2d, FractalDetectorWorkspace &ws) const;
+
+    /**Same as above, on a raw camera buffer, without converting it to BGR first. Planar YUV and gray buffers are
+     * used in place (only the Y plane is read). YUYV/UYVY luma is de-interleaved into the workspace in one pass.
+     * Bayer frames are reduced to a half resolution luma image in one pass, and the whole detection runs on it
+     * (markers must be twice as large in pixels); the corners and points are then mapped to full resolution.
+     * @param stride bytes between the start of consecutive rows of the image (of the Y plane). 0: no padding
+     */
+    inline std::vector<FractalMarker> detect(const uchar *data, int width, int height, size_t stride, PixelFormat format,
+                                             FractalDetectorWorkspace &ws) const;
+    inline std::vector<FractalMarker> detect(const uchar *data, int width, int height, size_t stride, PixelFormat format,
+                                             std::vector<cv::Point3f>& p3d, std::vector<cv::Point2f>& p2d,
+                                             FractalDetectorWorkspace &ws) const;
+    /**Fast detection on large image files (JPEG). The file is decoded in grey at 1/reduction of its size (2, 4 or 8,
+     * IMREAD_REDUCED_GRAYSCALE_*, which lets the JPEG decoder skip most of the work) and the markers are searched
+     * there. Only if some marker is found, the file is decoded again at full resolution and the detection is repeated
+     * in the region of the markers (plus a margin), so the corners and points have full precision. OpenCV cannot
+     * decode a region of a JPEG, so that second decode is of the whole file, but the files without markers never
+     * pay for it. The coordinates returned are always those of the full resolution image.
+     * @param refine if false, the second pass is skipped and the corners found in the reduced image are just scaled
+     * to full resolution: a preview of whether and where the markers are
+     * @param region if not null, receives the full resolution region searched in the second pass (empty if none)
+     */
+    inline std::vector<FractalMarker> detectFile(const std::string &path, int reduction, bool refine,
+                                                 FractalDetectorWorkspace &ws, cv::Rect *region=nullptr) const;
+    inline std::vector<FractalMarker> detectFile(const std::string &path, int reduction, std::vector<cv::Point3f>& p3d,
+                                                 std::vector<cv::Point2f>& p2d, FractalDetectorWorkspace &ws,
+                                                 cv::Rect *region=nullptr) const;
+
+    //Grey image of a raw buffer: a header on the buffer itself if possible, or else converted into the buffer passed.
+    //Half the size of the buffer for Bayer formats
+    static inline cv::Mat lumaView(const uchar *data, int width, int height, size_t stride, PixelFormat format, cv::Mat &buffer);
+
+    /**Camera of the images to detect, so distorted images can be used without undistorting them first. The detection
+     * still runs on the distorted image, but the homography of the markers is computed from their undistorted corners,
+     * and the model points projected with it are distorted back before being searched among the keypoints. Both
+     * mappings use a sparse LUT (one node every lutStep pixels) computed here, so they cost little per point.
+     * The parameters refer to the image passed to detect() (the half resolution luma for Bayer buffers).
+     * @param undistortOutput if true, the p2d returned by detect() are undistorted pixel coordinates (to use with K
+     * and no distortion). The marker corners, and the points of FractalMarkerTracker, are always image coordinates.
+     * Pass an empty K to remove the camera.
+     */
+    inline void setCameraParams(const cv::Mat &K, const cv::Mat &distCoeffs, const cv::Size &imageSize,
+                                bool undistortOutput=false, int lutStep=8);
+
+    /**If enabled, detect(img,p3d,p2d) extracts and classifies the keypoints in a second thread while the markers are
+     * searched, instead of after them. It hides most of the keypoint cost on frames with markers, at the price of
+     * some wasted work on frames without them.
+     */
+    inline void setSpeculativeKeypoints(bool enable){ speculativeKeypoints=enable; }
+    inline bool getSpeculativeKeypoints() const { return speculativeKeypoints; }
+
+    /**Sets a function called at the end of every detect() with its DetectionStats. It runs in the thread calling
+     * detect(), so it must be thread safe if the detector is shared. Pass nullptr to remove it.
+     */
+    inline void setStatsCallback(std::function<void(const DetectionStats&)> callback){ statsCallback=callback; }
+
+    //search radius of the model points among the keypoints (see MatchParams)
+    inline void setMatchParams(const MatchParams &params);
+    inline const MatchParams& getMatchParams() const { return matchParams; }
+    //subpixel refinement of the corners and points (see RefineParams)
+    inline void setRefineParams(const RefineParams &params);
+    inline const RefineParams& getRefineParams() const { return refineParams; }
+
+    /**Pose of the marker set in the image: detect(img,p3d,p2d,ws) followed by estimatePose(). The correspondences are
+     * kept in ws (poseP3d, poseP2d). Requires setCameraParams(). With several sets (addMarkerSet), the pose is that of
+     * the set of setParams().
+     * @param previous pose of the previous frame to start from, if valid. Otherwise the pose starts from the
+     * homography of the markers
+     */
+    inline std::vector<FractalMarker> detectPose(const cv::Mat &img, FractalPose &pose, FractalDetectorWorkspace &ws,
+                                                 const FractalPose *previous=nullptr) const;
+    /**Pose from correspondences returned by a detect() call with ws, which also provides the homography to start from
+     * (p2d relative to ws.roiOffset, and undistorted if the camera was set with undistortOutput). Returns pose.valid
+     */
+    inline bool estimatePose(const std::vector<cv::Point3f>& p3d, const std::vector<cv::Point2f>& p2d, FractalPose &pose,
+                             FractalDetectorWorkspace &ws, const FractalPose *previous=nullptr) const;
+    //robust refinement of the pose (see PoseParams)
+    inline void setPoseParams(const PoseParams &params);
+    inline const PoseParams& getPoseParams() const { return poseParams; }
+
+    /**Adds another marker set to detect along with that of setParams(). setParams() must be called first, and removes
+     * the sets added. The quads are extracted once for all the sets, and the bits of each quad are sampled once per
+     * grid size and compared with the codes of all the sets with markers of that size. Each set has its own
+     * homography and model points, since they are different objects: markers, p3d and p2d are tagged with their set
+     * (FractalMarker::setIndex and FractalDetectorWorkspace::pointSets).
+     * A quad is assigned to the first set that decodes it, so this throws if a code of the set could be read as a code
+     * of a previous one, or the other way around. Returns the index of the set
+     */
+    inline int addMarkerSet(std::string config, float markerSize=-1);
+    inline int getNumMarkerSets() const { return 1+int(extraSets.size()); }
+    inline const FractalMarkerSet& getFractalMarkerSet(int set=0) const { return set==0? fractalMarkerSet : extraSets.at(set-1); }
+
+    //Building blocks of the decoding stage, public so they can be benchmarked on their own
+    static inline  float  getSubpixelValue(const cv::Mat &im_grey,const cv::Point2f &p);
+    //returns the id of the marker, -1 if the code is not in the set or -2 if the border of the bits is not black
+    static inline  int    getMarkerId(const cv::Mat &bits,int &nrotations, const std::vector<int>& markersId, const FractalMarkerSet& markerSet);
+    //subpixel refinement of points of a grey image with half window halfWindows[i] (fixedHalfWindow if empty). Points
+    //with skip set are left as they are. stable (optional) receives 1 for the points that moved less than stableShift
+    static inline void refineCorners(const cv::Mat &gray, std::vector<cv::Point2f> &points, const std::vector<int> &halfWindows,
+                                     const RefineParams &params, const std::vector<uchar> *skip=nullptr,
+                                     std::vector<uchar> *stable=nullptr);
+    //half window for a point whose bits measure bitPixels in the image (0: unknown)
+    static inline int refineHalfWindow(float bitPixels, const RefineParams &params);
+private:
+    friend class FractalStreamProcessor;
+    friend class FractalMarkerTracker;
+    FractalMarkerSet fractalMarkerSet;
+    std::vector<FractalMarkerSet> extraSets;//added with addMarkerSet
+    std::map<int, std::vector<int>> codeIndex;//number of bits -> sets with markers of that number of bits
+    bool speculativeKeypoints=false;
+    std::function<void(const DetectionStats&)> statsCallback;
+    std::shared_ptr<const _private::LensLut> lensLut;//shared by the copies of the detector. Null without camera
+    bool undistortOutput=false;
+    MatchParams matchParams;
+    size_t nModelPoints=0;//keypts of all the markers of all the sets
+    RefineParams refineParams;
+    PoseParams poseParams;
+    cv::Matx33d cameraMatrix;//K of setCameraParams(), valid if lensLut
+
+    //stats of the workspace if they must be collected, nullptr otherwise
+    inline DetectionStats* statsOf(FractalDetectorWorkspace &ws) const{
+#ifdef NANOFRACTAL_NO_STATS
+        return nullptr;
+#else
+        return ws.collectStats || statsCallback ? &ws.stats : nullptr;
+#endif
+    }
+    inline void finishStats(DetectionStats *stats, std::chrono::high_resolution_clock::time_point start) const;
+
+    //Detection stages. Each one only reads the detector and reads/writes the workspace, so different frames can be
+    //at different stages at the same time (see FractalStreamProcessor)
+    inline void convertToGray(const cv::Mat &img, FractalDetectorWorkspace &ws) const;
+    inline void detectQuads(FractalDetectorWorkspace &ws) const;//adaptive threshold, contours and polygon approximation
+    inline void decodeQuads(FractalDetectorWorkspace &ws) const;//reads the bits of each quad and refines the corners of the markers
+    inline void detectKeypoints(FractalDetectorWorkspace &ws) const;//FAST
+    inline void classifyKeypoints(FractalDetectorWorkspace &ws) const;//kfilter and assignClass
+    inline void buildIndex(FractalDetectorWorkspace &ws) const;//kd-tree of the keypoints and homography of the markers
+    inline void indexKeypoints(FractalDetectorWorkspace &ws) const;//chooses the matching strategy, and builds the kd-tree if needed
+    //modelIdx (optional) receives the index of the model point of each correspondence, counting the keypts of all the
+    //markers of all the sets in order. Model points whose skip value (same indexing) is not zero are not searched
+    inline void matchKeypoints(FractalDetectorWorkspace &ws, std::vector<cv::Point3f>& p3d, std::vector<cv::Point2f>& p2d,
+                               std::vector<int>* modelIdx=nullptr, const std::vector<uchar>* skip=nullptr) const;
+    //window of each point from ws.pointBits if it has one value per point. Fills ws.pointStable
+    inline void refinePoints(FractalDetectorWorkspace &ws, std::vector<cv::Point2f>& p2d, const std::vector<uchar>* skip=nullptr) const;
+    inline int halfWindow(float bitPixels) const { return refineHalfWindow(bitPixels, refineParams); }
+    //code index and number of model points of the sets
+    inline void updateMarkerSets();
+    //removes the points of other sets appended to p3d/p2d from position first by the last detect() with ws
+    inline void keepSet(FractalDetectorWorkspace &ws, std::vector<cv::Point3f>& p3d, std::vector<cv::Point2f>& p2d,
+                        size_t first, int set) const;
+    //true if a and b could be read as each other in some rotation
+    static inline bool codesCollide(const FractalMarker &a, const FractalMarker &b);
+    //homography of the markers of a set in ws, empty if none was found
+    inline const cv::Mat& homographyOf(const FractalDetectorWorkspace &ws, int set) const{
+        static const cv::Mat none;
+        return set==0? ws.H : (size_t(set)<=ws.setsH.size()? ws.setsH[set-1] : none);
+    }
+    //undistorts the points from the index first if the camera was set with undistortOutput
+    inline void outputPoints(FractalDetectorWorkspace &ws, std::vector<cv::Point2f>& p2d, size_t first) const;
+
+    static inline  std::vector<cv::Point2f> sort( const  std::vector<cv::Point2f> &marker);
+    static inline  int    perimeter(const std::vector<cv::Point2f>& a);
+    inline std::vector<FractalMarker> detectFile(const std::string &path, int reduction, bool refine,
+                                                 std::vector<cv::Point3f>* p3d, std::vector<cv::Point2f>* p2d,
+                                                 FractalDetectorWorkspace &ws, cv::Rect *region) const;
+    static inline bool isBayer(PixelFormat format){ return format>=PIXEL_BAYER_RGGB && format<=PIXEL_BAYER_GBRG; }
+    //half resolution luma of a Bayer mosaic: one pixel per 2x2 cell
+    static inline void bayerLuma(const uchar *data, int width, int height, size_t stride, PixelFormat format, cv::Mat &luma);
+    //maps points of the half resolution luma to the full resolution frame: the center of cell x is at 2x+0.5
+    static inline void toFullResolution(std::vector<cv::Point2f> &points){
+        for(auto &p:points) p=cv::Point2f(2.f*p.x+0.5f, 2.f*p.y+0.5f);
+    }
+
+};
+
+
+void FractalMarkerDetector::setMatchParams(const MatchParams &params){
+    if(params.minRadius<=0 || params.maxRadius<params.minRadius)
+        throw std::runtime_error("FractalMarkerDetector::setMatchParams: invalid radius bounds");
+    if(params.bitFraction<=0 && params.fixedRadius<=0)
+        throw std::runtime_error("FractalMarkerDetector::setMatchParams: invalid fixed radius");
+    if(params.maxComponentSize<1)
+        throw std::runtime_error("FractalMarkerDetector::setMatchParams: invalid component size");
+    matchParams=params;
+}
+
+void FractalMarkerDetector::setRefineParams(const RefineParams &params){
+    if(params.minHalfWindow<1 || params.maxHalfWindow<params.minHalfWindow || params.fixedHalfWindow<1)
+        throw std::runtime_error("FractalMarkerDetector::setRefineParams: invalid window");
+    if(params.maxIterations<1 || params.epsilon<0)
+        throw std::runtime_error("FractalMarkerDetector::setRefineParams: invalid termination criteria");
+    refineParams=params;
+}
+
+void FractalMarkerDetector::setPoseParams(const PoseParams &params){
+    if(params.maxIterations<1) throw std::runtime_error("FractalMarkerDetector::setPoseParams: invalid number of iterations");
+    if(params.huberThreshold<=0 || params.inlierThreshold<=0)
+        throw std::runtime_error("FractalMarkerDetector::setPoseParams: invalid thresholds");
+    poseParams=params;
+}
+
+void FractalMarkerDetector::setCameraParams(const cv::Mat &K, const cv::Mat &distCoeffs, const cv::Size &imageSize,
+                                            bool undistort, int lutStep){
+    if(K.empty()){
+        lensLut.reset();
+        undistortOutput=undistort;
+        return;
+    }
+    if(K.rows!=3 || K.cols!=3) throw std::runtime_error("FractalMarkerDetector::setCameraParams: K must be 3x3");
+    if(imageSize.area()<=0) throw std::runtime_error("FractalMarkerDetector::setCameraParams: invalid image size");
+    //nothing changes if the LUT cannot be built
+    auto lut=std::make_shared<const _private::LensLut>(K, distCoeffs, imageSize, lutStep);
+    cv::Mat Kd;
+    K.convertTo(Kd,CV_64F);
+    lensLut=lut;
+    undistortOutput=undistort;
+    cameraMatrix=Kd;
+}
+
+void FractalMarkerDetector::outputPoints(FractalDetectorWorkspace &ws, std::vector<cv::Point2f>& p2d, size_t first) const{
+    if(!lensLut || !undistortOutput) return;
+    cv::Point2f offset(ws.roiOffset);
+    for(size_t i=first;i<p2d.size();i++) p2d[i]=lensLut->undistort(p2d[i]+offset)-offset;
+}
+
+void FractalMarkerDetector::setParams(std::string config, float markerSize)
+{
+    fractalMarkerSet = FractalMarkerSet(config);
+    if(markerSize != -1) fractalMarkerSet.convertToMeters(markerSize);
+    extraSets.clear();
+    updateMarkerSets();
+}
+
+int FractalMarkerDetector::addMarkerSet(std::string config, float markerSize)
+{
+    if(fractalMarkerSet.fractalMarkerCollection.empty())
+        throw std::runtime_error("FractalMarkerDetector::addMarkerSet: setParams must be called first");
+    FractalMarkerSet markerSet(config);
+    if(markerSize != -1) markerSet.convertToMeters(markerSize);
+    //a quad is decoded by the first set only, so the codes of different sets must not be mistaken for each other
+    for(const auto &fm:markerSet.fractalMarkerCollection)
+        for(int set=0; set<getNumMarkerSets(); set++)
+            for(const auto &other:getFractalMarkerSet(set).fractalMarkerCollection)
+                if(codesCollide(fm.second, other.second))
+                    throw std::runtime_error("FractalMarkerDetector::addMarkerSet: the codes of "+config+" collide with those of set "+std::to_string(set));
+    extraSets.push_back(markerSet);
+    updateMarkerSets();
+    return int(extraSets.size());
+}
+
+bool FractalMarkerDetector::codesCollide(const FractalMarker &a, const FractalMarker &b)
+{
+    if(a.nBits()!=b.nBits()) return false;
+    //the submarkers of a marker (mask 0) show other codes in the image, so any value can be read there: the codes
+    //are only compared where both masks are set. That covers a read as b and b read as a, in any rotation
+    cv::Mat bits=a.mat(), mask=a.mask();
+    const cv::Mat bBits=b.mat(), bMask=b.mask();
+    auto rotate=[](const cv::Mat& in)
+    {
+        cv::Mat out(in.size(),in.type());
+        for (int i = 0; i < in.rows; i++)
+            for (int j = 0; j < in.cols; j++)
+                out.at<uchar>(i, j) = in.at<uchar>(in.cols - j - 1, i);
+        return out;
+    };
+    for(int r=0; r<4; r++)
+    {
+        bool equal=true;
+        for(int y=0; y<bits.rows && equal; y++)
+            for(int x=0; x<bits.cols && equal; x++)
+                if(mask.at<uchar>(y,x) && bMask.at<uchar>(y,x) && bits.at<uchar>(y,x)!=bBits.at<uchar>(y,x))
+                    equal=false;
+        if(equal) return true;
+        bits=rotate(bits);
+        mask=rotate(mask);
+    }
+    return false;
+}
+
+void FractalMarkerDetector::keepSet(FractalDetectorWorkspace &ws, std::vector<cv::Point3f>& p3d,
+                                    std::vector<cv::Point2f>& p2d, size_t first, int set) const
+{
+    if(getNumMarkerSets()==1 || ws.pointSets.size()!=p2d.size()) return;
+    size_t n=first;
+    for(size_t i=first; i<p2d.size(); i++)
+    {
+        if(ws.pointSets[i]!=set) continue;
+        p3d[n]=p3d[i];
+        p2d[n]=p2d[i];
+        ws.pointSets[n]=ws.pointSets[i];
+        if(ws.pointBits.size()==p2d.size()) ws.pointBits[n]=ws.pointBits[i];
+        n++;
+    }
+    p3d.resize(n);
+    p2d.resize(n);
+    ws.pointSets.resize(n);
+    if(ws.pointBits.size()>n) ws.pointBits.resize(n);
+}
+
+void FractalMarkerDetector::updateMarkerSets()
+{
+    nModelPoints=0;
+    codeIndex.clear();
+    for(int set=0; set<getNumMarkerSets(); set++)
+    {
+        const FractalMarkerSet &markerSet=getFractalMarkerSet(set);
+        for(const auto &fm:markerSet.fractalMarkerCollection) nModelPoints+=fm.second.keypts.size();
+        for(const auto &b_vm:markerSet.bits_ids) codeIndex[b_vm.first].push_back(set);
+    }
+}
+
+
+std::vector<FractalMarker> FractalMarkerDetector::detect(const cv::Mat &img, std::vector<cv::Point3f>& p3d,
+                                                  std::vector<cv::Point2f>& p2d) const
+{
+    FractalDetectorWorkspace ws;
+    size_t nInitial=p2d.size();
+    detect(img, p3d, p2d, ws);
+    //the set of each point is not returned: the points of other sets would be taken as points of the first one
+    keepSet(ws, p3d, p2d, nInitial, 0);
+    return ws.markers;
+}
+
+std::vector<FractalMarker> FractalMarkerDetector::detect(const cv::Mat &img, std::vector<cv::Point3f>& p3d,
+                                                  std::vector<cv::Point2f>& p2d, FractalDetectorWorkspace &ws) const
+{
+    _private::TraceScope trace("detect");
+    DetectionStats *stats=statsOf(ws);
+    std::chrono::high_resolution_clock::time_point start;
+    if(stats) start=std::chrono::high_resolution_clock::now();
+
+    convertToGray(img, ws);
+    ws.pointSets.assign(p2d.size(), -1);//filled by matchKeypoints, if some marker is found
+
+    //Speculative keypoints: FAST and classification only touch ws.kpoints, so they can run while the markers are
+    //searched. If no marker is found, the classification is skipped, but FAST must finish before returning
+    std::atomic<bool> cancelKeypoints(false);
+    std::future<void> keypointsTask;
+    if(speculativeKeypoints)
+        keypointsTask=std::async(std::launch::async, [this, &ws, &cancelKeypoints](){
+            _private::traceThreadName("speculative keypoints");
+            detectKeypoints(ws);
+            if(!cancelKeypoints) classifyKeypoints(ws);
+        });
+
+    //Fractal marker detection
+    try{
+        detectQuads(ws);
+        decodeQuads(ws);
+    }catch(...){
+        cancelKeypoints=true;
+        if(keypointsTask.valid()) keypointsTask.wait();
+        throw;
+    }
+
+    if(keypointsTask.valid()){
+        if(ws.markers.empty()) cancelKeypoints=true;
+        keypointsTask.get();
+    }
+
+    if(ws.markers.size() > 0)
+    {
+        //FAST, and filter kpoints (low response) removing duplicated
+        if(!speculativeKeypoints){
+            detectKeypoints(ws);
+            classifyKeypoints(ws);
+        }
+        //kd-tree and homography from the external corners
+        buildIndex(ws);
+        size_t nInitial=p2d.size();
+        matchKeypoints(ws, p3d, p2d);
+        refinePoints(ws, p2d);
+        outputPoints(ws, p2d, nInitial);
+    }
+
+    finishStats(stats, start);
+    return ws.markers;
+}
+
+std::vector<FractalMarker> FractalMarkerDetector::detectPose(const cv::Mat &img, FractalPose &pose, FractalDetectorWorkspace &ws,
+                                                             const FractalPose *previous) const{
+    if(!lensLut) throw std::runtime_error("FractalMarkerDetector::detectPose: camera parameters not set");
+    ws.poseP3d.clear();
+    ws.poseP2d.clear();
+    detect(img, ws.poseP3d, ws.poseP2d, ws);
+    //with several sets, the pose is that of the set of setParams
+    keepSet(ws, ws.poseP3d, ws.poseP2d, 0, 0);
+    estimatePose(ws.poseP3d, ws.poseP2d, pose, ws, previous);
+    return ws.markers;
+}
+
+bool FractalMarkerDetector::estimatePose(const std::vector<cv::Point3f>& p3d, const std::vector<cv::Point2f>& p2d,
+                                         FractalPose &pose, FractalDetectorWorkspace &ws, const FractalPose *previous) const{
+    if(!lensLut) throw std::runtime_error("FractalMarkerDetector::estimatePose: camera parameters not set");
+    if(p3d.size()!=p2d.size()) throw std::runtime_error("FractalMarkerDetector::estimatePose: p3d and p2d sizes differ");
+    _private::TraceScope trace("estimatePose");
+    pose.valid=false;
+    pose.nPoints=int(p3d.size());
+    pose.nInliers=0;
+    pose.iterations=0;
+    pose.reprojError=-1;
+    if(p3d.size()<4) return false;
+
+    //undistorted normalized coordinates. The residuals are scaled back to pixels with the focal lengths
+    const cv::Matx33d &K=cameraMatrix;
+    cv::Matx33d Kinv=K.inv();
+    double fx=K(0,0), fy=K(1,1);
+    cv::Point2f offset(ws.roiOffset);
+    std::vector<cv::Point2d> &img=ws.poseNormalized;
+    img.resize(p2d.size());
+    for(size_t i=0;i<p2d.size();i++){
+        cv::Point2f q=p2d[i]+offset;
+        if(!undistortOutput) q=lensLut->undistort(q);
+        double w=Kinv(2,0)*q.x+Kinv(2,1)*q.y+Kinv(2,2);
+        img[i]=cv::Point2d((Kinv(0,0)*q.x+Kinv(0,1)*q.y+Kinv(0,2))/w, (Kinv(1,0)*q.x+Kinv(1,1)*q.y+Kinv(1,2))/w);
+    }
+
+    //cold start: the homography of the markers (undistorted image) is that of the marker plane, z=0
+    auto fromHomography=[&](cv::Matx33d &R, cv::Vec3d &t){
+        if(!ws.H.empty() && ws.undistortedH){
+            cv::Matx33d H=ws.H;
+            return _private::poseFromHomography(Kinv*H, R, t);
+        }
+        //no homography of this camera: that of the correspondences themselves
+        std::vector<cv::Point2d> model(p3d.size());
+        for(size_t i=0;i<p3d.size();i++) model[i]=cv::Point2d(p3d[i].x, p3d[i].y);
+        cv::Mat Hn=cv::findHomography(model, img);
+        if(Hn.empty()) return false;
+        cv::Matx33d H=Hn;
+        return _private::poseFromHomography(H, R, t);
+    };
+    //RMS of the inliers
+    auto evaluate=[&](const cv::Matx33d &R, const cv::Vec3d &t, int &nInliers){
+        double sum=0;
+        nInliers=0;
+        for(size_t i=0;i<p3d.size();i++){
+            const cv::Point3f &X=p3d[i];
+            double z=R(2,0)*X.x+R(2,1)*X.y+R(2,2)*X.z+t[2];
+            if(z<=0) continue;
+            double ru=fx*((R(0,0)*X.x+R(0,1)*X.y+R(0,2)*X.z+t[0])/z-img[i].x);
+            double rv=fy*((R(1,0)*X.x+R(1,1)*X.y+R(1,2)*X.z+t[1])/z-img[i].y);
+            double e2=ru*ru+rv*rv;
+            if(e2>double(poseParams.inlierThreshold)*poseParams.inlierThreshold) continue;
+            sum+=e2;
+            nInliers++;
+        }
+        return nInliers>0? std::sqrt(sum/nInliers) : -1.;
+    };
+
+    cv::Matx33d R;
+    cv::Vec3d t;
+    bool warm=previous && previous->valid;
+    if(warm){
+        cv::Rodrigues(previous->rvec, R);
+        t=previous->tvec;
+    }
+    else if(!fromHomography(R, t)) return false;
+    int iterations=_private::refinePose(p3d, img, fx, fy, poseParams, R, t);
+    int nInliers;
+    double error=evaluate(R, t, nInliers);
+
+    //the previous pose was too far (fast motion, or lost track): restarted from the homography
+    if(warm && (nInliers<4 || error>poseParams.restartError)){
+        cv::Matx33d R2;
+        cv::Vec3d t2;
+        if(fromHomography(R2, t2)){
+            iterations+=_private::refinePose(p3d, img, fx, fy, poseParams, R2, t2);
+            int nInliers2;
+            double error2=evaluate(R2, t2, nInliers2);
+            if(nInliers2>nInliers || (nInliers2==nInliers && error2<error)){
+                R=R2;
+                t=t2;
+                nInliers=nInliers2;
+                error=error2;
+            }
+        }
+    }
+
+    cv::Rodrigues(R, pose.rvec);
+    pose.tvec=t;
+    pose.reprojError=error;
+    pose.nInliers=nInliers;
+    pose.iterations=iterations;
+    pose.valid= nInliers>=4 && t[2]>0;
+    return pose.valid;
+}
+
+std::vector<FractalMarker> FractalMarkerDetector::detect(const uchar *data, int width, int height, size_t stride,
+                                                         PixelFormat format, FractalDetectorWorkspace &ws) const{
+    //the conversion goes to ws.gray, so detect() sees a grey image and uses it as it is
+    cv::Mat luma=lumaView(data, width, height, stride, format, ws.gray);
+    if(!isBayer(format)) return detect(luma, ws);
+    detect(luma, ws);
+    for(auto &m:ws.markers) toFullResolution(m);
+    return ws.markers;
+}
+
+std::vector<FractalMarker> FractalMarkerDetector::detect(const uchar *data, int width, int height, size_t stride,
+                                                         PixelFormat format, std::vector<cv::Point3f>& p3d,
+                                                         std::vector<cv::Point2f>& p2d, FractalDetectorWorkspace &ws) const{
+    cv::Mat luma=lumaView(data, width, height, stride, format, ws.gray);
+    if(!isBayer(format)) return detect(luma, p3d, p2d, ws);
+    size_t nInitial=p2d.size();
+    detect(luma, p3d, p2d, ws);
+    for(size_t i=nInitial;i<p2d.size();i++) p2d[i]=cv::Point2f(2.f*p2d[i].x+0.5f, 2.f*p2d[i].y+0.5f);
+    for(auto &m:ws.markers) toFullResolution(m);
+    return ws.markers;
+}
+
+cv::Mat FractalMarkerDetector::lumaView(const uchar *data, int width, int height, size_t stride, PixelFormat format,
+                                        cv::Mat &buffer){
+    if(data==nullptr || width<=0 || height<=0) throw std::runtime_error("FractalMarkerDetector::lumaView: empty buffer");
+    size_t bytesPerPixel= format==PIXEL_BGR24? 3 : (format==PIXEL_YUYV || format==PIXEL_UYVY)? 2 : 1;
+    if(stride==0) stride=size_t(width)*bytesPerPixel;
+    if(stride<size_t(width)*bytesPerPixel) throw std::runtime_error("FractalMarkerDetector::lumaView: stride smaller than a row");
+    uchar *ptr=const_cast<uchar*>(data);//the headers are only read
+    switch(format){
+    case PIXEL_GRAY8:
+    case PIXEL_NV12:
+    case PIXEL_NV21:
+    case PIXEL_I420:
+        return cv::Mat(height, width, CV_8UC1, ptr, stride);
+    case PIXEL_YUYV:
+    case PIXEL_UYVY:
+        if(width%2!=0) throw std::runtime_error("FractalMarkerDetector::lumaView: YUYV/UYVY width must be even");
+        //as two channel pixels, the luma is channel 0 in YUYV and 1 in UYVY
+        cv::extractChannel(cv::Mat(height, width, CV_8UC2, ptr, stride), buffer, format==PIXEL_YUYV? 0 : 1);
+        return buffer;
+    case PIXEL_BGR24:
+        cv::cvtColor(cv::Mat(height, width, CV_8UC3, ptr, stride), buffer, cv::COLOR_BGR2GRAY);
+        return buffer;
+    case PIXEL_BAYER_RGGB:
+    case PIXEL_BAYER_BGGR:
+    case PIXEL_BAYER_GRBG:
+    case PIXEL_BAYER_GBRG:
+        if(width%2!=0 || height%2!=0) throw std::runtime_error("FractalMarkerDetector::lumaView: Bayer width and height must be even");
+        bayerLuma(data, width, height, stride, format, buffer);
+        return buffer;
+    };
+    throw std::runtime_error("FractalMarkerDetector::lumaView: unknown pixel format");
+}
+
+std::vector<FractalMarker> FractalMarkerDetector::detectFile(const std::string &path, int reduction, bool refine,
+                                                             FractalDetectorWorkspace &ws, cv::Rect *region) const{
+    return detectFile(path, reduction, refine, nullptr, nullptr, ws, region);
+}
+
+std::vector<FractalMarker> FractalMarkerDetector::detectFile(const std::string &path, int reduction,
+                                                             std::vector<cv::Point3f>& p3d, std::vector<cv::Point2f>& p2d,
+                                                             FractalDetectorWorkspace &ws, cv::Rect *region) const{
+    return detectFile(path, reduction, true, &p3d, &p2d, ws, region);
+}
+
+std::vector<FractalMarker> FractalMarkerDetector::detectFile(const std::string &path, int reduction, bool refine,
+                                                             std::vector<cv::Point3f>* p3d, std::vector<cv::Point2f>* p2d,
+                                                             FractalDetectorWorkspace &ws, cv::Rect *region) const{
+    if(region) *region=cv::Rect();
+    if(reduction==1){
+        cv::Mat full=cv::imread(path, cv::IMREAD_GRAYSCALE);
+        if(full.empty()) throw std::runtime_error("FractalMarkerDetector::detectFile: could not read "+path);
+        return p3d? detect(full, *p3d, *p2d, ws) : detect(full, ws);
+    }
+    int flag;
+    switch(reduction){
+    case 2: flag=cv::IMREAD_REDUCED_GRAYSCALE_2; break;
+    case 4: flag=cv::IMREAD_REDUCED_GRAYSCALE_4; break;
+    case 8: flag=cv::IMREAD_REDUCED_GRAYSCALE_8; break;
+    default: throw std::runtime_error("FractalMarkerDetector::detectFile: reduction must be 1, 2, 4 or 8");
+    };
+    cv::Mat preview=cv::imread(path, flag);
+    if(preview.empty()) throw std::runtime_error("FractalMarkerDetector::detectFile: could not read "+path);
+
+    //markers in the reduced image, in full resolution coordinates (pixel x of the reduced image covers
+    //[x*reduction, (x+1)*reduction) of the full one)
+    detect(preview, ws);
+    if(ws.markers.empty()) return ws.markers;
+    std::vector<FractalMarker> scaled=ws.markers;
+    float k=float(reduction);
+    for(auto &m:scaled)
+        for(auto &c:m) c=cv::Point2f((c.x+0.5f)*k-0.5f, (c.y+0.5f)*k-0.5f);
+    if(!refine) return scaled;
+
+    //second pass at full resolution around the markers
+    cv::Mat full=cv::imread(path, cv::IMREAD_GRAYSCALE);
+    if(full.empty()) throw std::runtime_error("FractalMarkerDetector::detectFile: could not read "+path);
+    std::vector<cv::Point2f> corners;
+    for(const auto &m:scaled) corners.insert(corners.end(), m.begin(), m.end());
+    cv::Rect box=cv::boundingRect(corners);
+    int margin=std::max(box.width,box.height)/10+4*reduction;
+    cv::Rect roi=cv::Rect(box.x-margin, box.y-margin, box.width+2*margin, box.height+2*margin) & cv::Rect(cv::Point(0,0), full.size());
+    if(region) *region=roi;
+
+    //the threshold window depends on the full width, as in the detection of the whole image
+    size_t nInitial= p2d? p2d->size() : 0;
+    ws.fullSize=full.size();
+    ws.roiOffset=roi.tl();
+    try{
+        if(p3d) detect(full(roi), *p3d, *p2d, ws);
+        else detect(full(roi), ws);
+    }catch(...){
+        ws.fullSize=cv::Size();
+        ws.roiOffset=cv::Point();
+        throw;
+    }
+    ws.fullSize=cv::Size();
+    ws.roiOffset=cv::Point();
+    //lost at full resolution (e.g. blur hidden by the reduction): keep the preview
+    if(ws.markers.empty()) return scaled;
+
+    cv::Point2f offset(roi.x,roi.y);
+    for(auto &m:ws.markers)
+        for(auto &c:m) c+=offset;
+    if(p2d)
+        for(size_t i=nInitial;i<p2d->size();i++) (*p2d)[i]+=offset;
+    return ws.markers;
+}
+
+void FractalMarkerDetector::bayerLuma(const uchar *data, int width, int height, size_t stride, PixelFormat format, cv::Mat &luma){
+    //Y=0.299R+0.587G+0.114B in 8 bit fixed point, G being the mean of the two greens of the cell.
+    //Weights of the cell pixels in the order top left, top right, bottom left, bottom right
+    int w[4];
+    switch(format){
+    case PIXEL_BAYER_RGGB: w[0]=77; w[1]=75; w[2]=75; w[3]=29; break;
+    case PIXEL_BAYER_BGGR: w[0]=29; w[1]=75; w[2]=75; w[3]=77; break;
+    case PIXEL_BAYER_GRBG: w[0]=75; w[1]=77; w[2]=29; w[3]=75; break;
+    default: w[0]=75; w[1]=29; w[2]=77; w[3]=75; break;//GBRG
+    };
+    luma.create(height/2, width/2, CV_8UC1);
+    for(int y=0;y<luma.rows;y++){
+        const uchar *r0=data+size_t(2*y)*stride;
+        const uchar *r1=r0+stride;
+        uchar *out=luma.ptr<uchar>(y);
+        for(int x=0;x<luma.cols;x++)
+            out[x]=uchar((w[0]*r0[2*x]+w[1]*r0[2*x+1]+w[2]*r1[2*x]+w[3]*r1[2*x+1]+128)>>8);
+    }
+}
+
+std::vector<FractalMarker>  FractalMarkerDetector::detect(const cv::Mat &img) const{
+    FractalDetectorWorkspace ws;
+    return detect(img, ws);
+}
+
+std::vector<FractalMarker>  FractalMarkerDetector::detect(const cv::Mat &img, FractalDetectorWorkspace &ws) const{
+    _private::TraceScope trace("detect");
+    DetectionStats *stats=statsOf(ws);
+    std::chrono::high_resolution_clock::time_point start;
+    if(stats) start=std::chrono::high_resolution_clock::now();
+
+    convertToGray(img, ws);
+    detectQuads(ws);
+    decodeQuads(ws);
+    //Done
+    finishStats(stats, start);
+    return ws.markers;
+}
+
+void FractalMarkerDetector::finishStats(DetectionStats *stats, std::chrono::high_resolution_clock::time_point start) const{
+    if(!stats) return;
+    stats->totalMs=std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now()-start).count();
+#ifdef NANOFRACTAL_PERF
+    //here, after the speculative FAST thread was joined, so that only one thread writes it
+    stats->countersAvailable=PerfCounters::thisThread().available();
+#endif
+    if(statsCallback) statsCallback(*stats);
+}
+
+void FractalMarkerDetector::convertToGray(const cv::Mat &img, FractalDetectorWorkspace &ws) const{
+    //first stage of every detection: start new stats
+    DetectionStats *stats=statsOf(ws);
+    if(stats) *stats=DetectionStats();
+    _private::StageTimer timer(stats, DetectionStats::GRAY);
+    //first, convert to bw
+    if(img.channels()==3){
+        cv::cvtColor(img,ws.gray,cv::COLOR_BGR2GRAY);
+        ws.bwimage=ws.gray;
+    }
+    else ws.bwimage=img;
+}
+
+void FractalMarkerDetector::detectQuads(FractalDetectorWorkspace &ws) const{
+    const cv::Mat &bwimage=ws.bwimage;
+    cv::Mat &thresImage=ws.thresImage;
+    DetectionStats *stats=statsOf(ws);
+    _private::StageTimer timer(stats, DetectionStats::THRESHOLD);
+
+    ///////////////////////////////////////////////////
+    // Adaptive Threshold to detect border
+    int width=ws.fullSize.width>0 ? ws.fullSize.width : bwimage.cols;
+    int adaptiveWindowSize=std::max(int(3),int(15*float(width)/1920.));
+    if( adaptiveWindowSize%2==0) adaptiveWindowSize++;
+    cv::adaptiveThreshold(bwimage, thresImage, 255.,cv::ADAPTIVE_THRESH_MEAN_C, cv::THRESH_BINARY_INV, adaptiveWindowSize, 7);
+
+    ///////////////////////////////////////////////////
+    // compute marker candidates by detecting contours
+    //if image is eroded, minSize must be adapted
+    auto &contours=ws.contours;
+    auto &approxCurve=ws.approxCurve;
+    timer.next(DetectionStats::CONTOURS);
+    cv::findContours(thresImage, contours, cv::noArray(), cv::RETR_LIST, cv::CHAIN_APPROX_NONE);
+
+    ws.quads.clear();
+    //analyze  it is a paralelepiped likely to be the marker
+    for (unsigned int i = 0; i < contours.size(); i++)
+    {
+        // check it is a possible element by first checking that is is large enough
+        if (120 > int(contours[i].size())  ){
+            if(stats) stats->rejectedSmall++;
+            continue;
+        }
+        // can approximate to a convex rect?
+        cv::approxPolyDP(contours[i], approxCurve, double(contours[i].size()) * 0.05, true);
+
+        if (approxCurve.size() != 4 || !cv::isContourConvex(approxCurve)){
+            if(stats) stats->rejectedNotQuad++;
+            continue;
+        }
+        // add the points
+        std::vector<cv::Point2f> markerCandidate;
+        for (int j = 0; j < 4; j++)
+            markerCandidate.push_back( cv::Point2f( approxCurve[j].x,approxCurve[j].y));
+
+        //sort corner in clockwise direction
+        ws.quads.push_back(sort(markerCandidate));
+    }
+    if(stats){
+        stats->contours=contours.size();
+        stats->quads=ws.quads.size();
+    }
+}
+
+void FractalMarkerDetector::decodeQuads(FractalDetectorWorkspace &ws) const{
+    const cv::Mat &bwimage=ws.bwimage;
+    auto &candidates=ws.candidates;
+    candidates.clear();
+    ws.markers.clear();
+    DetectionStats *stats=statsOf(ws);
+    _private::StageTimer timer(stats, DetectionStats::DECODE);
+
+    for(auto &markerCandidate:ws.quads)
+    {
+        //extract the code
+        //obtain the intensities of the bits using homography
+        _private::Homographer hom(markerCandidate);
+
+        bool decoded=false,borderFound=false;
+        //the grid of each number of bits is sampled once, and compared with the codes of all the sets
+        for(const auto &code:codeIndex)
+        {
+            int nbitsWithBorder = sqrt(code.first)+2;
+            cv::Mat bits(nbitsWithBorder,nbitsWithBorder,CV_8UC1);
+            int pixelSum=0;
+
+            for(int r=0;r<bits.rows;r++){
+                for(int c=0;c<bits.cols;c++){
+                    auto pixelValue=uchar(0.5+getSubpixelValue(bwimage,hom(cv::Point2f(  float(c+0.5) / float(bits.cols) ,  float(r+0.5) / float(bits.rows)  ))));
+                    bits.at<uchar>(r,c)=pixelValue;
+                    pixelSum+=pixelValue;
+                }
+            }
+
+            //threshold by the average value
+            double mean=double(pixelSum)/double(bits.cols*bits.rows);
+            cv::threshold(bits,bits,mean,255,cv::THRESH_BINARY);
+
+            //now, analyze the inner code to see if is a marker.
+            //  If so, rotate to have the points properly sorted
+            for(int set:code.second)
+            {
+                const FractalMarkerSet &markerSet=getFractalMarkerSet(set);
+                int nrotations=0;
+
+                int id=getMarkerId(bits, nrotations, markerSet.bits_ids.at(code.first), markerSet);
+
+                if(id==-2) break;//the border is the same for all the sets
+                borderFound=true;
+                if(id<0) continue;//not a marker
+                std::vector<cv::Point2f> corners=markerCandidate;
+                std::rotate(corners.begin(),corners.begin() + 4 - nrotations,corners.end());
+                candidates.push_back(std::make_pair(std::make_pair(set,id),corners));
+                decoded=true;
+                break;//a quad is a marker of one set at most
+            }
+        }
+        if(stats && !decoded){
+            if(borderFound) stats->rejectedCode++;
+            else stats->rejectedBorder++;
+        }
+    }
+
+    ////////////////////////////////////////////
     //remove duplicates
-    // sort by id and within same id set the largest first
-    std::sort(candidates.begin(), candidates.end(),[](const std::pair<int, std::vector<cv::Point2f>> &a,const std::pair<int, std::vector<cv::Point2f>> &b){
+    // sort by (set, id) and within same id set the largest first
+    typedef std::pair<std::pair<int,int>, std::vector<cv::Point2f>> Candidate;
+    std::sort(candidates.begin(), candidates.end(),[](const Candidate &a,const Candidate &b){
         if( a.first<b.first) return true;
         else if( a.first==b.first) return perimeter(a.second)>perimeter(b.second);
         else return false;
     });
 
-     // Using std::unique remove duplicates
-       auto ip = std::unique(candidates.begin(), candidates.end(),[](const std::pair<int, std::vector<cv::Point2f>> &a,const std::pair<int, std::vector<cv::Point2f>> &b){return a.first==b.first;});
-       candidates.resize(std::distance(candidates.begin(), ip));
+     // Using std::unique remove duplicates
+       auto ip = std::unique(candidates.begin(), candidates.end(),[](const Candidate &a,const Candidate &b){return a.first==b.first;});
+       if(stats) stats->rejectedDuplicate=std::distance(ip, candidates.end());
+       candidates.resize(std::distance(candidates.begin(), ip));
+       if(stats) stats->candidates=candidates.size();
+
+       if(candidates.size()>0){
+           ////////////////////////////////////////////
+           //finally subpixel corner refinement
+           //window from the mean side of each marker divided by its bits (border included)
+           std::vector<cv::Point2f> Corners;
+           std::vector<int> windows;
+           for (const auto &m:candidates){
+               Corners.insert(Corners.end(), m.second.begin(),m.second.end());
+               const FractalMarker &fm=getFractalMarkerSet(m.first.first).fractalMarkerCollection.at(m.first.second);
+               float bitPixels=perimeter(m.second)/4.f/(std::sqrt(float(fm.nBits()))+2.f);
+               windows.insert(windows.end(), 4, halfWindow(bitPixels));
+           }
+           refineCorners(bwimage, Corners, windows, refineParams);
+           // copy back to the markers
+           for (unsigned int i = 0; i < candidates.size(); i++)
+           {
+               ws.markers.push_back(getFractalMarkerSet(candidates[i].first.first).fractalMarkerCollection.at(candidates[i].first.second));
+               ws.markers[i].setIndex=candidates[i].first.first;
+               for (int c = 0; c < 4; c++) ws.markers[i].push_back(Corners[i * 4 + c]);
+           }
+       }
+}
+
+void FractalMarkerDetector::detectKeypoints(FractalDetectorWorkspace &ws) const{
+    DetectionStats *stats=statsOf(ws);
+    _private::StageTimer timer(stats, DetectionStats::FAST);
+    cv::Ptr<cv::FastFeatureDetector> fd = cv::FastFeatureDetector::create();
+    fd->detect(ws.bwimage, ws.kpoints);
+    if(stats) stats->keypoints=ws.kpoints.size();
+}
+
+void FractalMarkerDetector::classifyKeypoints(FractalDetectorWorkspace &ws) const{
+    if(ws.kpoints.empty()) return;
+    DetectionStats *stats=statsOf(ws);
+    _private::StageTimer timer(stats, DetectionStats::FILTER);
+    _private::kfilter(ws.kpoints);
+    if(stats) stats->keypointsFiltered=ws.kpoints.size();
+    timer.next(DetectionStats::CLASSIFY);
+    _private::assignClass(ws.bwimage, ws.kpoints);
+}
+
+void FractalMarkerDetector::buildIndex(FractalDetectorWorkspace &ws) const{
+    _private::StageTimer timer(statsOf(ws), DetectionStats::INDEX_BUILD);
+    indexKeypoints(ws);
+    timer.next(DetectionStats::HOMOGRAPHY);
+
+    //External corners to compute homography, one per set
+    std::vector<cv::Point2f>imgpoints;
+    std::vector<cv::Point3f>objpoints;
+    //with a camera, the homography is computed without the lens distortion, in full image coordinates
+    cv::Point2f roiOffset(ws.roiOffset);
+    ws.setsH.resize(extraSets.size());
+    for(int set=0; set<getNumMarkerSets(); set++)
+    {
+        imgpoints.clear();
+        objpoints.clear();
+        for(const auto &marker:ws.markers)
+        {
+            if(marker.setIndex!=set) continue;
+            for(auto p2d:marker)
+                imgpoints.push_back(lensLut? lensLut->undistort(p2d+roiOffset) : p2d);
+
+            for(int c=0; c<4; c++)
+            {
+                const cv::KeyPoint &kpt = getFractalMarkerSet(set).fractalMarkerCollection.at(marker.id).keypts[c];
+                objpoints.push_back(cv::Point3f(kpt.pt.x, kpt.pt.y, 0));
+            }
+        }
+        cv::Mat &H= set==0? ws.H : ws.setsH[set-1];
+        H= objpoints.empty()? cv::Mat() : cv::findHomography(objpoints, imgpoints);
+    }
+    ws.undistortedH = bool(lensLut);
+}
+
+void FractalMarkerDetector::indexKeypoints(FractalDetectorWorkspace &ws) const{
+    //building the kd-tree of n points costs n log n, and each query log n: the smaller set is indexed
+    ws.modelIndex = matchParams.strategy==MATCH_MODEL_INDEX ||
+            (matchParams.strategy==MATCH_AUTO && ws.kpoints.size()>nModelPoints);
+    if(!ws.modelIndex) ws.kdtree.build(ws.kpoints);
+}
+
+void FractalMarkerDetector::matchKeypoints(FractalDetectorWorkspace &ws, std::vector<cv::Point3f>& p3d, std::vector<cv::Point2f>& p2d,
+                                           std::vector<int>* modelIdx, const std::vector<uchar>* skip) const{
+    const std::vector<cv::KeyPoint> &kpoints=ws.kpoints;
+    ws.pointBits.assign(p2d.size(), 0.f);
+    ws.pointSets.assign(p2d.size(), -1);
+    DetectionStats *stats=statsOf(ws);
+    _private::StageTimer timer(stats, DetectionStats::MATCH);
+    size_t nInitial=p2d.size();
+    cv::Point2f roiOffset(ws.roiOffset);
+    std::vector<_private::ModelQuery> &queries=ws.queries;
+    queries.clear();
+
+    //model points to search, and corners taken as they are, in the order of the output. The sets whose markers were
+    //not found are skipped, but their points are counted in the model indices
+    int offset=0;//index of the first keypoint of the marker in all the sets
+    for(int set=0; set<getNumMarkerSets(); set++)
+    {
+        const cv::Mat &H=homographyOf(ws, set);
+        if(H.empty()){
+            for(const auto &fm:getFractalMarkerSet(set).fractalMarkerCollection) offset+=fm.second.keypts.size();
+            continue;
+        }
+        for(const auto &fm:getFractalMarkerSet(set).fractalMarkerCollection)
+        {
+            std::vector<cv::Point2f> imgPoints;
+            std::vector<cv::Point2f> objPoints;
+            const std::vector<cv::KeyPoint> &objKeyPoints = fm.second.keypts;
+            //size of a bit of the marker in model units. Its keypoints are corners of its bits, so they are at least that far
+            float bitSize = fm.second.getMarkerSize() / (std::sqrt(float(fm.second.nBits()))+2.f);
+
+            for(auto kpt : objKeyPoints)
+                objPoints.push_back(cv::Point2f(kpt.pt.x, kpt.pt.y));
+
+            cv::perspectiveTransform(objPoints, imgPoints, H);
+            if(ws.undistortedH && lensLut)
+                for(auto &p:imgPoints) p=lensLut->distort(p)-roiOffset;
+
+            //We consider only markers whose internal points are separated by a specific distance.
+            bool consider=true;
+            for(size_t i=0; i<imgPoints.size()-1 && consider; i++)
+                for(size_t j=i+1; j<imgPoints.size() && consider; j++)
+                    if(pow(imgPoints[i].x-imgPoints[j].x, 2) + pow(imgPoints[i].y-imgPoints[j].y, 2) < 150)
+                        consider=false;
+
+            if(consider)
+            {
+                for(size_t idx=0; idx<imgPoints.size(); idx++)
+                {
+                    if(skip && (*skip)[offset+idx]) continue;
+                    if(!kpoints.empty() && imgPoints[idx].x > 0 && imgPoints[idx].x < ws.bwimage.cols
+                            && imgPoints[idx].y>0 && imgPoints[idx].y<ws.bwimage.rows)
+                    {
+                        _private::ModelQuery q;
+                        q.pt=imgPoints[idx];
+                        q.obj=cv::Point3f(objPoints[idx].x, objPoints[idx].y, 0);
+                        //the lens distortion is not considered: its local scale is close to 1 at the size of a bit
+                        q.bitPixels = bitSize*_private::homographyMinScale(H, objPoints[idx]);
+                        q.radius = matchParams.fixedRadius;
+                        if(matchParams.bitFraction>0)
+                            q.radius = std::min(matchParams.maxRadius, std::max(matchParams.minRadius,
+                                       matchParams.bitFraction*q.bitPixels));
+                        q.classId=objKeyPoints[idx].class_id;
+                        q.modelIdx=offset+idx;
+                        q.markerSet=set;
+                        queries.push_back(q);
+                    }
+                }
+            }
+            else
+            {
+                //If a marker is detected and it is not possible take all their corners,
+                //at least take the external one!
+                for(const auto &markerDetected:ws.markers)
+                {
+                    if(markerDetected.id == fm.first && markerDetected.setIndex == set)
+                    {
+                        for(int c=0; c<4; c++)
+                        {
+                            if(skip && (*skip)[offset+c]) continue;
+                            cv::Point2f pt = markerDetected.keypts[c].pt;
+                            _private::ModelQuery q;
+                            q.pt=markerDetected[c];
+                            q.obj=cv::Point3f(pt.x,pt.y,0);
+                            q.bitPixels=bitSize*_private::homographyMinScale(H, pt);
+                            q.modelIdx=offset+c;
+                            q.markerSet=set;
+                            q.direct=true;
+                            queries.push_back(q);
+                        }
+                        break;
+                    }
+                }
+            }
+            offset+=objKeyPoints.size();
+        }
+    }
 
-       if(candidates.size()>0){
-           ////////////////////////////////////////////
-           //finally subpixel corner refinement
-           int halfwsize= 4*float(bwimage.cols)/float(bwimage.cols) +0.5 ;
-           std::vector<cv::Point2f> Corners;
-           for (const auto &m:candidates)
-               Corners.insert(Corners.end(), m.second.begin(),m.second.end());
-           cv::cornerSubPix(bwimage, Corners, cv::Size(halfwsize,halfwsize), cv::Size(-1, -1),cv::TermCriteria( cv::TermCriteria::MAX_ITER | cv::TermCriteria::EPS, 12, 0.005));
-           // copy back to the markers
-           for (unsigned int i = 0; i < candidates.size(); i++)
-           {
-               DetectedFractalMarkers.push_back(fractalMarkerSet.fractalMarkerCollection[candidates[i].first]);
-               for (int c = 0; c < 4; c++) DetectedFractalMarkers[i].push_back(Corners[i * 4 + c]);
-           }
-       }
+    //keypoints of the class of each model point within its radius. Both strategies find the same candidates (same
+    //strict comparison of the same squared distances), and count all the keypoints within the radius
+    std::vector<_private::MatchCandidate> &cands=ws.matchCandidates;
+    cands.clear();
+    std::vector<std::pair<uint32_t, double>> res;
+    if(!ws.modelIndex)
+    {
+        for(size_t qi=0; qi<queries.size(); qi++)
+        {
+            _private::ModelQuery &q=queries[qi];
+            if(q.direct) continue;
+            ws.kdtree.radiusSearch(res, kpoints, q.pt, q.radius, false);
+            if(stats) stats->queries++;
+            q.count=res.size();
+            for(const auto &r:res)
+                if(kpoints[r.first].class_id==q.classId)
+                    cands.push_back({int(qi), int(r.first), float(r.second)});
+        }
+    }
+    else if(!queries.empty())
+    {
+        //the direct corners have radius 0, so no keypoint is ever within it
+        float maxRadius=0;
+        for(const auto &q:queries) maxRadius=std::max(maxRadius, q.radius);
+        ws.modelTree.build(queries);
+        for(size_t k=0; k<kpoints.size(); k++)
+        {
+            ws.modelTree.radiusSearch(res, queries, kpoints[k], maxRadius, false);
+            if(stats) stats->queries++;
+            for(const auto &r:res)
+            {
+                _private::ModelQuery &q=queries[r.first];
+                double radius=q.radius;
+                if(r.second>=radius*radius) continue;
+                q.count++;
+                if(kpoints[k].class_id==q.classId)
+                    cands.push_back({int(r.first), int(k), float(r.second)});
+            }
+        }
+    }
+    //a model point with several keypoints around it is ambiguous
+    if(matchParams.strictCandidates)
+        cands.erase(std::remove_if(cands.begin(), cands.end(), [&queries](const _private::MatchCandidate &c){
+            return queries[c.query].count!=1;
+        }), cands.end());
+    _private::assignCandidates(cands, queries.size(), kpoints.size(), matchParams.assignment==ASSIGN_OPTIMAL,
+                               matchParams.maxComponentSize, ws.queryMatch, ws.keypointOwner);
+
+    for(size_t qi=0; qi<queries.size(); qi++)
+    {
+        const _private::ModelQuery &q=queries[qi];
+        if(q.direct)
+            p2d.push_back(q.pt);
+        else if(ws.queryMatch[qi]>=0)
+            p2d.push_back(kpoints[ws.queryMatch[qi]].pt);
+        else
+            continue;
+        p3d.push_back(q.obj);
+        ws.pointBits.push_back(q.bitPixels);
+        ws.pointSets.push_back(q.markerSet);
+        if(modelIdx) modelIdx->push_back(q.modelIdx);
+    }
+    if(stats) stats->matches+=p2d.size()-nInitial;
+}
 
-    //Done
-    return DetectedFractalMarkers;
+void FractalMarkerDetector::refinePoints(FractalDetectorWorkspace &ws, std::vector<cv::Point2f>& p2d, const std::vector<uchar>* skip) const{
+    _private::StageTimer timer(statsOf(ws), DetectionStats::SUBPIX);
+    std::vector<int> windows(p2d.size());
+    bool known=ws.pointBits.size()==p2d.size();
+    for(size_t i=0; i<p2d.size(); i++) windows[i]=halfWindow(known? ws.pointBits[i] : 0.f);
+    refineCorners(ws.bwimage, p2d, windows, refineParams, skip, &ws.pointStable);
+}
+
+int FractalMarkerDetector::refineHalfWindow(float bitPixels, const RefineParams &params){
+    if(params.windowFraction<=0 || bitPixels<=0) return params.fixedHalfWindow;
+    int w=int(params.windowFraction*bitPixels+0.5f);
+    return std::min(params.maxHalfWindow, std::max(params.minHalfWindow, w));
+}
+
+void FractalMarkerDetector::refineCorners(const cv::Mat &gray, std::vector<cv::Point2f> &points, const std::vector<int> &halfWindows,
+                                          const RefineParams &params, const std::vector<uchar> *skip, std::vector<uchar> *stable){
+    if(stable) stable->assign(points.size(), 0);
+    if(points.empty()) return;
+    cv::TermCriteria criteria(cv::TermCriteria::MAX_ITER | cv::TermCriteria::EPS, params.maxIterations, params.epsilon);
+    if(params.useOpenCV || gray.type()!=CV_8UC1){
+        //all the points in one call, as before. The skipped ones are restored afterwards
+        std::vector<cv::Point2f> original=points;
+        cv::cornerSubPix(gray, points, cv::Size(params.fixedHalfWindow, params.fixedHalfWindow), cv::Size(-1,-1), criteria);
+        for(size_t i=0; i<points.size(); i++){
+            if(skip && (*skip)[i]) points[i]=original[i];
+            else if(stable) (*stable)[i]=cv::norm(points[i]-original[i])<params.stableShift;
+        }
+        return;
+    }
+    auto refineRange=[&](const cv::Range &r){
+        _private::CornerRefineBuffers buf;
+        for(int i=r.start; i<r.end; i++){
+            if(skip && (*skip)[i]) continue;
+            int w=halfWindows.empty()? params.fixedHalfWindow : halfWindows[i];
+            float firstShift;
+            if(_private::refineCorner(gray, points[i], w, params.maxIterations, params.epsilon, buf, firstShift) && stable)
+                (*stable)[i]=firstShift<params.stableShift;
+        }
+    };
+    int n=points.size();
+    if(params.chunkSize<=0 || n<=params.chunkSize) refineRange(cv::Range(0,n));
+    else{
+        int nChunks=(n+params.chunkSize-1)/params.chunkSize;
+        cv::parallel_for_(cv::Range(0,nChunks), [&](const cv::Range &chunks){
+            refineRange(cv::Range(chunks.start*params.chunkSize, std::min(n, chunks.end*params.chunkSize)));
+        });
+    }
 }
 
 int  FractalMarkerDetector::perimeter(const std::vector<cv::Point2f>& a)
@@ -1527,10 +3478,10 @@ int FractalMarkerDetector:: getMarkerId(const cv::Mat &bits, int &nrotations, co
 
      //first check that outer is all black
     for(int x=0;x<bits.cols;x++){
-        if( bits.at<uchar>(0,x)!=0)return -1;
-        if( bits.at<uchar>(bits.rows-1,x)!=0)return -1;
-        if( bits.at<uchar>(x,0)!=0)return -1;
-        if( bits.at<uchar>(x,bits.cols-1)!=0)return -1;
+        if( bits.at<uchar>(0,x)!=0)return -2;
+        if( bits.at<uchar>(bits.rows-1,x)!=0)return -2;
+        if( bits.at<uchar>(x,0)!=0)return -2;
+        if( bits.at<uchar>(x,bits.cols-1)!=0)return -2;
     }
 
      //now, get the inner bits wo the black border
@@ -1544,7 +3495,7 @@ int FractalMarkerDetector:: getMarkerId(const cv::Mat &bits, int &nrotations, co
     {
         for(auto idx:markersId)
         {
-            FractalMarker fm = fmset.fractalMarkerCollection.at(idx);
+            const FractalMarker &fm = fmset.fractalMarkerCollection.at(idx);
 
             //Apply mask to substract submarkers
 
@@ -1607,6 +3558,926 @@ std::vector<cv::Point2f>  FractalMarkerDetector::sort( const  std::vector<cv::Po
         }
     return res_marker;
 }
+
+namespace _private{
+/**
+ * Fixed size thread pool with one task deque per worker. A worker pops tasks from the back of its own deque and, when
+ * it runs out, steals from the front of the others, so frames of very different cost still keep all workers busy.
+ */
+class WorkStealingPool{
+public:
+    //@param nThreads number of workers (<=0 uses the hardware concurrency)
+    //@param cpuAffinity cpus the workers are pinned to (worker i goes to cpuAffinity[i%size]). Empty: no pinning
+    inline WorkStealingPool(int nThreads=0, const std::vector<int> &cpuAffinity=std::vector<int>());
+    inline ~WorkStealingPool();
+    WorkStealingPool(const WorkStealingPool&)=delete;
+    WorkStealingPool& operator=(const WorkStealingPool&)=delete;
+
+    inline int size()const{return int(_workers.size());}
+    //runs task(i,workerIdx) for every i in [0,n) and waits until all of them are done. Not reentrant.
+    //If a task throws, the first exception is rethrown here once the rest of the tasks have finished.
+    inline void run(size_t n, const std::function<void(size_t,int)> &task);
+private:
+    typedef std::function<void(size_t,int)> Task;
+    struct Worker{
+        std::mutex mtx;
+        std::deque<std::pair<const Task*,size_t>> tasks;//the function travels with the index
+        std::thread th;
+    };
+    std::vector<std::unique_ptr<Worker>> _workers;
+    std::mutex _mtx;
+    std::condition_variable _cvWork,_cvDone;
+    uint64_t _generation=0;
+    bool _stop=false;
+    size_t _pending=0;
+    std::exception_ptr _exception;
+
+    inline bool popTask(int widx, std::pair<const Task*,size_t> &task);
+    inline void workerLoop(int widx);
+};
+
+WorkStealingPool::WorkStealingPool(int nThreads, const std::vector<int> &cpuAffinity){
+    if(nThreads<=0) nThreads=std::max(1u,std::thread::hardware_concurrency());
+    for(int i=0;i<nThreads;i++) _workers.emplace_back(new Worker());
+    for(int i=0;i<nThreads;i++){
+        _workers[i]->th=std::thread(&WorkStealingPool::workerLoop,this,i);
+#ifdef __linux__
+        if(!cpuAffinity.empty()){
+            cpu_set_t cpuset;
+            CPU_ZERO(&cpuset);
+            CPU_SET(cpuAffinity[i%cpuAffinity.size()], &cpuset);
+            pthread_setaffinity_np(_workers[i]->th.native_handle(), sizeof(cpu_set_t), &cpuset);
+        }
+#endif
+    }
+}
+
+WorkStealingPool::~WorkStealingPool(){
+    {
+        std::unique_lock<std::mutex> lock(_mtx);
+        _stop=true;
+    }
+    _cvWork.notify_all();
+    for(auto &w:_workers) w->th.join();
+}
+
+bool WorkStealingPool::popTask(int widx, std::pair<const Task*,size_t> &task){
+    //own tasks first, from the back
+    {
+        Worker &w=*_workers[widx];
+        std::unique_lock<std::mutex> lock(w.mtx);
+        if(!w.tasks.empty()){
+            task=w.tasks.back();
+            w.tasks.pop_back();
+            return true;
+        }
+    }
+    //then steal from the front of the others
+    for(size_t i=1;i<_workers.size();i++){
+        Worker &v=*_workers[(widx+i)%_workers.size()];
+        std::unique_lock<std::mutex> lock(v.mtx);
+        if(!v.tasks.empty()){
+            task=v.tasks.front();
+            v.tasks.pop_front();
+            return true;
+        }
+    }
+    return false;
+}
+
+void WorkStealingPool::workerLoop(int widx){
+    traceThreadName("pool worker "+std::to_string(widx));
+    uint64_t lastGeneration=0;
+    while(true){
+        {
+            std::unique_lock<std::mutex> lock(_mtx);
+            _cvWork.wait(lock,[&]{return _stop || _generation!=lastGeneration;});
+            if(_stop) return;
+            lastGeneration=_generation;
+        }
+        std::pair<const Task*,size_t> task;
+        while(popTask(widx,task)){
+            try{
+                TraceScope trace("pool task");
+                (*task.first)(task.second,widx);
+            }catch(...){
+                std::unique_lock<std::mutex> lock(_mtx);
+                if(!_exception) _exception=std::current_exception();
+            }
+            std::unique_lock<std::mutex> lock(_mtx);
+            if(--_pending==0) _cvDone.notify_all();
+        }
+    }
+}
+
+void WorkStealingPool::run(size_t n, const std::function<void(size_t,int)> &task){
+    if(n==0) return;
+    //contiguous blocks per worker keep neighbouring frames together; stealing balances the rest
+    size_t blockSize=(n+_workers.size()-1)/_workers.size();
+    std::unique_lock<std::mutex> lock(_mtx);
+    _pending=n;
+    _exception=nullptr;
+    for(size_t w=0;w<_workers.size();w++){
+        std::unique_lock<std::mutex> wlock(_workers[w]->mtx);
+        for(size_t i=w*blockSize;i<std::min(n,(w+1)*blockSize);i++)
+            _workers[w]->tasks.push_front(std::make_pair(&task,i));
+    }
+    _generation++;
+    _cvWork.notify_all();
+    _cvDone.wait(lock,[&]{return _pending==0;});
+    if(_exception) std::rethrow_exception(_exception);
+}
+}
+
+/**
+ * @brief Parameters of the FractalBatchDetector
+ */
+struct FractalBatchParams{
+    int nThreads=0;//number of worker threads. <=0: hardware concurrency
+    std::vector<int> cpuAffinity;//cpus to pin the workers to (round robin). Empty: no pinning. Only on Linux
+    bool correspondences=true;//if true, computes also the p3d/p2d correspondences of each frame
+};
+
+/**
+ * @brief Detection result of one frame of the batch
+ */
+struct FractalBatchResult{
+    std::vector<FractalMarker> markers;
+    std::vector<cv::Point3f> p3d;
+    std::vector<cv::Point2f> p2d;
+    std::vector<int> pointSets;//marker set of each point (see FractalMarkerDetector::addMarkerSet)
+    double latencyMs=0;//time spent detecting this frame
+};
+
+/**
+ * @brief Results of a batch, in the same order as the input frames, and aggregated timing
+ */
+struct FractalBatchReport{
+    std::vector<FractalBatchResult> results;
+    double totalMs=0;//wall time of the whole batch
+    double framesPerSecond=0;//aggregate throughput
+    double meanLatencyMs=0,medianLatencyMs=0,p95LatencyMs=0,maxLatencyMs=0;
+};
+
+/**
+ * @brief Detects markers in many frames at once, spreading them over a work stealing thread pool.
+ *
+ * The pool and one FractalDetectorWorkspace per worker are created once and reused by every call to detectBatch.
+ * Example:
+ *
+ * nanofractal::FractalMarkerDetector detector;
+ * detector.setParams("FRACTAL_4L_6");
+ * nanofractal::FractalBatchParams params;
+ * params.nThreads=8;
+ * nanofractal::FractalBatchDetector batch(detector, params);
+ * auto report=batch.detectBatch(frames);
+ */
+class FractalBatchDetector{
+public:
+    inline FractalBatchDetector(const FractalMarkerDetector &detector, const FractalBatchParams &params=FractalBatchParams());
+    //detects the frames passed. Not reentrant: use one FractalBatchDetector per calling thread
+    inline FractalBatchReport detectBatch(const std::vector<cv::Mat> &frames);
+    inline FractalBatchReport detectBatch(const cv::Mat *frames, size_t nFrames);
+
+    inline int nThreads()const{return _pool.size();}
+private:
+    FractalMarkerDetector _detector;
+    FractalBatchParams _params;
+    _private::WorkStealingPool _pool;
+    std::vector<FractalDetectorWorkspace> _workspaces;
+};
+
+FractalBatchDetector::FractalBatchDetector(const FractalMarkerDetector &detector, const FractalBatchParams &params):
+    _detector(detector),_params(params),_pool(params.nThreads,params.cpuAffinity){
+    _workspaces.resize(_pool.size());
+}
+
+FractalBatchReport FractalBatchDetector::detectBatch(const std::vector<cv::Mat> &frames){
+    return detectBatch(frames.data(), frames.size());
+}
+
+FractalBatchReport FractalBatchDetector::detectBatch(const cv::Mat *frames, size_t nFrames){
+    using namespace std::chrono;
+    FractalBatchReport report;
+    report.results.resize(nFrames);
+    if(nFrames==0) return report;
+
+    auto start = high_resolution_clock::now();
+    _pool.run(nFrames,[&](size_t i, int worker){
+        FractalBatchResult &res=report.results[i];
+        auto t0 = high_resolution_clock::now();
+        if(_params.correspondences){
+            res.markers=_detector.detect(frames[i], res.p3d, res.p2d, _workspaces[worker]);
+            res.pointSets=_workspaces[worker].pointSets;
+        }
+        else
+            res.markers=_detector.detect(frames[i], _workspaces[worker]);
+        res.latencyMs = duration<double, std::milli>(high_resolution_clock::now()-t0).count();
+    });
+    report.totalMs = duration<double, std::milli>(high_resolution_clock::now()-start).count();
+    report.framesPerSecond = 1000.*double(nFrames)/std::max(report.totalMs,1e-9);
+
+    std::vector<double> latencies;
+    for(const auto &r:report.results) latencies.push_back(r.latencyMs);
+    std::sort(latencies.begin(),latencies.end());
+    double sum=0;
+    for(auto l:latencies) sum+=l;
+    report.meanLatencyMs = sum/double(latencies.size());
+    report.medianLatencyMs = latencies[latencies.size()/2];
+    report.p95LatencyMs = latencies[std::min(latencies.size()-1, size_t(0.95*double(latencies.size())))];
+    report.maxLatencyMs = latencies.back();
+    return report;
+}
+
+namespace _private{
+/**
+ * Bounded lock free queue for exactly one producer thread and one consumer thread.
+ */
+template<typename T>
+class SpscQueue{
+public:
+    //capacity is rounded up to a power of two
+    explicit SpscQueue(size_t capacity){
+        size_t cap=1;
+        while(cap<capacity) cap<<=1;
+        _buffer.resize(cap);
+        _mask=cap-1;
+    }
+    //returns false if the queue is full
+    inline bool push(const T &val){
+        size_t head=_head.load(std::memory_order_relaxed);
+        if(head-_tail.load(std::memory_order_acquire)==_buffer.size()) return false;
+        _buffer[head&_mask]=val;
+        _head.store(head+1,std::memory_order_release);
+        return true;
+    }
+    //returns false if the queue is empty
+    inline bool pop(T &val){
+        size_t tail=_tail.load(std::memory_order_relaxed);
+        if(tail==_head.load(std::memory_order_acquire)) return false;
+        val=_buffer[tail&_mask];
+        _tail.store(tail+1,std::memory_order_release);
+        return true;
+    }
+    inline size_t capacity()const{return _buffer.size();}
+private:
+    std::vector<T> _buffer;
+    size_t _mask;
+    alignas(64) std::atomic<size_t> _head{0};
+    alignas(64) std::atomic<size_t> _tail{0};
+};
+
+//spins for a while and then sleeps, used while waiting on the lock free queues
+struct Backoff{
+    int count=0;
+    inline void wait(){
+        if(count++<64) std::this_thread::yield();
+        else std::this_thread::sleep_for(std::chrono::microseconds(50));
+    }
+    inline void reset(){count=0;}
+};
+}
+
+//number of stages of the FractalStreamProcessor
+static const int STREAM_NSTAGES=8;
+
+/**
+ * @brief Parameters of the FractalStreamProcessor
+ */
+struct FractalStreamParams{
+    enum DropPolicy{
+        BLOCK=0,//push() waits until the pipeline has room for the frame
+        DROP_NEWEST=1,//push() discards the frame passed if the pipeline is full
+        //frames waiting to enter the pipeline are skipped in favour of the most recent one. If the pipeline is full,
+        //push() takes back a frame still waiting, or else the oldest result not popped, for the frame passed
+        DROP_OLDEST=2
+    };
+    int queueSize=2;//capacity of the queues between consecutive stages
+    DropPolicy dropPolicy=BLOCK;
+    bool correspondences=true;//if true, computes also the p3d/p2d correspondences of each frame
+};
+
+/**
+ * @brief Detection result of one frame of the stream
+ */
+struct FractalStreamResult{
+    uint64_t frameId=0;
+    std::vector<FractalMarker> markers;
+    std::vector<cv::Point3f> p3d;
+    std::vector<cv::Point2f> p2d;
+    std::vector<int> pointSets;//marker set of each point (see FractalMarkerDetector::addMarkerSet)
+    double latencyMs=0;//from push() until the last stage finished
+    double stageMs[STREAM_NSTAGES]={};//time spent in each stage (see FractalStreamProcessor::stageName)
+    //not empty if a stage failed on the frame (what() of its exception). The next stages are skipped, and the
+    //markers and points are empty
+    std::string error;
+};
+
+/**
+ * @brief Processes a video stream running the detection stages of consecutive frames at the same time.
+ *
+ * Each stage (gray conversion, threshold/contours, decode, FAST, classify, index build, match, cornerSubPix) runs in
+ * its own thread, and the stages are connected by bounded lock free queues, so the throughput is limited by the
+ * slowest stage instead of by the sum of all of them. Results come out in the same order the frames went in.
+ * A full pipeline pushes back to the producer, which either waits or drops frames depending on the DropPolicy.
+ *
+ * Example:
+ *
+ * nanofractal::FractalStreamProcessor stream(detector);
+ * while(capture.read(frame)){
+ *    stream.push(frame, frameIdx++);
+ *    nanofractal::FractalStreamResult res;
+ *    while(stream.tryPop(res)) use(res);
+ * }
+ */
+class FractalStreamProcessor{
+public:
+    static const int NSTAGES=STREAM_NSTAGES;
+
+    inline FractalStreamProcessor(const FractalMarkerDetector &detector, const FractalStreamParams &params=FractalStreamParams());
+    inline ~FractalStreamProcessor();
+    FractalStreamProcessor(const FractalStreamProcessor&)=delete;
+    FractalStreamProcessor& operator=(const FractalStreamProcessor&)=delete;
+
+    //Adds a frame to the stream. The frame is copied, so the caller can reuse its buffer.
+    //Returns false if the frame was dropped. Must always be called from the same thread.
+    inline bool push(const cv::Mat &frame, uint64_t frameId);
+    //Gets the next result. Waits at most timeoutMs (negative: forever). Returns false if no result was ready.
+    //Must always be called from the same thread (it can be the one calling push)
+    inline bool pop(FractalStreamResult &res, int timeoutMs=-1);
+    inline bool tryPop(FractalStreamResult &res){return pop(res,0);}
+
+    //number of frames dropped so far
+    inline uint64_t droppedFrames()const{return _dropped.load(std::memory_order_relaxed);}
+    //number of frames whose detection failed so far (see FractalStreamResult::error)
+    inline uint64_t failedFrames()const{return _failed.load(std::memory_order_relaxed);}
+    static inline const char* stageName(int stage);
+private:
+    struct Job{
+        cv::Mat frame;
+        uint64_t frameId=0;
+        bool dropped=false;
+        std::string error;//what() of the exception of the stage that failed
+        FractalDetectorWorkspace ws;
+        std::vector<cv::Point3f> p3d;
+        std::vector<cv::Point2f> p2d;
+        std::chrono::high_resolution_clock::time_point pushTime;
+        double stageMs[NSTAGES];
+    };
+    typedef _private::SpscQueue<Job*> Queue;
+
+    FractalMarkerDetector _detector;
+    FractalStreamParams _params;
+    std::vector<std::unique_ptr<Job>> _jobs;
+    std::unique_ptr<Queue> _free;//jobs available for push(). Producer: pop(), consumer: push()
+    std::vector<std::unique_ptr<Queue>> _queues;//_queues[i] feeds stage i, _queues[NSTAGES] holds the results
+    std::vector<std::thread> _threads;
+    std::atomic<bool> _stop{false};
+    std::atomic<uint64_t> _dropped{0};
+    std::atomic<uint64_t> _failed{0};
+    //with DROP_OLDEST, push() also consumes the input and the results: their consumers take these first
+    std::mutex _inputMutex, _resultsMutex;
+
+    inline void runStage(int stage, Job &job) const;
+    //pops from _queues[queue] (NSTAGES: the results), serializing the consumers of the queues shared with push()
+    inline bool popFrom(int queue, Job *&job);
+    inline void stageLoop(int stage);
+    //passes the job to the next queue, waiting while it is full. Returns false if the processor is stopping
+    inline bool forward(int stage, Job *job);
+};
+
+FractalStreamProcessor::FractalStreamProcessor(const FractalMarkerDetector &detector, const FractalStreamParams &params):
+    _detector(detector),_params(params){
+    //enough jobs for every stage to hold one and the queues between them to be full
+    size_t queueSize=std::max(1,_params.queueSize);
+    size_t nJobs=NSTAGES+queueSize*2;
+    for(size_t i=0;i<nJobs;i++) _jobs.emplace_back(new Job());
+    _free.reset(new Queue(nJobs));
+    for(auto &job:_jobs) _free->push(job.get());
+    //the input and output queues can hold all the jobs: the limit there is the number of jobs
+    _queues.emplace_back(new Queue(nJobs));
+    for(int i=1;i<NSTAGES;i++) _queues.emplace_back(new Queue(queueSize));
+    _queues.emplace_back(new Queue(nJobs));
+    for(int i=0;i<NSTAGES;i++)
+        _threads.emplace_back(&FractalStreamProcessor::stageLoop,this,i);
+}
+
+FractalStreamProcessor::~FractalStreamProcessor(){
+    _stop=true;
+    for(auto &th:_threads) th.join();
+}
+
+const char* FractalStreamProcessor::stageName(int stage){
+    static const char* names[NSTAGES]={"gray","threshold_contours","decode","fast","classify","index_build","match","subpix"};
+    return names[stage];
+}
+
+bool FractalStreamProcessor::push(const cv::Mat &frame, uint64_t frameId){
+    Job *job;
+    _private::Backoff backoff;
+    while(!_free->pop(job)){
+        if(_params.dropPolicy==FractalStreamParams::DROP_NEWEST){
+            _dropped++;
+            return false;
+        }
+        //DROP_OLDEST: a frame waiting for the first stage (it would be skipped anyway), or else the oldest result
+        //not popped, is replaced by this one. If all the frames are inside the stages, waits for one to come out
+        if(_params.dropPolicy==FractalStreamParams::DROP_OLDEST && (popFrom(0, job) || popFrom(NSTAGES, job))){
+            if(!job->dropped) _dropped++;
+            break;
+        }
+        backoff.wait();
+    }
+    frame.copyTo(job->frame);
+    job->frameId=frameId;
+    job->dropped=false;
+    job->error.clear();
+    job->pushTime=std::chrono::high_resolution_clock::now();
+    for(int i=0;i<NSTAGES;i++) job->stageMs[i]=0;
+    //the input queue can hold all the jobs, so this never fails
+    _queues[0]->push(job);
+    return true;
+}
+
+bool FractalStreamProcessor::pop(FractalStreamResult &res, int timeoutMs){
+    using namespace std::chrono;
+    auto start=high_resolution_clock::now();
+    _private::Backoff backoff;
+    Job *job;
+    while(true){
+        if(popFrom(NSTAGES, job)){
+            if(!job->dropped) break;
+            _free->push(job);
+            continue;
+        }
+        if(timeoutMs>=0 && duration<double, std::milli>(high_resolution_clock::now()-start).count()>=timeoutMs)
+            return false;
+        backoff.wait();
+    }
+    res.frameId=job->frameId;
+    res.error=job->error;
+    //the workspace of a failed frame is half filled
+    if(!job->error.empty()){
+        job->ws.markers.clear();
+        job->p3d.clear();
+        job->p2d.clear();
+        job->ws.pointSets.clear();
+    }
+    res.markers.swap(job->ws.markers);
+    res.p3d.swap(job->p3d);
+    res.p2d.swap(job->p2d);
+    res.pointSets.swap(job->ws.pointSets);
+    res.latencyMs=duration<double, std::milli>(high_resolution_clock::now()-job->pushTime).count();
+    for(int i=0;i<NSTAGES;i++) res.stageMs[i]=job->stageMs[i];
+    _free->push(job);
+    return true;
+}
+
+void FractalStreamProcessor::runStage(int stage, Job &job) const{
+    FractalDetectorWorkspace &ws=job.ws;
+    //only the marker detection stages run on frames without markers, as in FractalMarkerDetector::detect
+    if(stage>2 && (!_params.correspondences || ws.markers.empty())) return;
+    switch(stage){
+    case 0:
+        job.p3d.clear();
+        job.p2d.clear();
+        ws.pointSets.clear();
+        _detector.convertToGray(job.frame, ws);
+        break;
+    case 1: _detector.detectQuads(ws); break;
+    case 2: _detector.decodeQuads(ws); break;
+    case 3: _detector.detectKeypoints(ws); break;
+    case 4: _detector.classifyKeypoints(ws); break;
+    case 5: _detector.buildIndex(ws); break;
+    case 6: _detector.matchKeypoints(ws, job.p3d, job.p2d); break;
+    case 7:
+        _detector.refinePoints(ws, job.p2d);
+        _detector.outputPoints(ws, job.p2d, 0);
+        break;
+    };
+}
+
+bool FractalStreamProcessor::popFrom(int queue, Job *&job){
+    if(_params.dropPolicy!=FractalStreamParams::DROP_OLDEST || (queue!=0 && queue!=NSTAGES))
+        return _queues[queue]->pop(job);
+    std::lock_guard<std::mutex> lock(queue==0? _inputMutex : _resultsMutex);
+    return _queues[queue]->pop(job);
+}
+
+bool FractalStreamProcessor::forward(int stage, Job *job){
+    _private::Backoff backoff;
+    while(!_queues[stage+1]->push(job)){
+        if(_stop) return false;
+        backoff.wait();
+    }
+    return true;
+}
+
+void FractalStreamProcessor::stageLoop(int stage){
+    using namespace std::chrono;
+    _private::traceThreadName(std::string("stream ")+stageName(stage));
+    _private::Backoff backoff;
+    while(!_stop){
+        Job *job;
+        if(!popFrom(stage, job)){
+            backoff.wait();
+            continue;
+        }
+        backoff.reset();
+        //skip all the frames waiting but the most recent one. They go on as dropped to keep the order of the queues
+        if(stage==0 && _params.dropPolicy==FractalStreamParams::DROP_OLDEST){
+            Job *newer;
+            while(popFrom(stage, newer)){
+                job->dropped=true;
+                _dropped++;
+                if(!forward(stage,job)) return;
+                job=newer;
+            }
+        }
+        if(!job->dropped && job->error.empty()){
+            auto t0=high_resolution_clock::now();
+            //the next stages would run on a half filled workspace: they are skipped
+            try{
+                _private::TraceScope trace(stageName(stage));
+                runStage(stage,*job);
+            }catch(const std::exception &ex){
+                job->error=std::string(stageName(stage))+": "+ex.what();
+                _failed++;
+            }catch(...){
+                job->error=std::string(stageName(stage))+": unknown exception";
+                _failed++;
+            }
+            job->stageMs[stage]=duration<double, std::milli>(high_resolution_clock::now()-t0).count();
+        }
+        if(!forward(stage,job)) return;
+    }
+}
+
+/**
+ * @brief Parameters of the FractalMarkerTracker
+ */
+struct FractalTrackerParams{
+    int redetectInterval=30;//full image detection every redetectInterval frames (<=0: only when the marker is lost)
+    bool constantVelocity=true;//if true, the ROI is moved according to the motion between the last two frames
+    float roiMargin=0.25f;//the ROI is enlarged on each side by this fraction of the size of the tracked markers
+    int minRoiSize=64;//minimum width and height of the ROI in pixels
+
+    //Incremental correspondences (track(img,p3d,p2d) only): the points of the previous frame are propagated with
+    //pyramidal Lucas-Kanade, and FAST and matching run only for the model points lost or newly visible
+    bool kltPropagation=false;
+    cv::Size kltWinSize=cv::Size(21,21);
+    int kltMaxLevel=3;
+    float maxModelDistance=10;//max distance in pixels between a propagated point and its model point projected
+    float maxReprojError=3;//ransac threshold of the homography fitted to the propagated points
+    //propagated points whose subpixel refinement in the previous frame barely moved them (RefineParams::stableShift)
+    //are not refined again. A point skipped in one frame is always refined in the next
+    bool skipStablePoints=true;
+};
+
+/**
+ * @brief Detects fractal markers in a video, searching only around the position predicted from the previous frames.
+ *
+ * After a full image detection, the following frames are processed only inside a region of interest that bounds the
+ * markers found in the previous frame, optionally displaced by a constant velocity model. The gray conversion,
+ * threshold, contours and decoding then cost proportionally to the size of the marker in the image instead of the
+ * size of the image. The whole image is processed again every redetectInterval frames, and as soon as the markers
+ * are not found inside the ROI (in the same call, so no frame is lost).
+ *
+ * With kltPropagation, the inner corners are not searched again in every frame: the previous ones are moved with
+ * optical flow and verified against the position and class of their model point. Only the model points lost, or
+ * entering the image, go through FAST and matching, in the region where they are expected.
+ *
+ * A tracker holds the state of one video stream: use one per camera. The detector passed is copied.
+ */
+class FractalMarkerTracker{
+public:
+    inline FractalMarkerTracker(const FractalMarkerDetector &detector, const FractalTrackerParams &params=FractalTrackerParams());
+
+    inline std::vector<FractalMarker> track(const cv::Mat &img);
+    inline std::vector<FractalMarker> track(const cv::Mat &img, std::vector<cv::Point3f>& p3d, std::vector<cv::Point2f>& p2d);
+
+    //forgets the previous frames: next call processes the whole image
+    inline void reset();
+    //true if the markers were found in the last frame
+    inline bool isTracking() const { return !_corners.empty(); }
+    //region processed in the last frame
+    inline cv::Rect getLastRoi() const { return _roi; }
+    //homography from the marker coordinates to the last image. Only computed by track(img,p3d,p2d)
+    inline const cv::Mat& getHomography() const { return _H; }
+    //number of points of the last frame obtained by optical flow (the rest were matched)
+    inline int getNumPropagated() const { return _nPropagated; }
+    inline const FractalMarkerDetector& getDetector() const { return _detector; }
+private:
+    FractalMarkerDetector _detector;
+    FractalTrackerParams _params;
+    FractalDetectorWorkspace _ws;
+    std::vector<cv::Point2f> _corners;//corners of the markers found in the last frame
+    std::vector<int> _ids;//ids of the markers found in the last frame
+    cv::Point2f _center;//mean of _corners
+    cv::Point2f _velocity;//displacement of _center between the last two frames
+    int _framesSinceFull=0;
+    cv::Rect _roi;
+    cv::Mat _H,_prevH;//homography of the current and the previous frame
+
+    //incremental correspondences
+    std::vector<cv::KeyPoint> _model;//keypts of all the markers of the set, in the order used by matchKeypoints
+    cv::Mat _gray,_prevGray;
+    std::vector<cv::Point2f> _prevPts;//p2d of the last frame
+    std::vector<int> _prevIdx;//model index of each point of _prevPts
+    std::vector<float> _prevBits;//projected bit size of each point of _prevPts
+    std::vector<uchar> _prevStable;//1 for the points of _prevPts that were stable in their last refinement
+    std::vector<int> _idx;
+    int _nPropagated=0;
+
+    //region where the markers are expected in an image of size imSize. Empty if the whole image must be processed
+    inline cv::Rect predictRoi(const cv::Size &imSize) const;
+    inline std::vector<FractalMarker> detectIn(const cv::Mat &img, const cv::Rect &roi,
+                                               std::vector<cv::Point3f>* p3d, std::vector<cv::Point2f>* p2d);
+    inline std::vector<FractalMarker> process(const cv::Mat &img, std::vector<cv::Point3f>* p3d, std::vector<cv::Point2f>* p2d);
+    //computes p3d/p2d of the gray image from the points of the previous frame
+    inline void propagate(const cv::Mat &gray, const std::vector<FractalMarker> &markers,
+                          std::vector<cv::Point3f>& p3d, std::vector<cv::Point2f>& p2d);
+    inline cv::Mat markersHomography(const std::vector<FractalMarker> &markers) const;
+};
+
+FractalMarkerTracker::FractalMarkerTracker(const FractalMarkerDetector &detector, const FractalTrackerParams &params):
+    _detector(detector),_params(params){
+    //a single homography is tracked
+    if(_detector.getNumMarkerSets()>1)
+        throw std::runtime_error("FractalMarkerTracker: the detector must have a single marker set");
+    for(const auto &fm:_detector.getFractalMarkerSet().fractalMarkerCollection)
+        _model.insert(_model.end(),fm.second.keypts.begin(),fm.second.keypts.end());
+}
+
+void FractalMarkerTracker::reset(){
+    _corners.clear();
+    _ids.clear();
+    _velocity=cv::Point2f(0,0);
+    _framesSinceFull=0;
+    _roi=cv::Rect();
+    _H=cv::Mat();
+    _prevH=cv::Mat();
+    _prevPts.clear();
+    _prevIdx.clear();
+    _prevBits.clear();
+    _prevStable.clear();
+    _nPropagated=0;
+}
+
+cv::Rect FractalMarkerTracker::predictRoi(const cv::Size &imSize) const{
+    if(_corners.empty()) return cv::Rect();
+    if(_params.redetectInterval>0 && _framesSinceFull>=_params.redetectInterval) return cv::Rect();
+
+    cv::Rect2f box=cv::boundingRect(_corners);
+    if(_params.constantVelocity){
+        box.x+=_velocity.x;
+        box.y+=_velocity.y;
+    }
+    float margin=_params.roiMargin*std::max(box.width,box.height);
+    //the motion not explained by the model is larger when the markers move fast
+    if(_params.constantVelocity) margin+=0.5f*float(cv::norm(_velocity));
+    float w=std::max(float(_params.minRoiSize),box.width+2*margin);
+    float h=std::max(float(_params.minRoiSize),box.height+2*margin);
+    cv::Point2f center(box.x+box.width/2.f, box.y+box.height/2.f);
+    cv::Rect roi(cv::Point(int(center.x-w/2.f),int(center.y-h/2.f)), cv::Size(int(w+0.5f),int(h+0.5f)));
+    roi&=cv::Rect(cv::Point(0,0),imSize);
+    //not worth it if the ROI is most of the image
+    if(roi.area()==0 || roi.area()>0.8*imSize.area()) return cv::Rect();
+    return roi;
+}
+
+std::vector<FractalMarker> FractalMarkerTracker::detectIn(const cv::Mat &img, const cv::Rect &roi,
+                                                          std::vector<cv::Point3f>* p3d, std::vector<cv::Point2f>* p2d){
+    //the stages see the ROI as the whole image, except for the threshold window that depends on the full width
+    FractalDetectorWorkspace &ws=_ws;
+    ws.fullSize=img.size();
+    ws.roiOffset=roi.tl();
+    _detector.convertToGray(img(roi), ws);
+    _detector.detectQuads(ws);
+    _detector.decodeQuads(ws);
+    ws.fullSize=cv::Size();
+    _idx.clear();
+    _H=cv::Mat();
+    if(p3d){
+        p3d->clear();
+        p2d->clear();
+        if(!ws.markers.empty()){
+            _detector.detectKeypoints(ws);
+            _detector.classifyKeypoints(ws);
+            _detector.buildIndex(ws);
+            _detector.matchKeypoints(ws, *p3d, *p2d, &_idx);
+            _detector.refinePoints(ws, *p2d);
+        }
+    }
+
+    //back to image coordinates
+    std::vector<FractalMarker> markers=ws.markers;
+    cv::Point2f offset(roi.x,roi.y);
+    for(auto &m:markers)
+        for(auto &c:m) c+=offset;
+    if(p2d)
+        for(auto &p:*p2d) p+=offset;
+    ws.roiOffset=cv::Point();
+    if(p3d && !ws.H.empty()){
+        cv::Mat T=(cv::Mat_<double>(3,3)<<1,0,offset.x, 0,1,offset.y, 0,0,1);
+        //the homography of a detector with camera is undistorted: the tracker works in image coordinates
+        _H=ws.undistortedH? markersHomography(markers) : T*ws.H;
+    }
+    return markers;
+}
+
+cv::Mat FractalMarkerTracker::markersHomography(const std::vector<FractalMarker> &markers) const{
+    std::vector<cv::Point2f> imgpoints,objpoints;
+    for(const auto &marker:markers)
+        for(int c=0; c<4; c++){
+            imgpoints.push_back(marker[c]);
+            objpoints.push_back(marker.keypts[c].pt);
+        }
+    return cv::findHomography(objpoints, imgpoints);
+}
+
+void FractalMarkerTracker::propagate(const cv::Mat &gray, const std::vector<FractalMarker> &markers,
+                                     std::vector<cv::Point3f>& p3d, std::vector<cv::Point2f>& p2d){
+    p3d.clear();
+    p2d.clear();
+    _idx.clear();
+    _nPropagated=0;
+    _H=markersHomography(markers);
+    if(_H.empty()) return;
+    cv::Rect imRect(0,0,gray.cols,gray.rows);
+    std::vector<uchar> found(_model.size(),0);
+
+    ///////////////////////////////////////////////////
+    //Optical flow of the points of the previous frame
+    std::vector<cv::Point2f> next;
+    std::vector<uchar> status;
+    std::vector<float> err;
+    cv::calcOpticalFlowPyrLK(_prevGray, gray, _prevPts, next, status, err, _params.kltWinSize, _params.kltMaxLevel);
+
+    //keep those close to their model point projected and with its class
+    std::vector<cv::Point2f> modelPts,proj;
+    for(int idx:_prevIdx) modelPts.push_back(_model[idx].pt);
+    cv::perspectiveTransform(modelPts, proj, _H);
+    std::vector<cv::KeyPoint> kpts;
+    std::vector<int> cand;
+    for(size_t i=0; i<next.size(); i++){
+        if(!status[i] || !imRect.contains(next[i])) continue;
+        if(cv::norm(next[i]-proj[i]) > _params.maxModelDistance) continue;
+        kpts.push_back(cv::KeyPoint(next[i],1));
+        kpts.back().class_id=-1;
+        cand.push_back(i);
+    }
+    _private::assignClass(gray, kpts);
+    std::vector<cv::Point2f> candModel,candImg;
+    std::vector<int> candIdx,candPrev;
+    for(size_t i=0; i<kpts.size(); i++){
+        int idx=_prevIdx[cand[i]];
+        if(kpts[i].class_id!=_model[idx].class_id) continue;
+        candModel.push_back(_model[idx].pt);
+        candImg.push_back(kpts[i].pt);
+        candIdx.push_back(idx);
+        candPrev.push_back(cand[i]);
+    }
+    //outliers of the homography explaining the rest of points (points drifting along edges)
+    std::vector<uchar> inliers(candImg.size(),1);
+    if(candImg.size()>=4)
+        cv::findHomography(candModel, candImg, cv::RANSAC, _params.maxReprojError, inliers);
+    //window and refinement skip of each point
+    std::vector<float> bits;
+    std::vector<uchar> refineSkip;
+    bool prevKnown=_prevBits.size()==_prevPts.size() && _prevStable.size()==_prevPts.size();
+    for(size_t i=0; i<candImg.size(); i++){
+        if(!inliers[i] || found[candIdx[i]]) continue;
+        found[candIdx[i]]=1;
+        p3d.push_back(cv::Point3f(candModel[i].x, candModel[i].y, 0));
+        p2d.push_back(candImg[i]);
+        _idx.push_back(candIdx[i]);
+        bits.push_back(prevKnown? _prevBits[candPrev[i]] : 0.f);
+        refineSkip.push_back(prevKnown && _params.skipStablePoints && _prevStable[candPrev[i]]);
+    }
+    _nPropagated=p2d.size();
+
+    ///////////////////////////////////////////////////
+    //Model points lost in this frame, or that were out of the previous image, must be matched
+    std::vector<uchar> skip(_model.size(),1);
+    for(int idx:_prevIdx)
+        if(!found[idx]) skip[idx]=0;
+    std::vector<cv::Point2f> allModel,allProj,allPrevProj;
+    for(const auto &kpt:_model) allModel.push_back(kpt.pt);
+    cv::perspectiveTransform(allModel, allProj, _H);
+    if(!_prevH.empty()) cv::perspectiveTransform(allModel, allPrevProj, _prevH);
+    for(size_t i=0; i<_model.size(); i++)
+        if(!found[i] && imRect.contains(allProj[i]) && !allPrevProj.empty() && !imRect.contains(allPrevProj[i]))
+            skip[i]=0;
+
+    std::vector<cv::Point2f> wanted;
+    for(size_t i=0; i<_model.size(); i++)
+        if(!skip[i] && imRect.contains(allProj[i])) wanted.push_back(allProj[i]);
+    if(!wanted.empty()){
+        //FAST and matching only in the region where the points are expected
+        int border=int(_params.maxModelDistance)+8;
+        cv::Rect region=cv::boundingRect(wanted);
+        region=cv::Rect(region.x-border, region.y-border, region.width+2*border, region.height+2*border)&imRect;
+        FractalDetectorWorkspace &ws=_ws;
+        cv::Point2f offset(region.x,region.y);
+        ws.bwimage=gray(region);
+        ws.markers=markers;
+        for(auto &m:ws.markers)
+            for(auto &c:m) c-=offset;
+        cv::Mat T=(cv::Mat_<double>(3,3)<<1,0,-offset.x, 0,1,-offset.y, 0,0,1);
+        ws.H=T*_H;
+        ws.undistortedH=false;
+        _detector.detectKeypoints(ws);
+        _detector.classifyKeypoints(ws);
+        _detector.indexKeypoints(ws);
+        std::vector<cv::Point3f> newP3d;
+        std::vector<cv::Point2f> newP2d;
+        std::vector<int> newIdx;
+        _detector.matchKeypoints(ws, newP3d, newP2d, &newIdx, &skip);
+        bool newKnown=ws.pointBits.size()==newP2d.size();
+        for(size_t i=0; i<newP2d.size(); i++){
+            if(found[newIdx[i]]) continue;
+            found[newIdx[i]]=1;
+            p3d.push_back(newP3d[i]);
+            p2d.push_back(newP2d[i]+offset);
+            _idx.push_back(newIdx[i]);
+            bits.push_back(newKnown? ws.pointBits[i] : 0.f);
+            refineSkip.push_back(0);
+        }
+    }
+
+    _ws.bwimage=gray;
+    _ws.pointBits=bits;
+    _detector.refinePoints(_ws, p2d, &refineSkip);
+}
+
+std::vector<FractalMarker> FractalMarkerTracker::process(const cv::Mat &img, std::vector<cv::Point3f>* p3d, std::vector<cv::Point2f>* p2d){
+    bool incremental=p3d && _params.kltPropagation;
+    //optical flow needs the whole gray image of both frames
+    cv::Mat src=img;
+    if(incremental && img.channels()==3){
+        cv::cvtColor(img, _gray, cv::COLOR_BGR2GRAY);
+        src=_gray;
+    }
+
+    cv::Rect full(0,0,src.cols,src.rows);
+    _roi=predictRoi(src.size());
+    std::vector<FractalMarker> markers;
+    if(_roi.area()>0){
+        //the points will be propagated from the previous frame: only the markers are needed
+        bool propagating=incremental && !_prevPts.empty() && _prevGray.size()==src.size();
+        markers=detectIn(src,_roi, propagating?nullptr:p3d, propagating?nullptr:p2d);
+        if(propagating && !markers.empty()) propagate(src, markers, *p3d, *p2d);
+        _framesSinceFull++;
+    }
+    //lost inside the ROI, or time to look at the whole image
+    if(markers.empty()){
+        _roi=full;
+        markers=detectIn(src,_roi,p3d,p2d);
+        _framesSinceFull=0;
+        _nPropagated=0;
+    }
+
+    if(markers.empty()){
+        reset();
+        _roi=full;
+        return markers;
+    }
+    if(incremental){
+        //the frame converted here is kept as is, the next one is converted into the old buffer
+        if(src.data==_gray.data) std::swap(_gray,_prevGray);
+        else src.copyTo(_prevGray);//the caller may reuse its buffer
+        _prevPts=*p2d;
+        _prevIdx=_idx;
+        _prevH=_H;
+        bool aligned=_ws.pointBits.size()==p2d->size() && _ws.pointStable.size()==p2d->size();
+        _prevBits=aligned? _ws.pointBits : std::vector<float>(p2d->size(), 0.f);
+        _prevStable=aligned? _ws.pointStable : std::vector<uchar>(p2d->size(), 0);
+    }
+
+    std::vector<int> ids;
+    _corners.clear();
+    for(const auto &m:markers){
+        ids.push_back(m.id);
+        _corners.insert(_corners.end(),m.begin(),m.end());
+    }
+    cv::Point2f center(0,0);
+    for(const auto &c:_corners) center+=c;
+    center*=1./double(_corners.size());
+    //the velocity is only meaningful if the same markers were found in the previous frame
+    _velocity=ids==_ids ? center-_center : cv::Point2f(0,0);
+    _center=center;
+    _ids.swap(ids);
+    return markers;
+}
+
+std::vector<FractalMarker> FractalMarkerTracker::track(const cv::Mat &img){
+    return process(img,nullptr,nullptr);
+}
+
+std::vector<FractalMarker> FractalMarkerTracker::track(const cv::Mat &img, std::vector<cv::Point3f>& p3d, std::vector<cv::Point2f>& p2d){
+    return process(img,&p3d,&p2d);
+}
 }
 #endif
 
@@ -69,6 +69,8 @@
 #include <algorithm>
 #include <cstring>
 #include <fstream>
+#include <chrono>
+#include <functional>
 /**
  * The FractalMarkerDetector class detects fractal markers in the images passed
  *
@@ -77,9 +79,17 @@ namespace opencvfractal{
   public:
     //@param fractal_config possible values (FRACTAL_2L_6,FRACTAL_3L_6,FRACTAL_4L_6,FRACTAL_5L_6)
     void setParams(std::string config, float markerSize=-1);
-    inline std::vector<FractalMarker> detect(const cv::Mat &img);
+    inline std::vector<FractalMarker> detect(const cv::Mat &img) const;
     inline std::vector<FractalMarker> detect(const cv::Mat &img, std::vector<cv::Point3f>& p3d,
-                                             std::vector<cv::Point2f>& p2d);
+                                             std::vector<cv::Point2f>& p2d) const;
+    //reentrant versions: pass one workspace per thread to share the detector between threads
+    inline std::vector<FractalMarker> detect(const cv::Mat &img, FractalDetectorWorkspace &ws) const;
+    inline std::vector<FractalMarker> detect(const cv::Mat &img, std::vector<cv::Point3f>& p3d,
+                                             std::vector<cv::Point2f>& p2d, FractalDetectorWorkspace &ws) const;
+    //search radius of the projected model points: a fraction of their projected bit size (see MatchParams)
+    void setMatchParams(const MatchParams &params);
+    //function receiving the DetectionStats of every detect() call (see also FractalDetectorWorkspace::collectStats)
+    void setStatsCallback(std::function<void(const DetectionStats&)> callback);
   };
 }
 */
@@ -96,10 +106,10 @@ public:
     FractalMarker(int id, cv::Mat m, std::vector<cv::Point3f> corners, std::vector<int> id_submarkers);
     FractalMarker(){};
 
-    inline int nBits() { return _M.total(); }
-    inline cv::Mat mat(){ return _M; }
-    inline cv::Mat mask(){ return _mask; }
-    inline std::vector<int> subMarkers(){ return _submarkers; }
+    inline int nBits() const { return _M.total(); }
+    inline cv::Mat mat() const { return _M; }
+    inline cv::Mat mask() const { return _mask; }
+    inline const std::vector<int>& subMarkers() const { return _submarkers; }
     void addSubFractalMarker(FractalMarker submarker);
     // returns the distance of the marker side
     inline float getMarkerSize() const
@@ -221,10 +231,11 @@ void FractalMarkerSet::convertToMeters(float size)
     mInfoType = 1;
 
     // now, get the size of a pixel, and change scale
-    float pixSizeM = size / float(fractalMarkerCollection[idExternal].getMarkerSize());
+    float pixSizeM = size / float(fractalMarkerCollection.at(idExternal).getMarkerSize());
 
-    for (size_t i=0; i < fractalMarkerCollection.size(); i++)
-        for(auto &kpt:fractalMarkerCollection[i].keypts)
+    //markers ids are not necessarily consecutive, so iterate over the map itself
+    for (auto &id_marker:fractalMarkerCollection)
+        for(auto &kpt:id_marker.second.keypts)
             kpt.pt *= pixSizeM;
 }
 
@@ -500,7 +511,7 @@ FractalMarkerSet::FractalMarkerSet(std::string str)
     {
         FractalMarker &marker = id_marker.second;
         for(auto id:id_marker.second.subMarkers())
-            marker.addSubFractalMarker(fractalMarkerCollection[id]);
+            marker.addSubFractalMarker(fractalMarkerCollection.at(id));
 
         //Init marker kpts
         marker.getKeypts();
@@ -510,26 +521,329 @@ FractalMarkerSet::FractalMarkerSet(std::string str)
 }
 
 
+/**
+ * @brief Time spent in each stage of one detect() call and size of the intermediate results.
+ *
+ * Collected only if the workspace has collectStats set or the detector has a stats callback. Define
+ * OPENCVFRACTAL_NO_STATS before including this file to remove the collection code altogether.
+ */
+struct DetectionStats{
+    enum Stage{GRAY=0,THRESHOLD,CONTOURS,DECODE,FAST,FILTER,CLASSIFY,INDEX_BUILD,HOMOGRAPHY,MATCH,SUBPIX,NSTAGES};
+    double stageMs[NSTAGES]={};//milliseconds spent in each stage. Zero for the stages not run
+    double totalMs=0;
+    int contours=0;//contours found in the thresholded image
+    int quads=0;//contours approximated by a convex quadrilateral
+    int candidates=0;//quads decoded as markers, without duplicates
+    //reasons why contours and quads were discarded
+    int rejectedSmall=0;//contour too short to be a marker
+    int rejectedNotQuad=0;//contour not approximated by a convex quadrilateral
+    int rejectedBorder=0;//quad without a black border for any of the bit sizes of the set
+    int rejectedCode=0;//quad with a black border but a code not in the set
+    int rejectedDuplicate=0;//marker found more than once (the largest one is kept)
+    int keypoints=0;//FAST keypoints
+    int keypointsFiltered=0;//keypoints left by kfilter
+    int queries=0;//model points searched in the flann index
+    int matches=0;//3d-2d correspondences found
+
+    static inline const char* stageName(int stage){
+        static const char* names[NSTAGES]={"gray","threshold","contours","decode","fast","filter","classify",
+                                           "index_build","homography","match","subpix"};
+        return names[stage];
+    }
+};
+
+namespace _private{
+//Adds the time elapsed in a scope to one of the stages of the stats. Does nothing if stats is null
+class StageTimer{
+public:
+#ifndef OPENCVFRACTAL_NO_STATS
+    StageTimer(DetectionStats *stats, int stage):_stats(stats),_stage(stage){
+        if(_stats) _start=std::chrono::high_resolution_clock::now();
+    }
+    ~StageTimer(){ stop(); }
+    //stops measuring the current stage and starts with the stage passed
+    inline void next(int stage){
+        stop();
+        _stage=stage;
+        if(_stats) _start=std::chrono::high_resolution_clock::now();
+    }
+    inline void stop(){
+        if(!_stats || _stage<0) return;
+        _stats->stageMs[_stage]+=std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now()-_start).count();
+        _stage=-1;
+    }
+private:
+    DetectionStats *_stats;
+    int _stage;
+    std::chrono::high_resolution_clock::time_point _start;
+#else
+    StageTimer(DetectionStats *, int){}
+    inline void next(int){}
+    inline void stop(){}
+#endif
+};
+
+//Smallest scale factor of the homography H (CV_64F) around the model point p: the smallest singular value of its
+//Jacobian there. A model length l becomes at least l*scale pixels in any direction
+inline float homographyMinScale(const cv::Mat &H, const cv::Point2f &p){
+    const double *h=H.ptr<double>(0);
+    double w=h[6]*p.x+h[7]*p.y+h[8];
+    if(std::abs(w)<1e-12) return 0.f;
+    double u=(h[0]*p.x+h[1]*p.y+h[2])/w, v=(h[3]*p.x+h[4]*p.y+h[5])/w;
+    double a=(h[0]-u*h[6])/w, b=(h[1]-u*h[7])/w, c=(h[3]-v*h[6])/w, d=(h[4]-v*h[7])/w;
+    //eigenvalues of J^T J: (t -+ sqrt(t^2-4det^2))/2
+    double t=a*a+b*b+c*c+d*d, det=a*d-b*c;
+    double minEig=0.5*(t-std::sqrt(std::max(0.,t*t-4*det*det)));
+    return float(std::sqrt(std::max(0.,minEig)));
+}
+
+//Model point projected in the image, to be searched among the keypoints
+struct ModelQuery{
+    cv::Point2f pt;//projected point, or the corner itself if direct
+    cv::Point3f obj;
+    float radius=0;//search radius, in pixels
+    int classId=-1;
+    bool direct=false;//corner of a detected marker taken as it is, without search
+};
+
+//Keypoint of the class of a model point, within its search radius
+struct MatchCandidate{
+    int query;
+    int keypoint;
+    float dist2;//squared distance, in pixels
+};
+
+//Minimum cost assignment of a dense rows x cols cost matrix (row major), rows<=cols (Hungarian algorithm with
+//potentials, O(rows^2 cols)). Returns the column assigned to each row
+inline std::vector<int> hungarian(const std::vector<double> &cost, int rows, int cols){
+    const double inf=std::numeric_limits<double>::max();
+    std::vector<double> u(rows+1,0), v(cols+1,0), minv(cols+1);
+    std::vector<int> p(cols+1,0), way(cols+1,0);//p[j]: row (1 based) assigned to column j
+    std::vector<uchar> used(cols+1);
+    for(int i=1; i<=rows; i++){
+        p[0]=i;
+        int j0=0;
+        std::fill(minv.begin(), minv.end(), inf);
+        std::fill(used.begin(), used.end(), 0);
+        do{
+            used[j0]=1;
+            int i0=p[j0], j1=0;
+            double delta=inf;
+            for(int j=1; j<=cols; j++){
+                if(used[j]) continue;
+                double cur=cost[(i0-1)*cols+j-1]-u[i0]-v[j];
+                if(cur<minv[j]){ minv[j]=cur; way[j]=j0; }
+                if(minv[j]<delta){ delta=minv[j]; j1=j; }
+            }
+            for(int j=0; j<=cols; j++){
+                if(used[j]){ u[p[j]]+=delta; v[j]-=delta; }
+                else minv[j]-=delta;
+            }
+            j0=j1;
+        }while(p[j0]!=0);
+        do{ int j1=way[j0]; p[j0]=p[j1]; j0=j1; }while(j0);
+    }
+    std::vector<int> rowMatch(rows,-1);
+    for(int j=1; j<=cols; j++)
+        if(p[j]) rowMatch[p[j]-1]=j-1;
+    return rowMatch;
+}
+
+//Resolves the candidates into one-to-one correspondences: match[q] receives the keypoint of query q, or -1. Greedy:
+//by increasing distance. Optimal: the assignment of maximum size and then minimum total distance, in each connected
+//component of the candidates with at most maxComponent queries and keypoints (greedy in the larger ones).
+//Sorts the candidates. owner is a buffer of one element per keypoint, so no conflict is searched linearly
+inline void assignCandidates(std::vector<MatchCandidate> &cands, int nQueries, int nKeypoints, bool optimal,
+                             int maxComponent, std::vector<int> &match, std::vector<int> &owner){
+    match.assign(nQueries,-1);
+    owner.assign(nKeypoints,-1);
+    auto closer=[](const MatchCandidate &a, const MatchCandidate &b){
+        if(a.dist2!=b.dist2) return a.dist2<b.dist2;
+        return a.query!=b.query ? a.query<b.query : a.keypoint<b.keypoint;
+    };
+    auto greedy=[&](size_t first, size_t last){
+        for(size_t i=first; i<last; i++){
+            const MatchCandidate &c=cands[i];
+            if(match[c.query]>=0 || owner[c.keypoint]>=0) continue;
+            match[c.query]=c.keypoint;
+            owner[c.keypoint]=c.query;
+        }
+    };
+    if(!optimal){
+        std::sort(cands.begin(), cands.end(), closer);
+        greedy(0, cands.size());
+        return;
+    }
+
+    //connected components: union-find of the queries (0..nQueries-1) and keypoints (nQueries..)
+    std::vector<int> parent(nQueries+nKeypoints);
+    for(size_t i=0; i<parent.size(); i++) parent[i]=i;
+    auto root=[&](int a){
+        while(parent[a]!=a) a=parent[a]=parent[parent[a]];
+        return a;
+    };
+    for(const auto &c:cands){
+        int a=root(c.query), b=root(nQueries+c.keypoint);
+        if(a!=b) parent[std::max(a,b)]=std::min(a,b);
+    }
+    std::vector<int> component(cands.size());
+    for(size_t i=0; i<cands.size(); i++) component[i]=root(cands[i].query);
+    std::vector<int> order(cands.size());
+    for(size_t i=0; i<order.size(); i++) order[i]=i;
+    std::sort(order.begin(), order.end(), [&](int a, int b){
+        if(component[a]!=component[b]) return component[a]<component[b];
+        return closer(cands[a], cands[b]);
+    });
+    std::vector<MatchCandidate> sorted(cands.size());
+    for(size_t i=0; i<order.size(); i++) sorted[i]=cands[order[i]];
+    cands.swap(sorted);
+    for(size_t i=0; i<order.size(); i++) order[i]=component[order[i]];
+
+    //local index of the queries and keypoints of a component, -1 outside it
+    std::vector<int> local(nQueries+nKeypoints,-1);
+    std::vector<int> rows, cols;
+    for(size_t first=0, last; first<cands.size(); first=last){
+        for(last=first+1; last<cands.size() && order[last]==order[first]; last++);
+        rows.clear();
+        cols.clear();
+        for(size_t i=first; i<last; i++){
+            int q=cands[i].query, k=nQueries+cands[i].keypoint;
+            if(local[q]<0){ local[q]=rows.size(); rows.push_back(q); }
+            if(local[k]<0){ local[k]=cols.size(); cols.push_back(k); }
+        }
+        if(last-first>1 && int(rows.size())<=maxComponent && int(cols.size())<=maxComponent){
+            //the missing edges cost more than any set of real ones, so the largest assignment is preferred
+            const double missing=1e12;
+            bool transposed=rows.size()>cols.size();
+            int nr=transposed? cols.size() : rows.size(), nc=transposed? rows.size() : cols.size();
+            std::vector<double> cost(nr*nc, missing);
+            for(size_t i=first; i<last; i++){
+                int r=local[cands[i].query], c=local[nQueries+cands[i].keypoint];
+                if(transposed) std::swap(r,c);
+                cost[r*nc+c]=cands[i].dist2;
+            }
+            std::vector<int> rowMatch=hungarian(cost, nr, nc);
+            for(int r=0; r<nr; r++){
+                int c=rowMatch[r];
+                if(c<0 || cost[r*nc+c]>=missing) continue;
+                int q=transposed? rows[c] : rows[r], k=(transposed? cols[r] : cols[c])-nQueries;
+                match[q]=k;
+                owner[k]=q;
+            }
+        }
+        else greedy(first, last);
+        for(int q:rows) local[q]=-1;
+        for(int k:cols) local[k]=-1;
+    }
+}
+}
+
+/**
+ * @brief How the conflicts between model points wanting the same keypoint (or the reverse) are resolved
+ */
+enum AssignMethod{
+    ASSIGN_GREEDY,//by increasing distance
+    ASSIGN_OPTIMAL//minimum total distance (Hungarian) in the small groups of conflicting candidates, greedy in the others
+};
+
+/**
+ * @brief How the model points projected with the homography are searched among the keypoints.
+ *
+ * The radius of each point is a fraction of the size of a bit of its marker as projected there by the homography,
+ * so it follows the resolution, distance and tilt of the board instead of being a fixed number of pixels.
+ */
+struct MatchParams{
+    float bitFraction=0.4f;//radius / projected bit size. <=0: fixedRadius for all the points
+    float minRadius=2.f;//bounds of the radius, in pixels
+    float maxRadius=40.f;
+    float fixedRadius=17.89f;//sqrt(320), the former squared distance limit
+    int maxCandidates=4;//nearest keypoints considered per model point
+    //one knnSearch for all the model points, with the buffers of the workspace. If false, one radiusSearch per point
+    bool batchedSearch=true;
+    int searchChecks=32;//leaves visited by each batched search. -1: exact search
+    AssignMethod assignment=ASSIGN_GREEDY;//each keypoint is assigned to one model point at most, and vice versa
+    int maxComponentSize=8;//ASSIGN_OPTIMAL: largest number of model points or keypoints solved optimally together
+    //only the nearest keypoint of each model point is a candidate, rejected if it is of another class or at distance
+    //0. If false, the maxCandidates nearest keypoints of its class within the radius are
+    bool strictCandidates=true;
+};
+
+/**
+ * @brief Scratch buffers used by one detection call.
+ *
+ * detect() never writes into the detector itself, so a single configured FractalMarkerDetector can be shared by
+ * several threads as long as each thread passes its own workspace (or uses the overloads without it, which create
+ * a temporary one per call).
+ */
+struct FractalDetectorWorkspace{
+    cv::Mat gray;//grey conversion of color inputs. Never aliases the input image
+    cv::Mat thresImage;
+    std::vector<std::vector<cv::Point>> contours;
+    std::vector<cv::Point> approxCurve;
+    std::vector<std::pair<int, std::vector<cv::Point2f>>> candidates;
+    std::vector<cv::KeyPoint> kpoints;
+    cv::Mat kpointsMat, queryMat, indicesMat, distsMat;//FLANN input and output, reused across frames
+    bool collectStats=false;//if true, detect() fills stats
+    DetectionStats stats;//stats of the last call
+};
+
 /**
  * @brief The MarkerDetector class is detecting the markers in the image passed
  *
+ * Once setParams() has been called, the detector is immutable: all the detect() methods are const and reentrant.
+ * setParams() must not be called while another thread is detecting.
  */
 class FractalMarkerDetector{
 public:
     /**@param fractal_config possible values (FRACTAL_2L_6,FRACTAL_3L_6,FRACTAL_4L_6,FRACTAL_5L_6)
      */
     void setParams(std::string fractal_config, float markerSize=-1);
-    inline std::vector<FractalMarker> detect(const cv::Mat &img);
+    inline std::vector<FractalMarker> detect(const cv::Mat &img) const;
+    inline std::vector<FractalMarker> detect(const cv::Mat &img, std::vector<cv::Point3f>& p3d,
+                                             std::vector<cv::Point2f>& p2d) const;
+    //same as above, but using the buffers of the workspace passed (one per thread)
+    inline std::vector<FractalMarker> detect(const cv::Mat &img, FractalDetectorWorkspace &ws) const;
     inline std::vector<FractalMarker> detect(const cv::Mat &img, std::vector<cv::Point3f>& p3d,
-                                             std::vector<cv::Point2f>& p2d);
+                                             std::vector<cv::Point2f>& p2d, FractalDetectorWorkspace &ws) const;
+
+    /**Sets a function called at the end of every detect() with its DetectionStats. It runs in the thread calling
+     * detect(), so it must be thread safe if the detector is shared. Pass nullptr to remove it.
+     */
+    inline void setStatsCallback(std::function<void(const DetectionStats&)> callback){ statsCallback=callback; }
+
+    //search radius of the model points among the keypoints (see MatchParams)
+    inline void setMatchParams(const MatchParams &params);
+    inline const MatchParams& getMatchParams() const { return matchParams; }
+
+    inline const FractalMarkerSet& getFractalMarkerSet() const { return fractalMarkerSet; }
 private:
     FractalMarkerSet fractalMarkerSet;
+    std::function<void(const DetectionStats&)> statsCallback;
+    MatchParams matchParams;
+
+    //stats of the workspace if they must be collected, nullptr otherwise
+    inline DetectionStats* statsOf(FractalDetectorWorkspace &ws) const{
+#ifdef OPENCVFRACTAL_NO_STATS
+        return nullptr;
+#else
+        return ws.collectStats || statsCallback ? &ws.stats : nullptr;
+#endif
+    }
+    inline void finishStats(DetectionStats *stats, std::chrono::high_resolution_clock::time_point start) const;
+    //threshold, contours and decoding of a grey image
+    inline std::vector<FractalMarker> detectMarkers(const cv::Mat &bwimage, FractalDetectorWorkspace &ws, DetectionStats *stats) const;
     static inline  std::vector<cv::Point2f> sort( const  std::vector<cv::Point2f> &marker);
     static inline  float  getSubpixelValue(const cv::Mat &im_grey,const cv::Point2f &p);
+    //returns the id of the marker, -1 if the code is not in the set or -2 if the border of the bits is not black
     static inline  int    getMarkerId(const cv::Mat &bits,int &nrotations, const std::vector<int>& markersId, const FractalMarkerSet& markerSet);
     static inline  int    perimeter(const std::vector<cv::Point2f>& a);
-    inline void kfilter(std::vector<cv::KeyPoint>& kpoints);
-    inline void assignClass(const cv::Mat& im, std::vector<cv::KeyPoint>& kpoints, float sizeNorm = 0.f, int wsize = 5);
+    static inline void kfilter(std::vector<cv::KeyPoint>& kpoints);
+    static inline void assignClass(const cv::Mat& im, std::vector<cv::KeyPoint>& kpoints, float sizeNorm = 0.f, int wsize = 5);
+    //first rows of a buffer, reallocated only if it has fewer rows or another layout
+    static inline cv::Mat bufferRows(cv::Mat &buffer, int rows, int cols, int type){
+        if(buffer.rows<rows || buffer.cols!=cols || buffer.type()!=type) buffer.create(rows, cols, type);
+        return buffer.rowRange(0, rows);
+    }
 };
 
 
@@ -540,55 +854,75 @@ void FractalMarkerDetector::setParams(std::string config, float markerSize)
 
 }
 
+void FractalMarkerDetector::setMatchParams(const MatchParams &params)
+{
+    if(params.minRadius<=0 || params.maxRadius<params.minRadius)
+        throw std::runtime_error("FractalMarkerDetector::setMatchParams: invalid radius bounds");
+    if(params.bitFraction<=0 && params.fixedRadius<=0)
+        throw std::runtime_error("FractalMarkerDetector::setMatchParams: invalid fixed radius");
+    if(params.maxCandidates<1 || params.maxComponentSize<1 || params.searchChecks==0 || params.searchChecks<-1)
+        throw std::runtime_error("FractalMarkerDetector::setMatchParams: invalid candidate, component or check count");
+    matchParams=params;
+}
+
 std::vector<FractalMarker> FractalMarkerDetector::detect(const cv::Mat &img, std::vector<cv::Point3f>& p3d,
-                                                  std::vector<cv::Point2f>& p2d)
+                                                  std::vector<cv::Point2f>& p2d) const
 {
-    using namespace std::chrono;
-    auto t0 = high_resolution_clock::now();
+    FractalDetectorWorkspace ws;
+    return detect(img, p3d, p2d, ws);
+}
+
+std::vector<FractalMarker> FractalMarkerDetector::detect(const cv::Mat &img, std::vector<cv::Point3f>& p3d,
+                                                  std::vector<cv::Point2f>& p2d, FractalDetectorWorkspace &ws) const
+{
+    DetectionStats *stats=statsOf(ws);
+    std::chrono::high_resolution_clock::time_point start;
+    if(stats){
+        start=std::chrono::high_resolution_clock::now();
+        *stats=DetectionStats();
+    }
+    _private::StageTimer timer(stats, DetectionStats::GRAY);
 
     // Convert to grayscale if needed
     cv::Mat bwimage;
-    if(img.channels()==3)
-        cv::cvtColor(img, bwimage, cv::COLOR_BGR2GRAY);
+    if(img.channels()==3) {
+        cv::cvtColor(img, ws.gray, cv::COLOR_BGR2GRAY);
+        bwimage = ws.gray;
+    }
     else 
         bwimage = img;
-    auto t1 = high_resolution_clock::now();
-    // std::cout << "[opencvfractal] Convert to gray: " << duration<double, std::milli>(t1-t0).count() << " ms" << std::endl;
+    timer.stop();
 
     // Fractal marker detection
-    auto t2 = high_resolution_clock::now();
-    std::vector<FractalMarker> detected = detect(bwimage);
-    auto t3 = high_resolution_clock::now();
-    // std::cout << "[opencvfractal] Marker detection: " << duration<double, std::milli>(t3-t2).count() << " ms" << std::endl;
+    std::vector<FractalMarker> detected = detectMarkers(bwimage, ws, stats);
 
     if(detected.size() > 0) {
         // Prepare points for homography
-        auto t4 = high_resolution_clock::now();
+        timer.next(DetectionStats::HOMOGRAPHY);
         std::vector<cv::Point2f> imgpoints;
         std::vector<cv::Point3f> objpoints;
-        for(auto marker : detected) {
+        for(const auto &marker : detected) {
             for(auto p : marker)
                 imgpoints.push_back(p);
 
             for(int c = 0; c < 4; c++) {
-                cv::KeyPoint kpt = fractalMarkerSet.fractalMarkerCollection[marker.id].getKeypts()[c];
+                const cv::KeyPoint &kpt = fractalMarkerSet.fractalMarkerCollection.at(marker.id).keypts[c];
                 objpoints.push_back(cv::Point3f(kpt.pt.x, kpt.pt.y, 0));
             }
         }
-        auto t5 = high_resolution_clock::now();
-        // std::cout << "[opencvfractal] Homography prep: " << duration<double, std::milli>(t5-t4).count() << " ms" << std::endl;
 
         // FAST feature detection
-        auto t6 = high_resolution_clock::now();
-        std::vector<cv::KeyPoint> kpoints;
+        timer.next(DetectionStats::FAST);
+        std::vector<cv::KeyPoint> &kpoints = ws.kpoints;
         cv::Ptr<cv::FastFeatureDetector> fd = cv::FastFeatureDetector::create();
         fd->detect(bwimage, kpoints);
-        auto t7 = high_resolution_clock::now();
-        // std::cout << "[opencvfractal] FAST features: " << duration<double, std::milli>(t7-t6).count() << " ms" << std::endl;
+        if(stats) stats->keypoints=kpoints.size();
         
         // Filter keypoints
-        auto t8 = high_resolution_clock::now();
+        timer.next(DetectionStats::FILTER);
         kfilter(kpoints);
+        if(stats) stats->keypointsFiltered=kpoints.size();
+        timer.next(DetectionStats::CLASSIFY);
         assignClass(bwimage, kpoints);
 
         //// draw keypoints
@@ -613,38 +947,35 @@ std::vector<FractalMarker> FractalMarkerDetector::detect(const cv::Mat &img, std
         // }
         // cv::imwrite("data/keypoints_by_class.png", visImg);
 
-        auto t9 = high_resolution_clock::now();
-        // std::cout << "[opencvfractal] Keypoint filtering & classification: " << duration<double, std::milli>(t9-t8).count() << " ms" << std::endl;
-
         // Build FLANN index
-        auto t10 = high_resolution_clock::now();
-        cv::Mat kpointsMat(kpoints.size(), 2, CV_32F);
+        timer.next(DetectionStats::INDEX_BUILD);
+        // FLANN only takes continuous arrays, so the points can not be read in place from the keypoints
+        cv::Mat kpointsMat = bufferRows(ws.kpointsMat, kpoints.size(), 2, CV_32F);
         for (size_t i = 0; i < kpoints.size(); ++i)
         {
-            kpointsMat.at<float>(i, 0) = kpoints[i].pt.x;
-            kpointsMat.at<float>(i, 1) = kpoints[i].pt.y;
+            float *row = kpointsMat.ptr<float>(i);
+            row[0] = kpoints[i].pt.x;
+            row[1] = kpoints[i].pt.y;
         }
 
         cv::flann::Index Kdtree;
         Kdtree.build(kpointsMat, cv::flann::KDTreeIndexParams(1), cvflann::FLANN_DIST_EUCLIDEAN);
-        auto t11 = high_resolution_clock::now();
-        // std::cout << "[opencvfractal] KD-tree build: " << duration<double, std::milli>(t11-t10).count() << " ms" << std::endl;
 
         // Compute homography
-        auto t12 = high_resolution_clock::now();
+        timer.next(DetectionStats::HOMOGRAPHY);
         cv::Mat H = cv::findHomography(objpoints, imgpoints);
-        auto t13 = high_resolution_clock::now();
-        // std::cout << "[opencvfractal] Homography calc: " << duration<double, std::milli>(t13-t12).count() << " ms" << std::endl;
 
         // Process each marker
-        auto t14 = high_resolution_clock::now();
+        timer.next(DetectionStats::MATCH);
         
-        std::vector<int> nearestIdxList;
-        std::vector<float> distsList;
-        for (auto &fm : fractalMarkerSet.fractalMarkerCollection) {
+        // Model points to search, and corners taken as they are, in the order of the output
+        std::vector<_private::ModelQuery> queries;
+        for (const auto &fm : fractalMarkerSet.fractalMarkerCollection) {
             std::vector<cv::Point2f> imgPoints;
             std::vector<cv::Point2f> objPoints;
-            std::vector<cv::KeyPoint> objKeyPoints = fm.second.getKeypts();
+            const std::vector<cv::KeyPoint> &objKeyPoints = fm.second.keypts;
+            // Size of a bit of the marker in model units. Its keypoints are corners of its bits.
+            float bitSize = fm.second.getMarkerSize() / (std::sqrt(float(fm.second.nBits())) + 2.f);
         
             for (auto kpt : objKeyPoints)
                 objPoints.push_back(cv::Point2f(kpt.pt.x, kpt.pt.y));
@@ -660,99 +991,163 @@ std::vector<FractalMarker> FractalMarkerDetector::detect(const cv::Mat &img, std
         
             if (consider) {
                 for (size_t idx = 0; idx < imgPoints.size(); idx++) {
-                    // std::cout << objKeyPoints[idx].class_id << std::endl;
                     if (imgPoints[idx].x > 0 && imgPoints[idx].x < img.cols &&
                         imgPoints[idx].y > 0 && imgPoints[idx].y < img.rows) {
-                        std::vector<float> query = {imgPoints[idx].x, imgPoints[idx].y};
-                        std::vector<int> indices;
-                        std::vector<float> dists;
-                        
-                        Kdtree.radiusSearch(query, indices, dists, 400.0, 1, cv::flann::SearchParams());
-                        
-                        int nearestIdx = indices[0];
-
-                        float newDist = cv::norm(cv::Point2f(kpoints[nearestIdx].pt) - cv::Point2f(imgPoints[idx]));
-                        
-                        // This is my next step, adjusting the distance threshold
-                        // -to reach a good performance on different images
-                        if (kpoints[nearestIdx].class_id != objKeyPoints[idx].class_id||dists[0] > 320||dists[0] == 0) {
-                            continue;
-                        }
-                        // std::cout<< dists[0]<< std::endl;
-                        if (nearestIdx != -1) {
-                            bool duplicateFound = false;
-                            for (size_t i = 0; i < nearestIdxList.size(); ++i) {
-                                if (nearestIdxList[i] == nearestIdx) {
-                                    duplicateFound = true;
-                                    float existingDist = distsList[i];
-                                    // std::cout << "New distance: " << newDist << ", Existing distance: " << existingDist << std::endl;
-                                    if (newDist < existingDist) {
-                                        p2d[i] = kpoints[nearestIdx].pt;
-                                        p3d[i] = cv::Point3f(objPoints[idx].x, objPoints[idx].y, 0);
-                                        distsList[i] = newDist; // update distsList
-                                    }
-                                    break;
-                                }
-                            }
-                        
-                            if (!duplicateFound) {
-                                nearestIdxList.push_back(nearestIdx);
-                                distsList.push_back(newDist);              
-
-                                p2d.push_back(kpoints[nearestIdx].pt);
-                                p3d.push_back(cv::Point3f(objPoints[idx].x, objPoints[idx].y, 0));
-                            }
-                        }
+                        _private::ModelQuery q;
+                        q.pt = imgPoints[idx];
+                        q.obj = cv::Point3f(objPoints[idx].x, objPoints[idx].y, 0);
+                        // Radius from the projected size of a bit at this point, bounded
+                        q.radius = matchParams.fixedRadius;
+                        if (matchParams.bitFraction > 0)
+                            q.radius = std::min(matchParams.maxRadius, std::max(matchParams.minRadius,
+                                       matchParams.bitFraction * bitSize * _private::homographyMinScale(H, objPoints[idx])));
+                        q.classId = objKeyPoints[idx].class_id;
+                        queries.push_back(q);
                     }
                 }
             } else {
                 // If a marker is detected and it is not possible to take all their corners,
                 // at least take the external one!
-                for (auto markerDetected : detected) {
+                for (const auto &markerDetected : detected) {
                     if (markerDetected.id == fm.first) {
                         for (int c = 0; c < 4; c++) {
                             cv::Point2f pt = markerDetected.keypts[c].pt;
-                            p3d.push_back(cv::Point3f(pt.x, pt.y, 0));
-                            p2d.push_back(markerDetected[c]);
+                            _private::ModelQuery q;
+                            q.pt = markerDetected[c];
+                            q.obj = cv::Point3f(pt.x, pt.y, 0);
+                            q.direct = true;
+                            queries.push_back(q);
                         }
                         break;
                     }
                 }
             }
         }
-        auto t15 = high_resolution_clock::now();
-        // std::cout << "[opencvfractal] Keypoints matching: " << duration<double, std::milli>(t15-t14+t11-t10).count() << " ms" << std::endl;
+
+        // Nearest keypoints of the class of each model point within its radius (sorted by distance)
+        std::vector<_private::MatchCandidate> cands;
+        if (matchParams.batchedSearch) {
+            // k nearest keypoints of all the model points in one call, then limited to the radius of each one
+            std::vector<int> searched;
+            for (size_t qi = 0; qi < queries.size(); qi++)
+                if (!queries[qi].direct) searched.push_back(qi);
+            int k = std::min<int>(matchParams.maxCandidates, kpoints.size());
+            if (!searched.empty() && k > 0) {
+                int n = searched.size();
+                cv::Mat queryMat = bufferRows(ws.queryMat, n, 2, CV_32F);
+                for (int r = 0; r < n; r++) {
+                    float *row = queryMat.ptr<float>(r);
+                    row[0] = queries[searched[r]].pt.x;
+                    row[1] = queries[searched[r]].pt.y;
+                }
+                cv::Mat indices = bufferRows(ws.indicesMat, n, k, CV_32S);
+                cv::Mat dists = bufferRows(ws.distsMat, n, k, CV_32F);
+                Kdtree.knnSearch(queryMat, indices, dists, k, cv::flann::SearchParams(matchParams.searchChecks, 0, matchParams.strictCandidates));
+                if(stats) stats->queries += n;
+                for (int r = 0; r < n; r++) {
+                    const _private::ModelQuery &q = queries[searched[r]];
+                    const int *idx = indices.ptr<int>(r);
+                    const float *d = dists.ptr<float>(r);
+                    for (int i = 0; i < k; i++) {
+                        if (matchParams.strictCandidates && (i > 0 || d[i] == 0)) break;
+                        if (idx[i] >= 0 && d[i] < q.radius * q.radius && kpoints[idx[i]].class_id == q.classId)
+                            cands.push_back({searched[r], idx[i], d[i]});
+                    }
+                }
+            }
+        }
+        else {
+            std::vector<float> query(2);
+            std::vector<int> indices;
+            std::vector<float> dists;
+            for (size_t qi = 0; qi < queries.size(); qi++) {
+                const _private::ModelQuery &q = queries[qi];
+                if (q.direct) continue;
+                query[0] = q.pt.x;
+                query[1] = q.pt.y;
+                int found = Kdtree.radiusSearch(query, indices, dists, q.radius * q.radius, matchParams.maxCandidates,
+                                                cv::flann::SearchParams());
+                if(stats) stats->queries++;
+                for (int i = 0; i < std::min(found, matchParams.maxCandidates); i++) {
+                    if (matchParams.strictCandidates && (i > 0 || dists[i] == 0)) break;
+                    if (kpoints[indices[i]].class_id == q.classId)
+                        cands.push_back({int(qi), indices[i], dists[i]});
+                }
+            }
+        }
+
+        // One keypoint per model point and vice versa, resolved at once
+        std::vector<int> queryMatch, keypointOwner;
+        _private::assignCandidates(cands, queries.size(), kpoints.size(), matchParams.assignment == ASSIGN_OPTIMAL,
+                                   matchParams.maxComponentSize, queryMatch, keypointOwner);
+        for (size_t qi = 0; qi < queries.size(); qi++) {
+            if (queries[qi].direct)
+                p2d.push_back(queries[qi].pt);
+            else if (queryMatch[qi] >= 0)
+                p2d.push_back(kpoints[queryMatch[qi]].pt);
+            else
+                continue;
+            p3d.push_back(queries[qi].obj);
+        }
+        if(stats) stats->matches=p2d.size();
         // Subpixel refinement
-        auto t16 = high_resolution_clock::now();
+        timer.next(DetectionStats::SUBPIX);
         if(p2d.size() > 0) {
             cv::Size winSize(4, 4);
             cv::Size zeroZone(-1, -1);
             cv::TermCriteria criteria(cv::TermCriteria::MAX_ITER | cv::TermCriteria::EPS, 12, 0.005);
             cornerSubPix(bwimage, p2d, winSize, zeroZone, criteria);
         }
-        auto t17 = high_resolution_clock::now();
-        // std::cout << "[opencvfractal] Subpixel refinement: " << duration<double, std::milli>(t17-t16).count() << " ms" << std::endl;
     }
+    timer.stop();
 
-    auto tEnd = high_resolution_clock::now();
-    // std::cout << "[opencvfractal] Total: " << duration<double, std::milli>(tEnd-t0).count() << " ms" << std::endl;
-
+    finishStats(stats, start);
     return detected;
 }
 
 
-std::vector<FractalMarker>  FractalMarkerDetector::detect(const cv::Mat &img){
-
-    cv::Mat bwimage,thresImage;
-
-    std::vector<std::pair<int, std::vector<cv::Point2f>>> candidates;
+std::vector<FractalMarker>  FractalMarkerDetector::detect(const cv::Mat &img) const{
+    FractalDetectorWorkspace ws;
+    return detect(img, ws);
+}
 
-    std::vector<FractalMarker> DetectedFractalMarkers;
+std::vector<FractalMarker>  FractalMarkerDetector::detect(const cv::Mat &img, FractalDetectorWorkspace &ws) const{
+    DetectionStats *stats=statsOf(ws);
+    std::chrono::high_resolution_clock::time_point start;
+    if(stats){
+        start=std::chrono::high_resolution_clock::now();
+        *stats=DetectionStats();
+    }
+    _private::StageTimer timer(stats, DetectionStats::GRAY);
 
+    cv::Mat bwimage;
     //first, convert to bw
-    if(img.channels()==3)
-        cv::cvtColor(img,bwimage,cv::COLOR_BGR2GRAY);
+    if(img.channels()==3){
+        cv::cvtColor(img,ws.gray,cv::COLOR_BGR2GRAY);
+        bwimage=ws.gray;
+    }
     else bwimage=img;
+    timer.stop();
+
+    std::vector<FractalMarker> DetectedFractalMarkers=detectMarkers(bwimage, ws, stats);
+    finishStats(stats, start);
+    return DetectedFractalMarkers;
+}
+
+void FractalMarkerDetector::finishStats(DetectionStats *stats, std::chrono::high_resolution_clock::time_point start) const{
+    if(!stats) return;
+    stats->totalMs=std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now()-start).count();
+    if(statsCallback) statsCallback(*stats);
+}
+
+std::vector<FractalMarker> FractalMarkerDetector::detectMarkers(const cv::Mat &bwimage, FractalDetectorWorkspace &ws, DetectionStats *stats) const{
+    cv::Mat &thresImage=ws.thresImage;
+
+    auto &candidates=ws.candidates;
+    candidates.clear();
+
+    std::vector<FractalMarker> DetectedFractalMarkers;
+    _private::StageTimer timer(stats, DetectionStats::THRESHOLD);
 
 
     ///////////////////////////////////////////////////
@@ -764,19 +1159,27 @@ std::vector<FractalMarker>  FractalMarkerDetector::detect(const cv::Mat &img){
     ///////////////////////////////////////////////////
     // compute marker candidates by detecting contours
     //if image is eroded, minSize must be adapted
-    std::vector<std::vector<cv::Point>> contours;
-    std::vector<cv::Point> approxCurve;
+    auto &contours=ws.contours;
+    auto &approxCurve=ws.approxCurve;
+    timer.next(DetectionStats::CONTOURS);
     cv::findContours(thresImage, contours, cv::noArray(), cv::RETR_LIST, cv::CHAIN_APPROX_NONE);
+    if(stats) stats->contours=contours.size();
 
     //analyze  it is a paralelepiped likely to be the marker
     for (unsigned int i = 0; i < contours.size(); i++)
     {
         // check it is a possible element by first checking that is is large enough
-        if (120 > int(contours[i].size())  ) continue;
+        if (120 > int(contours[i].size())  ){
+            if(stats) stats->rejectedSmall++;
+            continue;
+        }
         // can approximate to a convex rect?
         cv::approxPolyDP(contours[i], approxCurve, double(contours[i].size()) * 0.05, true);
 
-        if (approxCurve.size() != 4 || !cv::isContourConvex(approxCurve)) continue;
+        if (approxCurve.size() != 4 || !cv::isContourConvex(approxCurve)){
+            if(stats) stats->rejectedNotQuad++;
+            continue;
+        }
         // add the points
         std::vector<cv::Point2f> markerCandidate;
         for (int j = 0; j < 4; j++)
@@ -784,14 +1187,17 @@ std::vector<FractalMarker>  FractalMarkerDetector::detect(const cv::Mat &img){
 
         //sort corner in clockwise direction
         markerCandidate=sort(markerCandidate);
+        if(stats) stats->quads++;
 
         //extract the code
+        timer.next(DetectionStats::DECODE);
         //obtain the intensities of the bits using homography
 
         std::vector<cv::Point2f> in = {cv::Point2f(0,0), cv::Point2f(1,0), cv::Point2f(1,1), cv::Point2f(0,1)};
         cv::Mat H = cv::getPerspectiveTransform(in, markerCandidate);
 
-        for(auto b_vm:fractalMarkerSet.bits_ids)
+        bool decoded=false,borderFound=false;
+        for(const auto &b_vm:fractalMarkerSet.bits_ids)
         {
             int nbitsWithBorder = sqrt(b_vm.first)+2;
             cv::Mat bits(nbitsWithBorder,nbitsWithBorder,CV_8UC1);
@@ -822,14 +1228,22 @@ std::vector<FractalMarker>  FractalMarkerDetector::detect(const cv::Mat &img){
 
             int id=getMarkerId(bits, nrotations, b_vm.second, fractalMarkerSet);
 
-            if(id==-1) continue;//not a marker
+            if(id!=-2) borderFound=true;
+            if(id<0) continue;//not a marker
             std::rotate(markerCandidate.begin(),markerCandidate.begin() + 4 - nrotations,markerCandidate.end());
             candidates.push_back(std::make_pair(id,markerCandidate));
+            decoded=true;
+        }
+        if(stats && !decoded){
+            if(borderFound) stats->rejectedCode++;
+            else stats->rejectedBorder++;
         }
+        timer.next(DetectionStats::CONTOURS);
     }
 
     ////////////////////////////////////////////
     //remove duplicates
+    timer.next(DetectionStats::DECODE);
     // sort by id and within same id set the largest first
     std::sort(candidates.begin(), candidates.end(),[](const std::pair<int, std::vector<cv::Point2f>> &a,const std::pair<int, std::vector<cv::Point2f>> &b){
         if( a.first<b.first) return true;
@@ -839,7 +1253,9 @@ std::vector<FractalMarker>  FractalMarkerDetector::detect(const cv::Mat &img){
 
      // Using std::unique remove duplicates
        auto ip = std::unique(candidates.begin(), candidates.end(),[](const std::pair<int, std::vector<cv::Point2f>> &a,const std::pair<int, std::vector<cv::Point2f>> &b){return a.first==b.first;});
+       if(stats) stats->rejectedDuplicate=std::distance(ip, candidates.end());
        candidates.resize(std::distance(candidates.begin(), ip));
+       if(stats) stats->candidates=candidates.size();
 
        if(candidates.size()>0){
            ////////////////////////////////////////////
@@ -852,7 +1268,7 @@ std::vector<FractalMarker>  FractalMarkerDetector::detect(const cv::Mat &img){
            // copy back to the markers
            for (unsigned int i = 0; i < candidates.size(); i++)
            {
-               DetectedFractalMarkers.push_back(fractalMarkerSet.fractalMarkerCollection[candidates[i].first]);
+               DetectedFractalMarkers.push_back(fractalMarkerSet.fractalMarkerCollection.at(candidates[i].first));
                for (int c = 0; c < 4; c++) DetectedFractalMarkers[i].push_back(Corners[i * 4 + c]);
            }
        }
@@ -882,10 +1298,10 @@ int FractalMarkerDetector:: getMarkerId(const cv::Mat &bits, int &nrotations, co
 
      //first check that outer is all black
     for(int x=0;x<bits.cols;x++){
-        if( bits.at<uchar>(0,x)!=0)return -1;
-        if( bits.at<uchar>(bits.rows-1,x)!=0)return -1;
-        if( bits.at<uchar>(x,0)!=0)return -1;
-        if( bits.at<uchar>(x,bits.cols-1)!=0)return -1;
+        if( bits.at<uchar>(0,x)!=0)return -2;
+        if( bits.at<uchar>(bits.rows-1,x)!=0)return -2;
+        if( bits.at<uchar>(x,0)!=0)return -2;
+        if( bits.at<uchar>(x,bits.cols-1)!=0)return -2;
     }
 
      //now, get the inner bits wo the black border
@@ -899,7 +1315,7 @@ int FractalMarkerDetector:: getMarkerId(const cv::Mat &bits, int &nrotations, co
     {
         for(auto idx:markersId)
         {
-            FractalMarker fm = fmset.fractalMarkerCollection.at(idx);
+            const FractalMarker &fm = fmset.fractalMarkerCollection.at(idx);
 
             //Apply mask to substract submarkers
 
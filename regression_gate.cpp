@@ -0,0 +1,359 @@
+#include <filesystem>
+#include <iostream>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <vector>
+#include <string>
+#include <map>
+#include <opencv2/opencv.hpp>
+#include "nanofractal.h"
+#include "opencv_fractal.h"
+
+// Reruns a dataset and compares it against a baseline CSV written by this tool with --update:
+//
+//   filename,opencv_count,opencv_time_ms,nano_count,nano_time_ms
+//
+// The CSV of test_dir has the same columns, but its times are single runs on all the cores at once and it writes no
+// calibration: it is not accepted as a baseline.
+//
+// - Matched point counts: fails if the count of an image falls more than --count-tolerance (fraction) below the
+//   baseline, or the total count falls more than --total-tolerance.
+// - Times: each run and the baseline are divided by the time of a fixed calibration workload measured on the machine
+//   that produced them (stored next to the baseline in <baseline>.calibration), so baselines can be compared across
+//   machines. Fails if the median or the p90 of the normalized times grows more than --time-tolerance.
+// - Accuracy (optional): with --ground-truth (ground_truth.csv of generate_scenes), fails if the mean distance of the
+//   points found to their true position exceeds --max-error pixels.
+//
+// Exit code: 0 no regression, 1 invalid arguments or files, 2 regression.
+
+struct ImageResult {
+    int opencvCount = 0, nanoCount = 0;
+    double opencvMs = 0, nanoMs = 0;
+};
+
+static double percentile(std::vector<double> v, double p) {
+    if (v.empty()) return 0;
+    std::sort(v.begin(), v.end());
+    double pos = p * (v.size() - 1);
+    size_t i = size_t(pos);
+    if (i + 1 >= v.size()) return v.back();
+    return v[i] + (pos - i) * (v[i + 1] - v[i]);
+}
+
+// Fixed workload similar to the detection (adaptive threshold, contours and FAST on a synthetic image).
+// Returns the median time in ms of several runs.
+static double calibrate() {
+    cv::Mat image(1008, 1344, CV_8UC1);
+    cv::RNG rng(1234);
+    image.setTo(cv::Scalar::all(128));
+    for (int i = 0; i < 400; i++) {
+        cv::Point tl(rng.uniform(0, image.cols), rng.uniform(0, image.rows));
+        cv::rectangle(image, cv::Rect(tl, cv::Size(rng.uniform(5, 80), rng.uniform(5, 80))),
+                      cv::Scalar::all(rng.uniform(0, 256)), cv::FILLED);
+    }
+    cv::Mat thres;
+    std::vector<std::vector<cv::Point>> contours;
+    std::vector<cv::KeyPoint> kpoints;
+    cv::Ptr<cv::FastFeatureDetector> fd = cv::FastFeatureDetector::create();
+    std::vector<double> times;
+    for (int i = 0; i < 15; i++) {
+        auto start = std::chrono::high_resolution_clock::now();
+        cv::adaptiveThreshold(image, thres, 255., cv::ADAPTIVE_THRESH_MEAN_C, cv::THRESH_BINARY_INV, 11, 7);
+        cv::findContours(thres, contours, cv::noArray(), cv::RETR_LIST, cv::CHAIN_APPROX_NONE);
+        fd->detect(image, kpoints);
+        auto end = std::chrono::high_resolution_clock::now();
+        if (i >= 3) times.push_back(std::chrono::duration<double, std::milli>(end - start).count());
+    }
+    return percentile(times, 0.5);
+}
+
+static bool readBaseline(const std::string& path, std::map<std::string, ImageResult>& baseline) {
+    std::ifstream ifs(path);
+    if (!ifs.is_open()) return false;
+    std::string line;
+    std::getline(ifs, line); // skip header
+    for (int lineNumber = 2; std::getline(ifs, line); lineNumber++) {
+        if (line.empty()) continue;
+        std::stringstream ss(line);
+        std::string filename, opencvCount, opencvTime, nanoCount, nanoTime;
+        std::getline(ss, filename, ',');
+        std::getline(ss, opencvCount, ',');
+        std::getline(ss, opencvTime, ',');
+        std::getline(ss, nanoCount, ',');
+        std::getline(ss, nanoTime, ',');
+        ImageResult res;
+        try {
+            res.opencvCount = std::stoi(opencvCount);
+            res.opencvMs = std::stod(opencvTime);
+            res.nanoCount = std::stoi(nanoCount);
+            res.nanoMs = std::stod(nanoTime);
+        } catch (const std::exception&) {
+            std::cerr << "Invalid line " << lineNumber << " of " << path << ": " << line << std::endl;
+            return false;
+        }
+        baseline[filename] = res;
+    }
+    return true;
+}
+
+// ground truth: filename -> (model point -> image point), only visible points
+typedef std::map<std::string, std::vector<std::pair<cv::Point2f, cv::Point2f>>> GroundTruth;
+
+static bool readGroundTruth(const std::string& path, GroundTruth& gt) {
+    std::ifstream ifs(path);
+    if (!ifs.is_open()) return false;
+    std::string line;
+    std::getline(ifs, line); // skip header
+    for (int lineNumber = 2; std::getline(ifs, line); lineNumber++) {
+        std::stringstream ss(line);
+        std::vector<std::string> fields;
+        std::string field;
+        while (std::getline(ss, field, ',')) fields.push_back(field);
+        if (fields.size() < 9 || fields[8] != "1") continue;
+        try {
+            gt[fields[0]].push_back({cv::Point2f(std::stof(fields[4]), std::stof(fields[5])),
+                                     cv::Point2f(std::stof(fields[6]), std::stof(fields[7]))});
+        } catch (const std::exception&) {
+            std::cerr << "Invalid line " << lineNumber << " of " << path << ": " << line << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+// distances of the points found to the true position of their model point
+static void reprojectionErrors(const std::vector<std::pair<cv::Point2f, cv::Point2f>>& gt, const std::vector<cv::Point3f>& p3d,
+                               const std::vector<cv::Point2f>& p2d, std::vector<double>& errors) {
+    for (size_t i = 0; i < p3d.size(); i++)
+        for (const auto& g : gt)
+            if (std::abs(g.first.x - p3d[i].x) < 1e-4 && std::abs(g.first.y - p3d[i].y) < 1e-4) {
+                errors.push_back(cv::norm(g.second - p2d[i]));
+                break;
+            }
+}
+
+static void usage(const char* name) {
+    std::cerr << "Usage: " << name << " <directory_path> <baseline.csv> [--config FRACTAL_4L_6] [--reps 3]\n"
+              << "          [--count-tolerance 0.05] [--total-tolerance 0.02] [--time-tolerance 0.15]\n"
+              << "          [--ground-truth ground_truth.csv] [--max-error 1.0] [--update]" << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 3) {
+        usage(argv[0]);
+        return 1;
+    }
+    std::filesystem::path folder(argv[1]);
+    std::string baselinePath = argv[2], config = "FRACTAL_4L_6", gtPath;
+    int reps = 3;
+    double countTolerance = 0.05, totalTolerance = 0.02, timeTolerance = 0.15, maxError = 1.0;
+    bool update = false;
+    try {
+        for (int i = 3; i < argc; i++) {
+            std::string arg = argv[i];
+            if (arg == "--update") {
+                update = true;
+                continue;
+            }
+            if (i + 1 >= argc) {
+                usage(argv[0]);
+                return 1;
+            }
+            std::string value = argv[++i];
+            if (arg == "--config") config = value;
+            else if (arg == "--reps") reps = std::max(1, std::stoi(value));
+            else if (arg == "--count-tolerance") countTolerance = std::stod(value);
+            else if (arg == "--total-tolerance") totalTolerance = std::stod(value);
+            else if (arg == "--time-tolerance") timeTolerance = std::stod(value);
+            else if (arg == "--ground-truth") gtPath = value;
+            else if (arg == "--max-error") maxError = std::stod(value);
+            else {
+                usage(argv[0]);
+                return 1;
+            }
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Invalid argument: " << e.what() << std::endl;
+        return 1;
+    }
+    if (!std::filesystem::exists(folder) || !std::filesystem::is_directory(folder)) {
+        std::cerr << "Invalid directory: " << folder.string() << std::endl;
+        return 1;
+    }
+
+    std::map<std::string, ImageResult> baseline;
+    if (!update && !readBaseline(baselinePath, baseline)) {
+        std::cerr << "Failed to read baseline file: " << baselinePath << std::endl;
+        return 1;
+    }
+    GroundTruth groundTruth;
+    if (!gtPath.empty() && !readGroundTruth(gtPath, groundTruth)) {
+        std::cerr << "Failed to read ground truth file: " << gtPath << std::endl;
+        return 1;
+    }
+
+    double baselineCalibrationMs = 0;
+    std::string calibrationPath = baselinePath + ".calibration";
+    if (!update) {
+        std::ifstream ifs(calibrationPath);
+        if (!(ifs >> baselineCalibrationMs) || baselineCalibrationMs <= 0) {
+            std::cerr << "No calibration for the baseline (" << calibrationPath
+                      << "): create the baseline with --update" << std::endl;
+            return 1;
+        }
+    }
+    double calibrationMs = calibrate();
+    std::cout << "Calibration: " << calibrationMs << " ms (baseline " << baselineCalibrationMs << " ms)" << std::endl;
+
+    // detection of the whole dataset
+    nanofractal::FractalMarkerDetector nanoDetector;
+    nanoDetector.setParams(config);
+    opencvfractal::FractalMarkerDetector opencvDetector;
+    opencvDetector.setParams(config);
+    nanofractal::FractalDetectorWorkspace nanoWs;
+    opencvfractal::FractalDetectorWorkspace opencvWs;
+
+    std::vector<std::filesystem::path> files;
+    for (const auto& entry : std::filesystem::directory_iterator(folder))
+        if (entry.is_regular_file() && entry.path().extension() == ".jpg") files.push_back(entry.path());
+    std::sort(files.begin(), files.end());
+
+    std::map<std::string, ImageResult> current;
+    std::vector<double> nanoErrors, opencvErrors;
+    for (const auto& path : files) {
+        cv::Mat image = cv::imread(path.string());
+        if (image.empty()) {
+            std::cerr << "Failed to read image: " << path.string() << std::endl;
+            continue;
+        }
+        std::string filename = path.filename().string();
+        ImageResult res;
+        res.opencvMs = res.nanoMs = std::numeric_limits<double>::max();
+        std::vector<cv::Point3f> nanoP3d, opencvP3d;
+        std::vector<cv::Point2f> nanoP2d, opencvP2d;
+        // the fastest of several runs is the least disturbed by the rest of the system
+        for (int r = 0; r < reps; r++) {
+            nanoP3d.clear();
+            nanoP2d.clear();
+            auto start = std::chrono::high_resolution_clock::now();
+            nanoDetector.detect(image, nanoP3d, nanoP2d, nanoWs);
+            auto end = std::chrono::high_resolution_clock::now();
+            res.nanoMs = std::min(res.nanoMs, std::chrono::duration<double, std::milli>(end - start).count());
+
+            opencvP3d.clear();
+            opencvP2d.clear();
+            start = std::chrono::high_resolution_clock::now();
+            opencvDetector.detect(image, opencvP3d, opencvP2d, opencvWs);
+            end = std::chrono::high_resolution_clock::now();
+            res.opencvMs = std::min(res.opencvMs, std::chrono::duration<double, std::milli>(end - start).count());
+        }
+        res.nanoCount = nanoP3d.size();
+        res.opencvCount = opencvP3d.size();
+        current[filename] = res;
+
+        auto gt = groundTruth.find(filename);
+        if (gt != groundTruth.end()) {
+            reprojectionErrors(gt->second, nanoP3d, nanoP2d, nanoErrors);
+            reprojectionErrors(gt->second, opencvP3d, opencvP2d, opencvErrors);
+        }
+    }
+    if (current.empty()) {
+        std::cerr << "No images found in: " << folder.string() << std::endl;
+        return 1;
+    }
+
+    if (update) {
+        std::ofstream ofs(baselinePath);
+        std::ofstream calib(calibrationPath);
+        if (!ofs.is_open() || !calib.is_open()) {
+            std::cerr << "Failed to open output file: " << baselinePath << std::endl;
+            return 1;
+        }
+        ofs << "filename,opencv_count,opencv_time_ms,nano_count,nano_time_ms" << std::endl;
+        for (const auto& r : current)
+            ofs << r.first << "," << r.second.opencvCount << "," << r.second.opencvMs << "," << r.second.nanoCount << ","
+                << r.second.nanoMs << std::endl;
+        calib << calibrationMs << std::endl;
+        std::cout << "Baseline saved to: " << baselinePath << std::endl;
+        return 0;
+    }
+
+    ///////////////////////////////////////////////////
+    // comparison
+    bool regression = false;
+    auto fail = [&](const std::string& msg) {
+        std::cout << "REGRESSION: " << msg << std::endl;
+        regression = true;
+    };
+
+    int baseNano = 0, baseOpencv = 0, curNano = 0, curOpencv = 0, compared = 0;
+    std::vector<double> baseNanoT, baseOpencvT, curNanoT, curOpencvT;
+    for (const auto& r : current) {
+        auto b = baseline.find(r.first);
+        if (b == baseline.end()) {
+            std::cout << "Not in the baseline, skipped: " << r.first << std::endl;
+            continue;
+        }
+        compared++;
+        const ImageResult &cur = r.second, &base = b->second;
+        if (cur.nanoCount < base.nanoCount * (1 - countTolerance))
+            fail(r.first + " nano count " + std::to_string(cur.nanoCount) + " < baseline " + std::to_string(base.nanoCount));
+        if (cur.opencvCount < base.opencvCount * (1 - countTolerance))
+            fail(r.first + " opencv count " + std::to_string(cur.opencvCount) + " < baseline " + std::to_string(base.opencvCount));
+        baseNano += base.nanoCount;
+        baseOpencv += base.opencvCount;
+        curNano += cur.nanoCount;
+        curOpencv += cur.opencvCount;
+        baseNanoT.push_back(base.nanoMs / baselineCalibrationMs);
+        baseOpencvT.push_back(base.opencvMs / baselineCalibrationMs);
+        curNanoT.push_back(cur.nanoMs / calibrationMs);
+        curOpencvT.push_back(cur.opencvMs / calibrationMs);
+    }
+    for (const auto& b : baseline)
+        if (!current.count(b.first)) fail("missing image " + b.first);
+    if (compared == 0) {
+        std::cerr << "No image in common with the baseline" << std::endl;
+        return 1;
+    }
+
+    std::cout << std::fixed << std::setprecision(3);
+    std::cout << "Images compared: " << compared << std::endl;
+    std::cout << "Total points nano: " << curNano << " (baseline " << baseNano << "), opencv: " << curOpencv
+              << " (baseline " << baseOpencv << ")" << std::endl;
+    if (curNano < baseNano * (1 - totalTolerance)) fail("total nano count");
+    if (curOpencv < baseOpencv * (1 - totalTolerance)) fail("total opencv count");
+
+    auto compareTimes = [&](const std::string& name, const std::vector<double>& base, const std::vector<double>& cur) {
+        for (double p : {0.5, 0.9}) {
+            double b = percentile(base, p), c = percentile(cur, p);
+            std::cout << name << " p" << int(p * 100) << " time: " << c * calibrationMs << " ms normalized " << c
+                      << " (baseline " << b << ", " << std::showpos << (b > 0 ? 100 * (c / b - 1) : 0) << std::noshowpos
+                      << "%)" << std::endl;
+            if (c > b * (1 + timeTolerance)) fail(name + " p" + std::to_string(int(p * 100)) + " time");
+        }
+    };
+    compareTimes("nano", baseNanoT, curNanoT);
+    compareTimes("opencv", baseOpencvT, curOpencvT);
+
+    if (!gtPath.empty()) {
+        auto checkErrors = [&](const std::string& name, const std::vector<double>& errors) {
+            if (errors.empty()) {
+                fail(name + ": no point matched the ground truth");
+                return;
+            }
+            double mean = 0;
+            for (double e : errors) mean += e;
+            mean /= errors.size();
+            std::cout << name << " reprojection error: mean " << mean << " px, p95 " << percentile(errors, 0.95)
+                      << " px (" << errors.size() << " points)" << std::endl;
+            if (mean > maxError) fail(name + " mean reprojection error");
+        };
+        checkErrors("nano", nanoErrors);
+        checkErrors("opencv", opencvErrors);
+    }
+
+    std::cout << (regression ? "FAILED" : "PASSED") << std::endl;
+    return regression ? 2 : 0;
+}
@@ -2,18 +2,120 @@
 #include <iostream>
 #include <chrono>
 #include <fstream>
+#include <iomanip>
 #include <vector>
 #include <string>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <algorithm>
 #include <opencv2/opencv.hpp>
 #include "nanofractal.h"
 #include "opencv_fractal.h"
 
+// Runs both detectors on every .jpg of a directory and writes output_<dir>.csv:
+//
+//   filename,opencv_count,opencv_time_ms,nano_count,nano_time_ms
+//
+// Images are decoded in background threads into a bounded prefetch queue, and consumed by worker threads that keep
+// their detectors and workspaces for the whole run. Only the detect() calls are timed. The annotated images
+// (<dir>/opencv/ and <dir>/nano/, read by show_diff) are written by another thread, unless --no-annotate.
+// Rows are written in filename order. Use --threads 1 for timings free from contention between workers.
+
+// Bounded multi-producer multi-consumer queue. pop() returns false once the queue is closed and empty
+template <typename T>
+class BlockingQueue {
+public:
+    explicit BlockingQueue(size_t capacity) : _capacity(std::max<size_t>(1, capacity)) {}
+
+    void push(T item) {
+        std::unique_lock<std::mutex> lock(_mtx);
+        _notFull.wait(lock, [&] { return _items.size() < _capacity; });
+        _items.push_back(std::move(item));
+        _notEmpty.notify_one();
+    }
+    bool pop(T& item) {
+        std::unique_lock<std::mutex> lock(_mtx);
+        _notEmpty.wait(lock, [&] { return !_items.empty() || _closed; });
+        if (_items.empty()) return false;
+        item = std::move(_items.front());
+        _items.pop_front();
+        _notFull.notify_one();
+        return true;
+    }
+    void close() {
+        std::unique_lock<std::mutex> lock(_mtx);
+        _closed = true;
+        _notEmpty.notify_all();
+    }
+
+private:
+    size_t _capacity;
+    std::deque<T> _items;
+    bool _closed = false;
+    std::mutex _mtx;
+    std::condition_variable _notEmpty, _notFull;
+};
+
+struct DecodedImage {
+    size_t index = 0;
+    cv::Mat image;
+};
+
+struct Annotation {
+    std::string path;
+    cv::Mat image;
+};
+
+struct ImageResult {
+    bool valid = false;
+    size_t opencvCount = 0, nanoCount = 0;
+    double opencvMs = 0, nanoMs = 0;
+};
+
+static void usage(const char* name) {
+    std::cerr << "Usage: " << name << " <directory_path> [--config FRACTAL_4L_6] [--threads N] [--decoders 2]"
+              << " [--prefetch 16] [--no-annotate]" << std::endl;
+}
+
 int main(int argc, char* argv[]) {
     if (argc < 2) {
-        std::cerr << "Usage: " << argv[0] << " <directory_path>" << std::endl;
+        usage(argv[0]);
         return 1;
     }
     std::string dirPath = argv[1];
+    std::string config = "FRACTAL_4L_6";
+    int nThreads = std::max(1u, std::thread::hardware_concurrency());
+    int nDecoders = 2, prefetch = 16;
+    bool annotate = true;
+    try {
+        for (int i = 2; i < argc; i++) {
+            std::string arg = argv[i];
+            if (arg == "--no-annotate") {
+                annotate = false;
+                continue;
+            }
+            if (i + 1 >= argc) {
+                usage(argv[0]);
+                return 1;
+            }
+            std::string value = argv[++i];
+            if (arg == "--config") config = value;
+            else if (arg == "--threads") nThreads = std::max(1, std::stoi(value));
+            else if (arg == "--decoders") nDecoders = std::max(1, std::stoi(value));
+            else if (arg == "--prefetch") prefetch = std::max(1, std::stoi(value));
+            else {
+                usage(argv[0]);
+                return 1;
+            }
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Invalid argument: " << e.what() << std::endl;
+        return 1;
+    }
+
     std::filesystem::path folder(dirPath);
     if (!std::filesystem::exists(folder) || !std::filesystem::is_directory(folder)) {
         std::cerr << "Invalid directory: " << dirPath << std::endl;
@@ -27,75 +129,144 @@ int main(int argc, char* argv[]) {
         std::cerr << "Failed to open output file: " << outputFile << std::endl;
         return 1;
     }
-    ofs << "filename,opencv_count,opencv_time_ms,nano_count,nano_time_ms" << std::endl;
 
-    for (const auto& entry : std::filesystem::directory_iterator(folder)) {
-        if (!entry.is_regular_file()) continue;
-        std::string filePath = entry.path().string();
-        if (entry.path().extension() != ".jpg") continue;
-
-        cv::Mat image = cv::imread(filePath);
-        if (image.empty()) {
-            std::cerr << "Failed to read image: " << filePath << std::endl;
-            continue;
-        }
+    std::vector<std::filesystem::path> files;
+    for (const auto& entry : std::filesystem::directory_iterator(folder))
+        if (entry.is_regular_file() && entry.path().extension() == ".jpg") files.push_back(entry.path());
+    std::sort(files.begin(), files.end());
 
-        // OpenCV version
-        cv::Mat opencvImage = image.clone();
-        opencvfractal::FractalMarkerDetector opencvDetector;
-        opencvDetector.setParams("FRACTAL_4L_6");
-        std::vector<cv::Point3f> opencvPoints3D;
-        std::vector<cv::Point2f> opencvPoints2D;
-        auto opencvStart = std::chrono::high_resolution_clock::now();
-        std::vector<opencvfractal::FractalMarker> opencvMarkers = opencvDetector.detect(opencvImage, opencvPoints3D, opencvPoints2D);
-        auto opencvEnd = std::chrono::high_resolution_clock::now();
-        double opencvTime = std::chrono::duration<double, std::milli>(opencvEnd - opencvStart).count();
-
-        for (const auto& marker : opencvMarkers) {
-            marker.draw(opencvImage);
-        }
-        for (const auto& point : opencvPoints2D) {
-            cv::circle(opencvImage, point, 5, cv::Scalar(0, 255, 0), cv::FILLED);
-        }
-        // 保存到 opencv 文件夹
-        std::filesystem::path opencvDir = entry.path().parent_path() / "opencv";
-        if (!std::filesystem::exists(opencvDir)) {
-            std::filesystem::create_directory(opencvDir);
-        }
-        std::string opencvOutput = (opencvDir / entry.path().filename()).string();
-        cv::imwrite(opencvOutput, opencvImage);
-
-        // Nano version
-        cv::Mat nanoImage = image.clone();
-        nanofractal::FractalMarkerDetector nanoDetector;
-        nanoDetector.setParams("FRACTAL_4L_6");
-        std::vector<cv::Point3f> nanoPoints3D;
-        std::vector<cv::Point2f> nanoPoints2D;
-        auto nanoStart = std::chrono::high_resolution_clock::now();
-        std::vector<nanofractal::FractalMarker> nanoMarkers = nanoDetector.detect(nanoImage, nanoPoints3D, nanoPoints2D);
-        auto nanoEnd = std::chrono::high_resolution_clock::now();
-        double nanoTime = std::chrono::duration<double, std::milli>(nanoEnd - nanoStart).count();
-
-        for (const auto& marker : nanoMarkers) {
-            marker.draw(nanoImage);
-        }
-        for (const auto& point : nanoPoints2D) {
-            cv::circle(nanoImage, point, 5, cv::Scalar(0, 255, 0), cv::FILLED);
-        }
-        // 保存到 nano 文件夹
-        std::filesystem::path nanoDir = entry.path().parent_path() / "nano";
-        if (!std::filesystem::exists(nanoDir)) {
-            std::filesystem::create_directory(nanoDir);
-        }
-        std::string nanoOutput = (nanoDir / entry.path().filename()).string();
-        cv::imwrite(nanoOutput, nanoImage);
+    std::filesystem::path opencvDir = folder / "opencv", nanoDir = folder / "nano";
+    if (annotate) {
+        std::filesystem::create_directories(opencvDir);
+        std::filesystem::create_directories(nanoDir);
+    }
 
-        ofs << entry.path().filename().string() << ","
-            << opencvPoints3D.size() << "," << opencvTime << ","
-            << nanoPoints3D.size() << "," << nanoTime << std::endl;
+    // detectors are configured once and copied to each worker
+    opencvfractal::FractalMarkerDetector opencvDetector;
+    nanofractal::FractalMarkerDetector nanoDetector;
+    try {
+        opencvDetector.setParams(config);
+        nanoDetector.setParams(config);
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return -1;
     }
 
+    BlockingQueue<DecodedImage> decoded(prefetch);
+    BlockingQueue<Annotation> annotations(prefetch * 2);
+    std::vector<ImageResult> results(files.size());
+    std::atomic<size_t> nextFile{0};
+    std::atomic<bool> failed{false};
+
+    auto start = std::chrono::high_resolution_clock::now();
+
+    // decoders: take the files in order, so the queue is filled roughly in filename order
+    std::vector<std::thread> decoders;
+    for (int d = 0; d < nDecoders; d++)
+        decoders.emplace_back([&] {
+            for (size_t i = nextFile++; i < files.size(); i = nextFile++) {
+                DecodedImage item;
+                item.index = i;
+                item.image = cv::imread(files[i].string());
+                if (item.image.empty()) {
+                    std::cerr << "Failed to read image: " << files[i].string() << std::endl;
+                    continue;
+                }
+                decoded.push(std::move(item));
+            }
+        });
+
+    // writer of the annotated images
+    std::thread writer;
+    if (annotate)
+        writer = std::thread([&] {
+            Annotation item;
+            while (annotations.pop(item))
+                if (!cv::imwrite(item.path, item.image)) std::cerr << "Failed to write image: " << item.path << std::endl;
+        });
+
+    std::vector<std::thread> workers;
+    for (int w = 0; w < nThreads; w++)
+        workers.emplace_back([&, opencvDetector, nanoDetector] {
+            opencvfractal::FractalDetectorWorkspace opencvWs;
+            nanofractal::FractalDetectorWorkspace nanoWs;
+            std::vector<cv::Point3f> opencvPoints3D, nanoPoints3D;
+            std::vector<cv::Point2f> opencvPoints2D, nanoPoints2D;
+            DecodedImage item;
+            while (decoded.pop(item)) {
+                try {
+                    // OpenCV version
+                    opencvPoints3D.clear();
+                    opencvPoints2D.clear();
+                    auto opencvStart = std::chrono::high_resolution_clock::now();
+                    std::vector<opencvfractal::FractalMarker> opencvMarkers =
+                        opencvDetector.detect(item.image, opencvPoints3D, opencvPoints2D, opencvWs);
+                    auto opencvEnd = std::chrono::high_resolution_clock::now();
+
+                    // Nano version
+                    nanoPoints3D.clear();
+                    nanoPoints2D.clear();
+                    auto nanoStart = std::chrono::high_resolution_clock::now();
+                    std::vector<nanofractal::FractalMarker> nanoMarkers =
+                        nanoDetector.detect(item.image, nanoPoints3D, nanoPoints2D, nanoWs);
+                    auto nanoEnd = std::chrono::high_resolution_clock::now();
+
+                    ImageResult& res = results[item.index];
+                    res.opencvCount = opencvPoints3D.size();
+                    res.opencvMs = std::chrono::duration<double, std::milli>(opencvEnd - opencvStart).count();
+                    res.nanoCount = nanoPoints3D.size();
+                    res.nanoMs = std::chrono::duration<double, std::milli>(nanoEnd - nanoStart).count();
+                    res.valid = true;
+
+                    if (annotate) {
+                        // the decoded image is not needed anymore: it becomes the nano annotation
+                        cv::Mat opencvImage = item.image.clone();
+                        for (const auto& marker : opencvMarkers) marker.draw(opencvImage);
+                        for (const auto& point : opencvPoints2D)
+                            cv::circle(opencvImage, point, 5, cv::Scalar(0, 255, 0), cv::FILLED);
+                        for (const auto& marker : nanoMarkers) marker.draw(item.image);
+                        for (const auto& point : nanoPoints2D)
+                            cv::circle(item.image, point, 5, cv::Scalar(0, 255, 0), cv::FILLED);
+                        std::string filename = files[item.index].filename().string();
+                        annotations.push({(opencvDir / filename).string(), opencvImage});
+                        annotations.push({(nanoDir / filename).string(), item.image});
+                    }
+                } catch (const std::exception& e) {
+                    std::cerr << "Error: " << files[item.index].string() << ": " << e.what() << std::endl;
+                    failed = true;
+                }
+            }
+        });
+
+    for (auto& th : decoders) th.join();
+    decoded.close();
+    for (auto& th : workers) th.join();
+    auto end = std::chrono::high_resolution_clock::now();
+    annotations.close();
+    if (writer.joinable()) writer.join();
+
+    ofs << "filename,opencv_count,opencv_time_ms,nano_count,nano_time_ms" << std::endl;
+    std::vector<double> opencvTimes, nanoTimes;
+    for (size_t i = 0; i < files.size(); i++) {
+        const ImageResult& res = results[i];
+        if (!res.valid) continue;
+        ofs << files[i].filename().string() << "," << res.opencvCount << "," << res.opencvMs << "," << res.nanoCount
+            << "," << res.nanoMs << std::endl;
+        opencvTimes.push_back(res.opencvMs);
+        nanoTimes.push_back(res.nanoMs);
+    }
     ofs.close();
-    // std::cout << "Results saved to: " << outputFile << std::endl;
-    return 0;
+
+    double wallS = std::chrono::duration<double>(end - start).count();
+    auto median = [](std::vector<double> v) {
+        if (v.empty()) return 0.;
+        std::nth_element(v.begin(), v.begin() + v.size() / 2, v.end());
+        return v[v.size() / 2];
+    };
+    std::cout << std::fixed << std::setprecision(2) << opencvTimes.size() << " images in " << wallS << " s ("
+              << (wallS > 0 ? opencvTimes.size() / wallS : 0.) << " images/s, " << nThreads << " workers)"
+              << ", median detect opencv " << median(opencvTimes) << " ms, nano " << median(nanoTimes) << " ms"
+              << std::endl;
+    std::cout << "Results saved to: " << outputFile << std::endl;
+    return failed ? -1 : 0;
 }